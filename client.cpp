@@ -46,65 +46,52 @@
 
 #include <math.h>
 #include <algorithm>
+#include <stdexcept>
 
 #include "client.h"
+#include "shard_connection.h"
+#include "cluster.h"
+#include "ketama.h"
 #include "obj_gen.h"
 #include "memtier_benchmark.h"
+#include "io_uring_engine.h"
 
-float get_2_meaningful_digits(float val)
+inline uint64_t ts_factorial_average(uint64_t a, uint64_t b, unsigned int weight)
 {
-    float log = floor(log10(val));
-    float factor = pow(10, log-1); // to save 2 digits
-    float new_val = round( val / factor);
-    new_val *= factor;
-    return new_val;
-}
-
-void client_event_handler(evutil_socket_t sfd, short evtype, void *opaque)
-{
-    client *c = (client *) opaque;
-
-    assert(c != NULL);
-    assert(c->get_sockfd() == sfd);
-
-    c->handle_event(evtype);
+    double factor = ((double)weight - 1) / weight;
+    return factor * a + (double)b / weight;
 }
 
-inline long long int ts_diff(struct timeval a, struct timeval b)
+client::split_request::split_request(unsigned int parts, unsigned int keys)
+    : m_parts(parts), m_refs(parts), m_keys(keys), m_bytes(0), m_hits(0)
 {
-    unsigned long long aval = a.tv_sec * 1000000 + a.tv_usec;
-    unsigned long long bval = b.tv_sec * 1000000 + b.tv_usec;
-
-    return bval - aval;
 }
 
-inline unsigned long int ts_diff_now(struct timeval a)
+client::command_args::command_args(const char *key, unsigned int key_len, const char *value,
+    unsigned int value_len, unsigned int expiry, bool copy_value)
+    : m_key(key, key_len), m_value(value), m_value_len(value_len), m_expiry(expiry)
 {
-    struct timeval b;
-
-    gettimeofday(&b, NULL);
-    unsigned long long aval = a.tv_sec * 1000000 + a.tv_usec;
-    unsigned long long bval = b.tv_sec * 1000000 + b.tv_usec;
-
-    return bval - aval;
+    if (copy_value && value != NULL) {
+        m_value_copy.assign(value, value_len);
+        m_value = m_value_copy.data();
+    }
 }
 
-inline timeval timeval_factorial_average(timeval a, timeval b, unsigned int weight)
+client::request::request(request_type type, unsigned int size, uint64_t sent_time, unsigned int keys)
+    : m_type(type), m_sent_time(sent_time), m_write_end(0), m_write_time(0), m_first_byte_time(0),
+      m_size(size), m_keys(keys), m_args(NULL), m_redirects(0), m_split(NULL)
 {
-    timeval tv;
-    double factor = ((double)weight - 1) / weight;
-    tv.tv_sec   = factor * a.tv_sec  + (double)b.tv_sec  / weight ;
-    tv.tv_usec  = factor * a.tv_usec + (double)b.tv_usec / weight ;
-    return (tv);
 }
 
-client::request::request(request_type type, unsigned int size, struct timeval* sent_time, unsigned int keys)
-    : m_type(type), m_size(size), m_keys(keys)
+client::request::~request(void)
 {
-    if (sent_time != NULL)
-        m_sent_time = *sent_time;
-    else {
-        gettimeofday(&m_sent_time, NULL);
+    if (m_args != NULL) {
+        delete m_args;
+        m_args = NULL;
+    }
+    if (m_split != NULL && --m_split->m_refs == 0) {
+        delete m_split;
+        m_split = NULL;
     }
 }
 
@@ -113,24 +100,32 @@ bool client::setup_client(benchmark_config *config, abstract_protocol *protocol,
     m_config = config;
     assert(m_config != NULL);
 
-    if (m_config->unix_socket) {
-        m_unix_sockaddr = (struct sockaddr_un *) malloc(sizeof(struct sockaddr_un));
-        assert(m_unix_sockaddr != NULL);
+    m_base_protocol = protocol;
+    assert(m_base_protocol != NULL);
 
-        m_unix_sockaddr->sun_family = AF_UNIX;
-        strncpy(m_unix_sockaddr->sun_path, m_config->unix_socket, sizeof(m_unix_sockaddr->sun_path)-1);
-        m_unix_sockaddr->sun_path[sizeof(m_unix_sockaddr->sun_path)-1] = '\0';
-    }
-
-    m_read_buf = evbuffer_new();
-    assert(m_read_buf != NULL);
+    // in cluster mode there is a connection to every node, and keys are
+    // sent to the node serving their slot
+    if (m_config->cluster_slots != NULL) {
+        const cluster_slot_map *map = m_config->cluster_slots;
 
-    m_write_buf = evbuffer_new();
-    assert(m_write_buf != NULL);    
-
-    m_protocol = protocol->clone();
-    assert(m_protocol != NULL);
-    m_protocol->set_buffers(m_read_buf, m_write_buf);
+        for (unsigned int i = 0; i < map->get_nodes_count(); i++) {
+            const cluster_slot_map::node& n = map->get_node(i);
+            add_connection(n.m_addr, false, n.m_name.c_str());
+        }
+        m_slot_connections = map->get_slots();
+    } else if (m_config->server_pool != NULL) {
+        // likewise with a server pool, keys are sent to the server the
+        // continuum maps them to; connections are in the pool's order
+        const ketama_continuum *pool = m_config->server_pool;
+
+        for (unsigned int i = 0; i < pool->get_servers_count(); i++) {
+            const ketama_continuum::server& s = pool->get_server_info(i);
+            add_connection(s.m_addr, false, s.m_name.c_str());
+            m_server_keylists.push_back(new keylist(m_config->multi_key_get + 1));
+        }
+    } else {
+        add_connection(m_config->server_addr, false, "");
+    }
 
     m_obj_gen = objgen->clone();
     assert(m_obj_gen != NULL);
@@ -158,20 +153,40 @@ bool client::setup_client(benchmark_config *config, abstract_protocol *protocol,
     return true;
 }
 
+void client_rate_event_handler(evutil_socket_t sfd, short evtype, void *opaque)
+{
+    client *c = (client *) opaque;
+
+    assert(c != NULL);
+    c->m_now = clock_now();
+    c->handle_rate_event();
+}
+
 client::client(client_group* group) : 
-    m_sockfd(-1), m_unix_sockaddr(NULL), m_event(NULL), m_event_base(NULL),
-    m_read_buf(NULL), m_write_buf(NULL), m_initialized(false), m_connected(false),
-    m_authentication(auth_none), m_db_selection(select_none),
-    m_config(NULL), m_protocol(NULL), m_obj_gen(NULL),
+    m_event_base(NULL), m_initialized(false), m_now(0),
+    m_config(NULL), m_base_protocol(NULL), m_keep_value(false), m_obj_gen(NULL),
+    m_pending_requests(0),
     m_reqs_processed(0),
     m_set_ratio_count(0),
-    m_get_ratio_count(0)    
+    m_get_ratio_count(0),
+    m_rate_event(NULL), m_rate_start(0), m_rate_interval(0), m_next_request_offset(0)
 {
     m_event_base = group->get_event_base();
 
     if (!setup_client(group->get_config(), group->get_protocol(), group->get_obj_gen())) {
         return;
     }
+    m_stats.set_live_stats(group->get_live_stats());
+    m_stats.set_keep_time_series(m_config->stats_stream == NULL);
+
+    // the requested rate is shared evenly by all connections
+    if (m_config->request_rate) {
+        m_rate_interval = (double) NSEC_PER_SEC * m_config->clients * m_config->threads / m_config->request_rate;
+        m_rate_random.set_seed(m_config->randomize + m_config->next_client_idx);
+
+        m_rate_event = evtimer_new(m_event_base, client_rate_event_handler, (void *)this);
+        assert(m_rate_event != NULL);
+    }
     
     benchmark_debug_log("new client %p successfully set up.\n", this);
     m_initialized = true;
@@ -181,15 +196,15 @@ client::client(struct event_base *event_base,
     benchmark_config *config,
     abstract_protocol *protocol,
     object_generator *obj_gen) : 
-    m_sockfd(-1), m_unix_sockaddr(NULL), m_event(NULL), m_event_base(NULL),
-    m_read_buf(NULL), m_write_buf(NULL), m_initialized(false), m_connected(false),
-    m_authentication(auth_none), m_db_selection(select_none),
-    m_config(NULL), m_protocol(NULL), m_obj_gen(NULL),
+    m_event_base(NULL), m_initialized(false), m_now(0),
+    m_config(NULL), m_base_protocol(NULL), m_keep_value(false), m_obj_gen(NULL),
+    m_pending_requests(0),
     m_reqs_processed(0),
     m_set_ratio_count(0),
     m_get_ratio_count(0),
     m_tot_set_ops(0),
-    m_tot_wait_ops(0)
+    m_tot_wait_ops(0),
+    m_rate_event(NULL), m_rate_start(0), m_rate_interval(0), m_next_request_offset(0)
 {
     m_event_base = event_base;
     if (!setup_client(config, protocol, obj_gen)) {
@@ -202,34 +217,14 @@ client::client(struct event_base *event_base,
 
 client::~client()
 {
-    if (m_event != NULL) {
-        event_free(m_event);
-        m_event = NULL;
-    }
-    
-    if (m_unix_sockaddr != NULL) {
-        free(m_unix_sockaddr);
-        m_unix_sockaddr = NULL;
-    }
-
-    if (m_read_buf != NULL) {
-        evbuffer_free(m_read_buf);
-        m_read_buf = NULL;
+    for (std::vector<shard_connection*>::iterator i = m_connections.begin(); i != m_connections.end(); i++) {
+        delete *i;
     }
+    m_connections.clear();
 
-    if (m_write_buf != NULL) {
-        evbuffer_free(m_write_buf);
-        m_write_buf = NULL;
-    }
-    
-    if (m_sockfd != -1) {
-        close(m_sockfd);
-        m_sockfd = -1;
-    }
-
-    if (m_protocol != NULL) {
-        delete m_protocol;
-        m_protocol = NULL;
+    if (m_rate_event != NULL) {
+        event_free(m_rate_event);
+        m_rate_event = NULL;
     }
 
     if (m_obj_gen != NULL) {
@@ -241,6 +236,11 @@ client::~client()
         delete m_keylist;
         m_keylist = NULL;
     }
+
+    for (std::vector<keylist*>::iterator i = m_server_keylists.begin(); i != m_server_keylists.end(); i++) {
+        delete *i;
+    }
+    m_server_keylists.clear();
 }
 
 bool client::initialized(void)
@@ -248,243 +248,235 @@ bool client::initialized(void)
     return m_initialized;
 }
 
-void client::disconnect(void)
+shard_connection* client::add_connection(struct server_addr *addr, bool addr_owned, const char *name)
 {
-    if (m_sockfd != -1) {
-        close(m_sockfd);
-        m_sockfd = -1;
-    }
-
-    evbuffer_drain(m_read_buf, evbuffer_get_length(m_read_buf));
-    evbuffer_drain(m_write_buf, evbuffer_get_length(m_write_buf));
+    shard_connection *conn = new shard_connection(this, addr, addr_owned, name, m_base_protocol);
+    assert(conn != NULL);
 
-    int ret = event_del(m_event);
-    assert(ret == 0);
+    conn->get_protocol()->set_keep_value(m_keep_value);
+    if (m_config->cluster_mode || m_config->server_pool != NULL)
+        conn->set_shard_stats(m_stats.get_shard_stats(name));
 
-    m_connected = false;
-    m_authentication = auth_none;
-    m_db_selection = select_none;
+    m_connections.push_back(conn);
+    return conn;
 }
 
-int client::connect(void)
+// returns the connection to host:port, which is set up (but may still be
+// connecting) if the client did not have one yet; NULL on failure.
+shard_connection* client::get_connection(const char *host, unsigned int port)
 {
-    struct connect_info addr;
+    char name[300];
+    snprintf(name, sizeof(name), "%s:%u", host, port);
 
-    // clean up existing socket/buffers
-    if (m_sockfd != -1)
-        close(m_sockfd);
-    evbuffer_drain(m_read_buf, evbuffer_get_length(m_read_buf));
-    evbuffer_drain(m_write_buf, evbuffer_get_length(m_write_buf));
+    for (std::vector<shard_connection*>::iterator i = m_connections.begin(); i != m_connections.end(); i++) {
+        if (strcmp((*i)->get_name(), name) == 0)
+            return *i;
+    }
 
-    if (m_unix_sockaddr != NULL) {
-        m_sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
-        if (m_sockfd < 0) {
-            return -errno;
-        }
-    } else {
-        if (m_config->server_addr->get_connect_info(&addr) != 0) {
-            benchmark_error_log("connect: resolve error: %s\n", m_config->server_addr->get_last_error());
-            return -1;
-        }
+    struct server_addr *addr;
+    try {
+        addr = new server_addr(host, port);
+    } catch (std::runtime_error& e) {
+        benchmark_error_log("%s: error: %s\n", name, e.what());
+        return NULL;
+    }
 
-        // initialize socket
-        m_sockfd = socket(addr.ci_family, addr.ci_socktype, addr.ci_protocol);
-        if (m_sockfd < 0) {
-            return -errno;
-        }
+    benchmark_debug_log("connecting to new node %s.\n", name);
+    shard_connection *conn = add_connection(addr, true, name);
+    if (conn->connect() < 0)
+        return NULL;
 
-        // configure socket behavior
-        struct linger ling = {0, 0};
-        int flags = 1;
-        int error = setsockopt(m_sockfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
-        assert(error == 0);
+    // requests may follow right away, they wait in the buffer behind these
+    conn->send_conn_setup_commands(m_now);
+    return conn;
+}
 
-        error = setsockopt(m_sockfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
-        assert(error == 0);
+void client::set_keep_value(bool flag)
+{
+    m_keep_value = flag;
+    for (std::vector<shard_connection*>::iterator i = m_connections.begin(); i != m_connections.end(); i++) {
+        (*i)->get_protocol()->set_keep_value(flag);
+    }
+}
 
-        error = setsockopt(m_sockfd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags, sizeof(flags));
-        assert(error == 0);
+void client::disconnect(void)
+{
+    for (std::vector<shard_connection*>::iterator i = m_connections.begin(); i != m_connections.end(); i++) {
+        (*i)->disconnect();
     }
-    
-    // set non-blocking behavior
-    int flags = 1;
-    if ((flags = fcntl(m_sockfd, F_GETFL, 0)) < 0 ||
-        fcntl(m_sockfd, F_SETFL, flags | O_NONBLOCK) < 0) {
-            benchmark_error_log("connect: failed to set non-blocking flag.\n");
-            close(m_sockfd);
-            m_sockfd = -1;
-            return -1;
-    }
-
-    // set up event
-    if (!m_event) {
-        m_event = event_new(m_event_base,
-            m_sockfd, EV_WRITE, client_event_handler, (void *)this);    
-        assert(m_event != NULL);
-    } else {
-        int ret = event_del(m_event);
-        assert(ret == 0);
 
-        ret = event_assign(m_event, m_event_base,
-            m_sockfd, EV_WRITE, client_event_handler, (void *)this);
+    if (m_rate_event != NULL) {
+        int ret = event_del(m_rate_event);
         assert(ret == 0);
     }
-    
-    int ret = event_add(m_event, NULL);
-    assert(ret == 0);
+}
 
-    // call connect
-    if (::connect(m_sockfd, 
-        m_unix_sockaddr ? (struct sockaddr *) m_unix_sockaddr : addr.ci_addr,
-        m_unix_sockaddr ? sizeof(struct sockaddr_un) : addr.ci_addrlen) == -1) {
-        if (errno == EINPROGRESS || errno == EWOULDBLOCK)            
-            return 0;
-        benchmark_error_log("connect failed, error = %s\n", strerror(errno));
-        return -1;
+int client::connect(void)
+{
+    for (std::vector<shard_connection*>::iterator i = m_connections.begin(); i != m_connections.end(); i++) {
+        int ret = (*i)->connect();
+        if (ret < 0)
+            return ret;
     }
-    
+
     return 0;
 }
 
-void client::handle_event(short evtype)
+// called by a connection once connected, starts (or resumes) sending requests
+void client::connection_ready(shard_connection *conn)
 {
-    // connect() returning to us?  normally we expect EV_WRITE, but for UNIX domain
-    // sockets we workaround since connect() returned immediately, but we don't want
-    // to do any I/O from the client::connect() call...
-    if (!m_connected && (evtype == EV_WRITE || m_unix_sockaddr != NULL)) {
-        int error = -1;
-        socklen_t errsz = sizeof(error);
+    if (m_stats.get_start_time() == 0) {
+        process_first_request();
+    } else {
+        benchmark_debug_log("connection to %s complete, proceeding with test\n", conn->get_name());
+        fill_pipeline();
+    }
+}
 
-        if (getsockopt(m_sockfd, SOL_SOCKET, SO_ERROR, (void *) &error, &errsz) == -1) {
-            benchmark_error_log("connect: error getting connect response (getsockopt): %s\n", strerror(errno));
-            return;
-        }
+// once the test is over, stops watching the sockets (events are persistent,
+// so the event loop would never run out of them otherwise).
+bool client::stop_if_finished(void)
+{
+    if (!finished())
+        return false;
 
-        if (error != 0) {
-            benchmark_error_log("connect: connection failed: %s\n", strerror(error));
-            return;
-        }
+    // requests still queued past the pipeline depth are never sent
+    for (std::vector<shard_connection*>::iterator i = m_connections.begin(); i != m_connections.end(); i++) {
+        (*i)->stop_watching();
+    }
 
-        m_connected = true;
-        if (!m_reqs_processed) {
-            process_first_request();
-        } else {
-            benchmark_debug_log("reconnection complete, proceeding with test\n");
-            fill_pipeline();
-        }
+    if (m_rate_event != NULL) {
+        int ret = event_del(m_rate_event);
+        assert(ret == 0);
     }
-   
-    assert(m_connected == true);
-    if ((evtype & EV_WRITE) == EV_WRITE && evbuffer_get_length(m_write_buf) > 0) {
-        if (evbuffer_write(m_write_buf, m_sockfd) < 0) {
-            if (errno != EWOULDBLOCK) {
-                benchmark_error_log("write error: %s\n", strerror(errno));
-                disconnect();
 
-                return;
-            }
-        }
+    benchmark_debug_log("nothing else to do, test is finished.\n");
+    m_stats.set_end_time(m_now);
+    return true;
+}
+
+void client::write_pending(void)
+{
+    for (unsigned int i = 0; i < m_connections.size(); i++) {
+        m_connections[i]->write_pending();
     }
+}
 
-    if ((evtype & EV_READ) == EV_READ) {
-        int ret = 1;
-        while (ret > 0) {
-            ret = evbuffer_read(m_read_buf, m_sockfd, -1); 
-        }
+bool client::finished(void)
+{
+    if (m_config->requests > 0 && m_reqs_processed >= m_config->requests)
+        return true;
+    if (m_config->test_time > 0 && m_stats.get_start_time() > 0 &&
+        m_now - m_stats.get_start_time() >= m_config->test_time * NSEC_PER_SEC)
+        return true;
+    return false;    
+}
 
-        if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-            benchmark_error_log("read error: %s\n", strerror(errno));
-            disconnect();
+shard_connection* client::route(const char *key, unsigned int key_len)
+{
+    if (m_config->server_pool != NULL)
+        return m_connections[m_config->server_pool->get_server(key, key_len)];
+    if (m_slot_connections.empty())
+        return m_connections[0];
+    return m_connections[m_slot_connections[cluster_key_slot(key, key_len)]];
+}
 
-            return;
-        }
-        if (ret == 0) {
-            benchmark_error_log("connection dropped.\n");
-            disconnect();
+client::request* client::create_multi_get_request(unsigned int size, uint64_t timestamp, keylist *keys)
+{
+    return new client::request(rt_get, size, timestamp, keys->get_keys_count());
+}
 
-            return;
-        }
-        
-        if (evbuffer_get_length(m_read_buf) > 0) {
-            process_response();
+// sends a multi-get of the keys in m_keylist.  with a server pool, the keys
+// are grouped by server and every server gets a multi-get of its own keys.
+void client::send_multi_get(uint64_t timestamp)
+{
+    if (m_server_keylists.empty()) {
+        shard_connection *conn = m_connections[0];
+        int cmd_size = conn->get_protocol()->write_command_multi_get(m_keylist);
+        push_request(conn, create_multi_get_request(cmd_size, timestamp, m_keylist));
+        return;
+    }
 
-            // process_response may have disconnected, in which case
-            // we just abort and wait for libevent to call us back sometime
-            if (!m_connected) {
-                return;
-            }
-                
-        }
+    for (unsigned int i = 0; i < m_server_keylists.size(); i++) {
+        m_server_keylists[i]->clear();
+    }
+    for (unsigned int i = 0; i < m_keylist->get_keys_count(); i++) {
+        unsigned int key_len;
+        const char *key = m_keylist->get_key(i, &key_len);
+        m_server_keylists[m_config->server_pool->get_server(key, key_len)]->add_key(key, key_len);
     }
 
-    // update event
-    short new_evtype = 0;
-    if (!finished()) {
-        new_evtype = EV_READ;
+    unsigned int parts = 0;
+    for (unsigned int i = 0; i < m_server_keylists.size(); i++) {
+        if (m_server_keylists[i]->get_keys_count() > 0)
+            parts++;
     }
-    if (evbuffer_get_length(m_write_buf) > 0) {
-        if (finished()) {
-            assert(m_config->requests <= 0 && "finished to write all requests but write buffer is not empty");
-            return;
-        }
-        new_evtype |= EV_WRITE;
+
+    // a split multi-get is one pending request, however many parts it has
+    split_request *split = NULL;
+    if (parts > 1) {
+        split = new split_request(parts, m_keylist->get_keys_count());
+        m_pending_requests++;
     }
 
-    if (new_evtype) {
-        int ret = event_assign(m_event, m_event_base,
-            m_sockfd, new_evtype, client_event_handler, (void *)this);
-        assert(ret == 0);
+    for (unsigned int i = 0; i < m_server_keylists.size(); i++) {
+        keylist *keys = m_server_keylists[i];
+        if (keys->get_keys_count() == 0)
+            continue;
 
-        ret = event_add(m_event, NULL);
-        assert(ret == 0);
-    } else {
-        benchmark_debug_log("nothing else to do, test is finished.\n");
-        m_stats.set_end_time(NULL);
+        shard_connection *conn = m_connections[i];
+        int cmd_size = conn->get_protocol()->write_command_multi_get(keys);
+        request *req = create_multi_get_request(cmd_size, timestamp, keys);
+        req->m_split = split;
+        push_request(conn, req);
     }
 }
 
-bool client::finished(void)
+void client::save_command_args(request *req, const char *key, unsigned int key_len,
+    const char *value, unsigned int value_len, unsigned int expiry)
 {
-    if (m_config->requests > 0 && m_reqs_processed >= m_config->requests)
-        return true;
-    if (m_config->test_time > 0 && m_stats.get_duration() >= m_config->test_time)
-        return true;
-    return false;    
+    if (m_slot_connections.empty())
+        return;
+
+    // random data without a value pool: the value buffer changes with every
+    // object generated
+    bool copy_value = m_config->random_data && !m_config->value_pool;
+    req->m_args = new command_args(key, key_len, value, value_len, expiry, copy_value);
 }
 
-bool client::send_conn_setup_commands(struct timeval timestamp)
+void client::push_request(shard_connection *conn, request *req)
 {
-    bool sent = false;
+    conn->push_request(req);
+    if (req->m_split == NULL)
+        m_pending_requests++;
 
-    if (m_config->authenticate && m_authentication != auth_done) {
-        if (m_authentication == auth_none) {
-            benchmark_debug_log("sending authentication command.\n");
-            m_protocol->authenticate(m_config->authenticate);
-            m_pipeline.push(new client::request(rt_auth, 0, &timestamp, 0));
-            m_authentication = auth_sent;
-            sent = true;
+    // requests past the pipeline depth wait in the buffer: quiet commands
+    // in flight must not wait for a batch end queued behind them
+    if (conn->get_queued_requests() >= m_config->pipeline)
+        conn->get_protocol()->write_batch_end();
+}
+
+// sends connection setup commands where needed; true once all connections
+// are ready for requests
+bool client::connections_ready(uint64_t timestamp)
+{
+    bool ready = true;
+
+    for (std::vector<shard_connection*>::iterator i = m_connections.begin(); i != m_connections.end(); i++) {
+        shard_connection *conn = *i;
+
+        if (!conn->is_connected()) {
+            ready = false;
+            continue;
         }
-    }
-    if (m_config->select_db && m_db_selection != select_done) {
-        if (m_db_selection == select_none) {
-            benchmark_debug_log("sending db selection command.\n");
-            m_protocol->select_db(m_config->select_db);
-            m_pipeline.push(new client::request(rt_select_db, 0, &timestamp, 0));
-            m_db_selection = select_sent;
-            sent = true;
+        if (!conn->is_conn_setup_done()) {
+            conn->send_conn_setup_commands(timestamp);
+            if (!conn->is_conn_setup_done())
+                ready = false;
         }
     }
 
-    return sent; 
-}
-
-bool client::is_conn_setup_done(void)
-{
-     if (m_config->authenticate && m_authentication != auth_done)
-         return false;
-     if (m_config->select_db && m_db_selection != select_done)
-         return false;
-     return true;
+    return ready;
 }
 
 /*
@@ -497,11 +489,13 @@ int obj_iter_type(benchmark_config *cfg, unsigned char index)
         return OBJECT_GENERATOR_KEY_RANDOM;
     else if (cfg->key_pattern[index] == 'G')
         return OBJECT_GENERATOR_KEY_GAUSSIAN;
+    else if (cfg->key_pattern[index] == 'Z')
+        return OBJECT_GENERATOR_KEY_ZIPF;
     return OBJECT_GENERATOR_KEY_SET_ITER;
 }
 
 // This function could use some urgent TLC -- but we need to do it without altering the behavior
-void client::create_request(struct timeval timestamp)
+void client::create_request(uint64_t timestamp)
 {
     int cmd_size = 0;
 
@@ -518,8 +512,9 @@ void client::create_request(struct timeval timestamp)
                                   ((m_config->wait_timeout.max - m_config->wait_timeout.min)/2.0) + m_config->wait_timeout.min);
 
         benchmark_debug_log("WAIT num_slaves=%u timeout=%u\n", num_slaves, timeout);
-        cmd_size = m_protocol->write_command_wait(num_slaves, timeout);
-        m_pipeline.push(new client::request(rt_wait, cmd_size, &timestamp, 0));
+        shard_connection *conn = m_connections[0];
+        cmd_size = conn->get_protocol()->write_command_wait(num_slaves, timeout);
+        push_request(conn, new client::request(rt_wait, cmd_size, timestamp, 0));
     }
     // are we set or get? this depends on the ratio
     else if (m_set_ratio_count < m_config->ratio.a) {
@@ -535,10 +530,13 @@ void client::create_request(struct timeval timestamp)
 
         benchmark_debug_log("SET key=[%.*s] value_len=%u expiry=%u\n",
             key_len, key, value_len, obj->get_expiry());
-        cmd_size = m_protocol->write_command_set(key, key_len, value, value_len,
+        shard_connection *conn = route(key, key_len);
+        cmd_size = conn->get_protocol()->write_command_set(key, key_len, value, value_len,
             obj->get_expiry(), m_config->data_offset);
 
-        m_pipeline.push(new client::request(rt_set, cmd_size, &timestamp, 1));
+        request *req = new client::request(rt_set, cmd_size, timestamp, 1);
+        save_command_args(req, key, key_len, value, value_len, obj->get_expiry());
+        push_request(conn, req);
     } else if (m_get_ratio_count < m_config->ratio.b) {
         // get command
         int iter = obj_iter_type(m_config, 2);
@@ -569,9 +567,8 @@ void client::create_request(struct timeval timestamp)
             benchmark_debug_log("MGET %d keys [%.*s] .. [%.*s]\n", 
                 m_keylist->get_keys_count(), first_key_len, first_key, last_key_len, last_key);
 
-            cmd_size = m_protocol->write_command_multi_get(m_keylist);
             m_get_ratio_count += keys_count;
-            m_pipeline.push(new client::request(rt_get, cmd_size, &timestamp, m_keylist->get_keys_count()));
+            send_multi_get(timestamp);
         } else {
             unsigned int keylen;
             const char *key = m_obj_gen->get_key(iter, &keylen);
@@ -579,10 +576,13 @@ void client::create_request(struct timeval timestamp)
             assert(keylen > 0);
             
             benchmark_debug_log("GET key=[%.*s]\n", keylen, key);
-            cmd_size = m_protocol->write_command_get(key, keylen, m_config->data_offset);
+            shard_connection *conn = route(key, keylen);
+            cmd_size = conn->get_protocol()->write_command_get(key, keylen, m_config->data_offset);
 
             m_get_ratio_count++;
-            m_pipeline.push(new client::request(rt_get, cmd_size, &timestamp, 1));
+            request *req = new client::request(rt_get, cmd_size, timestamp, 1);
+            save_command_args(req, key, keylen, NULL, 0, 0);
+            push_request(conn, req);
         }
     } else {
         // overlap counters
@@ -590,35 +590,106 @@ void client::create_request(struct timeval timestamp)
     }        
 }
 
+// true once no more requests should be created for now.  with several
+// connections, --pipeline applies to each of them: requests are created
+// until every connection has that many queued.  keys rarely spread evenly,
+// so a connection may get more, which wait in its buffer until it has room
+// for them (see shard_connection::get_writable_length()); no connection
+// gets more than twice as many, though.
+bool client::pipeline_full(void)
+{
+    if (m_connections.size() == 1)
+        return m_pending_requests >= m_config->pipeline;
+
+    bool full = true;
+    for (std::vector<shard_connection*>::iterator i = m_connections.begin(); i != m_connections.end(); i++) {
+        unsigned int queued = (*i)->get_queued_requests();
+
+        if (queued >= 2 * m_config->pipeline)
+            return true;
+        if (queued < m_config->pipeline)
+            full = false;
+    }
+
+    return full;
+}
+
 void client::fill_pipeline(void)
 {
-    struct timeval now;
-    gettimeofday(&now, NULL);
+    uint64_t now = m_now;
 
-    while (!finished() && m_pipeline.size() < m_config->pipeline) {
-        if (!is_conn_setup_done()) {
-            send_conn_setup_commands(now);
-            return;
-        }
+    while (!finished() && !pipeline_full()) {
+        if (!connections_ready(now))
+            break;
 
         // don't exceed requests
-        if (m_config->requests > 0 && m_reqs_processed + m_pipeline.size() >= m_config->requests)
+        if (m_config->requests > 0 && m_reqs_processed + m_pending_requests >= m_config->requests)
             break;
 
         // if we have reconnect_interval stop enlarging the pipeline
         // on time
         if (m_config->reconnect_interval) {
-            if ((m_reqs_processed % m_config->reconnect_interval) + m_pipeline.size() >= m_config->reconnect_interval)
-                return;
+            if ((m_reqs_processed % m_config->reconnect_interval) + m_pending_requests >= m_config->reconnect_interval)
+                break;
         }
 
-        create_request(now);
+        // in open-loop mode requests are only issued once they are due, and
+        // carry their intended send time so that any delay in sending them
+        // (e.g. a full pipeline) is accounted for as latency.
+        if (m_rate_interval > 0) {
+            uint64_t next_time = get_next_request_time();
+            if (next_time > now) {
+                struct timeval delay = clock_ns_to_timeval(next_time - now);
+
+                int ret = evtimer_add(m_rate_event, &delay);
+                assert(ret == 0);
+                break;
+            }
+
+            create_request(next_time);
+            advance_next_request_time();
+        } else {
+            create_request(now);
+        }
+    }
+
+    // e.g. terminates a run of quiet commands
+    for (unsigned int i = 0; i < m_connections.size(); i++) {
+        m_connections[i]->get_protocol()->write_batch_end();
     }
 }
 
+uint64_t client::get_next_request_time(void)
+{
+    return m_rate_start + (uint64_t) m_next_request_offset;
+}
+
+void client::advance_next_request_time(void)
+{
+    if (m_config->rate_distribution[0] == 'p') {
+        // exponentially distributed inter-arrival times give poisson arrivals
+        double u = m_rate_random.get_random() / ((double) m_rate_random.get_random_max() + 1);
+        m_next_request_offset += -log(1.0 - u) * m_rate_interval;
+    } else {
+        m_next_request_offset += m_rate_interval;
+    }
+}
+
+void client::handle_rate_event(void)
+{
+    if (!m_connections[0]->is_connected())
+        return;
+
+    fill_pipeline();
+    if (stop_if_finished())
+        return;
+
+    write_pending();
+}
+
 int client::prepare(void)
 {       
-    if (!m_unix_sockaddr && (!m_config->server_addr || !m_protocol))
+    if (!m_config->unix_socket && !m_config->server_pool && (!m_config->server_addr || !m_base_protocol))
         return -1;
     
     int ret = this->connect();
@@ -632,38 +703,64 @@ int client::prepare(void)
 
 void client::process_first_request(void)
 {
-    struct timeval now;
+    uint64_t now = m_now;
+
+    m_stats.set_start_time(now);
+
+    // start connections at a random phase, so they don't all fire at once
+    if (m_rate_interval > 0) {
+        m_rate_start = now;
+        m_next_request_offset = m_rate_interval *
+            (m_rate_random.get_random() / ((double) m_rate_random.get_random_max() + 1));
+    }
 
-    gettimeofday(&now, NULL);    
-    m_stats.set_start_time(&now);
     fill_pipeline();
 }
 
-void client::handle_response(struct timeval timestamp, request *request, protocol_response *response)
+// a multi-get split over several servers counts once, when its last part
+// is answered, so its latency is that of the slowest server
+void client::update_get_stats(uint64_t timestamp, request *request, protocol_response *response)
+{
+    split_request *split = request->m_split;
+
+    if (split == NULL) {
+        m_stats.update_get_op(timestamp,
+            request->m_size + response->get_total_len(),
+            timestamp - request->m_sent_time,
+            response->get_hits(),
+            request->m_keys - response->get_hits());
+    } else {
+        split->m_bytes += request->m_size + response->get_total_len();
+        split->m_hits += response->get_hits();
+        if (--split->m_parts == 0) {
+            m_stats.update_get_op(timestamp,
+                split->m_bytes,
+                timestamp - request->m_sent_time,
+                split->m_hits,
+                split->m_keys - split->m_hits);
+        }
+    }
+
+    unsigned int latencies_size = response->get_latencies_count();
+    for (unsigned int i = 0; i < latencies_size; i++) {
+        m_stats.update_get_latency_histogram(response->get_latency());
+    }
+}
+
+void client::handle_response(uint64_t timestamp, request *request, protocol_response *response)
 {
     switch (request->m_type) {
         case rt_get:
-            {
-                m_stats.update_get_op(&timestamp,
-                    request->m_size + response->get_total_len(),
-                    ts_diff(request->m_sent_time, timestamp),
-                    response->get_hits(),
-                    request->m_keys - response->get_hits());
-
-                unsigned int latencies_size = response->get_latencies_count();
-                for (unsigned int i = 0; i < latencies_size; i++) {
-                    m_stats.update_get_latency_map(response->get_latency());
-                }
-            }
+            update_get_stats(timestamp, request, response);
             break;
         case rt_set:
-            m_stats.update_set_op(&timestamp,
+            m_stats.update_set_op(timestamp,
                 request->m_size + response->get_total_len(),
-                ts_diff(request->m_sent_time, timestamp));
+                timestamp - request->m_sent_time);
             break;
         case rt_wait:
-            m_stats.update_wait_op(&timestamp,
-                ts_diff(request->m_sent_time, timestamp));
+            m_stats.update_wait_op(timestamp,
+                timestamp - request->m_sent_time);
             break;
         default:
             assert(0);
@@ -671,70 +768,156 @@ void client::handle_response(struct timeval timestamp, request *request, protoco
     }
 }
 
-void client::process_response(void)
+// only subscribers expect messages
+void client::handle_message(uint64_t timestamp, protocol_response *response)
 {
-    int ret;
-    bool responses_handled = false;
+    benchmark_error_log("error: unexpected pub/sub message received.\n");
+}
 
-    struct timeval now;
-    gettimeofday(&now, NULL);
+// splits the latency of a request, timestamps that were never taken (e.g.
+// a response received before the write completed) count as zero time
+void client::record_latency_breakdown(request *req)
+{
+    uint64_t parsed_time = clock_now();
+    uint64_t write_time = req->m_write_time ? req->m_write_time : req->m_sent_time;
+    uint64_t first_byte_time = req->m_first_byte_time ? req->m_first_byte_time : write_time;
 
-    client::request* req = m_pipeline.front();
-    
-    while ((ret = m_protocol->parse_response(ts_diff_now(req->m_sent_time))) > 0) {
-        bool error = false;
-        protocol_response *r = m_protocol->get_response();
+    if (write_time < req->m_sent_time)
+        write_time = req->m_sent_time;
+    if (first_byte_time < write_time)
+        first_byte_time = write_time;
+    if (parsed_time < first_byte_time)
+        parsed_time = first_byte_time;
 
-        req = m_pipeline.front();
-        m_pipeline.pop();
+    m_stats.update_latency_breakdown(write_time - req->m_sent_time,
+        first_byte_time - write_time,
+        parsed_time - first_byte_time);
+}
 
-        if (req->m_type == rt_auth) {
-            if (r->is_error()) {
-                benchmark_error_log("error: authentication failed [%s]\n", r->get_status());
-                error = true;
-            } else {
-                m_authentication = auth_done;
-                benchmark_debug_log("authentication successful.\n");
-            }
-        } else if (req->m_type == rt_select_db) {
-           if (strcmp(r->get_status(), "+OK") != 0) {
-                benchmark_error_log("database selection failed.\n");
-                error = true;
-            } else {
-                benchmark_debug_log("database selection successful.\n");
-                m_db_selection = select_done;
-            }
-        } else {
-            benchmark_debug_log("handled response (first line): %s, %d hits, %d misses\n",
-                r->get_status(),
-                r->get_hits(),
-                req->m_keys - r->get_hits());
+// in cluster mode, a -MOVED or -ASK reply sends the request to the node it
+// names (connecting to it first if needed), keeping its original send time;
+// the command is written again from the arguments saved with the request.
+// MOVED also updates the client's slot map; the rest of the map is updated
+// the same way, one redirection at a time.  returns false if the reply is
+// not a redirection, or can't be followed (e.g. one redirection too many).
+bool client::redirect_request(shard_connection *conn, request *req, protocol_response *response)
+{
+    const char *status = response->get_status();
+    const char *p;
+    bool ask;
 
-            if (r->is_error()) {
-                benchmark_error_log("error response: %s\n", r->get_status());
-            }
+    if (status == NULL || req->m_args == NULL)
+        return false;
+    if (strncmp(status, "-MOVED ", 7) == 0) {
+        p = status + 7;
+        ask = false;
+    } else if (strncmp(status, "-ASK ", 5) == 0) {
+        p = status + 5;
+        ask = true;
+    } else {
+        return false;
+    }
 
-            handle_response(now, req, r);
-            m_reqs_processed += req->m_keys;
-            responses_handled = true;
-        }
-        delete req;
-        if (error) {
-            return;
+    // <slot> <host>:<port>, where host may be an IPv6 address
+    char *end;
+    unsigned long slot = strtoul(p, &end, 10);
+    if (end == p || *end != ' ' || slot >= CLUSTER_SLOTS)
+        return false;
+    const char *host = end + 1;
+    const char *colon = strrchr(host, ':');
+    if (colon == NULL || colon == host)
+        return false;
+    unsigned long port = strtoul(colon + 1, &end, 10);
+    if (port == 0 || port > 65535)
+        return false;
+
+    // the error reply is accounted for like any other
+    if (req->m_redirects >= CLUSTER_MAX_REDIRECTS) {
+        benchmark_error_log("%s: request redirected more than %u times, dropped.\n",
+            conn->get_name(), CLUSTER_MAX_REDIRECTS);
+        return false;
+    }
+
+    std::string host_name(host, colon - host);
+    shard_connection *target = get_connection(host_name.c_str(), port);
+    if (target == NULL)
+        return false;
+
+    benchmark_debug_log("%s: %s\n", conn->get_name(), status);
+    if (ask) {
+        evbuffer_add(target->m_write_buf, CLUSTER_ASKING_COMMAND, sizeof(CLUSTER_ASKING_COMMAND) - 1);
+        target->push_request(new client::request(rt_asking, 0, req->m_sent_time, 0));
+    } else {
+        for (unsigned int i = 0; i < m_connections.size(); i++) {
+            if (m_connections[i] == target)
+                m_slot_connections[slot] = i;
         }
     }
 
-    if (ret == -1) {
-        benchmark_error_log("error: response parsing failed.\n");
+    const command_args *args = req->m_args;
+    if (args->m_value != NULL)
+        target->get_protocol()->write_command_set(args->m_key.data(), args->m_key.size(),
+            args->m_value, args->m_value_len, args->m_expiry, m_config->data_offset);
+    else
+        target->get_protocol()->write_command_get(args->m_key.data(), args->m_key.size(),
+            m_config->data_offset);
+    req->m_redirects++;
+    req->m_write_time = 0;
+    req->m_first_byte_time = 0;
+    target->push_request(req);
+
+    return true;
+}
+
+// accounts for the response to a request sent by the client; returns false
+// if the request is still outstanding (it was redirected).
+bool client::process_reply(shard_connection *conn, request *req, protocol_response *response)
+{
+    uint64_t now = m_now;
+
+    // once the test is over nothing more is sent, redirected or not
+    if (response->is_error() && !m_slot_connections.empty() && !finished() &&
+        redirect_request(conn, req, response))
+        return false;
+
+    // handle_response() below accounts for the part
+    if (req->m_split == NULL || req->m_split->m_parts == 1)
+        m_pending_requests--;
+
+    if (m_config->latency_breakdown)
+        record_latency_breakdown(req);
+
+    benchmark_debug_log("handled response (first line): %s, %d hits, %d misses\n",
+        response->get_status(),
+        response->get_hits(),
+        req->m_keys - response->get_hits());
+
+    if (response->is_error()) {
+        benchmark_error_log("error response: %s\n", response->get_status());
     }
 
-    if (m_config->reconnect_interval > 0 && responses_handled) {
+    handle_response(now, req, response);
+    m_reqs_processed += req->m_keys;
+
+    if (conn->m_shard_stats != NULL) {
+        conn->m_shard_stats->update_op(req->m_type == rt_get ? req->m_keys : 1,
+            req->m_size + response->get_total_len(),
+            now - req->m_sent_time);
+    }
+
+    return true;
+}
+
+// called by a connection once it processed the responses it read
+void client::responses_processed(bool handled)
+{
+    if (m_config->reconnect_interval > 0 && handled) {
         if ((m_reqs_processed % m_config->reconnect_interval) == 0) {
-            assert(m_pipeline.size() == 0);
+            assert(m_pending_requests == 0);
             benchmark_debug_log("reconnecting, m_reqs_processed = %u\n", m_reqs_processed);
             disconnect();
 
-            ret = connect();
+            int ret = connect();
             assert(ret == 0);
 
             return;
@@ -748,7 +931,7 @@ void client::process_response(void)
 
 verify_client::verify_request::verify_request(request_type type, 
     unsigned int size, 
-    struct timeval* sent_time,
+    uint64_t sent_time,
     unsigned int keys,
     const char *key,
     unsigned int key_len,
@@ -785,7 +968,7 @@ verify_client::verify_client(struct event_base *event_base,
     object_generator *obj_gen) : client(event_base, config, protocol, obj_gen),
     m_finished(false), m_verified_keys(0), m_errors(0)
 {
-    m_protocol->set_keep_value(true);
+    set_keep_value(true);
 }
 
 unsigned long long int verify_client::get_verified_keys(void)
@@ -798,7 +981,7 @@ unsigned long long int verify_client::get_errors(void)
     return m_errors;
 }
 
-void verify_client::create_request(struct timeval timestamp)
+void verify_client::create_request(uint64_t timestamp)
 {
     // TODO: Refactor client::create_request so this can be unified.
     if (m_set_ratio_count < m_config->ratio.a) {
@@ -812,10 +995,13 @@ void verify_client::create_request(struct timeval timestamp)
         unsigned int cmd_size;
 
         m_set_ratio_count++;
-        cmd_size = m_protocol->write_command_get(key, key_len, m_config->data_offset);
+        shard_connection *conn = route(key, key_len);
+        cmd_size = conn->get_protocol()->write_command_get(key, key_len, m_config->data_offset);
 
-        m_pipeline.push(new verify_client::verify_request(rt_get,
-            cmd_size, &timestamp, 1, key, key_len, value, value_len));
+        request *req = new verify_client::verify_request(rt_get,
+            cmd_size, timestamp, 1, key, key_len, value, value_len);
+        save_command_args(req, key, key_len, NULL, 0, 0);
+        push_request(conn, req);
     } else if (m_get_ratio_count < m_config->ratio.b) {
         // We don't really care about GET operations, all we do here is keep
         // the object generator synced.
@@ -852,7 +1038,7 @@ void verify_client::create_request(struct timeval timestamp)
     }
 }
 
-void verify_client::handle_response(struct timeval timestamp, request *request, protocol_response *response)
+void verify_client::handle_response(uint64_t timestamp, request *request, protocol_response *response)
 {
     unsigned int rvalue_len;
     unsigned int key_len;
@@ -897,7 +1083,7 @@ bool verify_client::finished(void)
 
 crc_verify_client::verify_request::verify_request(request_type type,
                                               unsigned int size,
-                                              struct timeval* sent_time,
+                                              uint64_t sent_time,
                                               unsigned int keys,
                                               keylist keylist_source) :
         client::request(type, size, sent_time, keys),
@@ -913,7 +1099,7 @@ crc_verify_client::crc_verify_client(verify_client_group* group) :
         client(dynamic_cast<client_group*>(group)),
         m_verified_keys(0), m_errors(0)
 {
-    m_protocol->set_keep_value(true);
+    set_keep_value(true);
 }
 
 unsigned long int crc_verify_client::get_verified_keys(void)
@@ -926,7 +1112,12 @@ unsigned long int crc_verify_client::get_errors(void)
     return m_errors;
 }
 
-void crc_verify_client::create_request(struct timeval timestamp)
+client::request* crc_verify_client::create_multi_get_request(unsigned int size, uint64_t timestamp, keylist *keys)
+{
+    return new crc_verify_client::verify_request(rt_get, size, timestamp, keys->get_keys_count(), *keys);
+}
+
+void crc_verify_client::create_request(uint64_t timestamp)
 {
     int cmd_size = 0;
     // Prepare a GET request that will be compared against a previous
@@ -952,9 +1143,8 @@ void crc_verify_client::create_request(struct timeval timestamp)
         benchmark_debug_log("MGET %d keys [%.*s] .. [%.*s]\n",
                 m_keylist->get_keys_count(), first_key_len, first_key, last_key_len, last_key);
 
-        cmd_size = m_protocol->write_command_multi_get(m_keylist);
         m_get_ratio_count += keys_count;
-        m_pipeline.push(new crc_verify_client::verify_request(rt_get, cmd_size, &timestamp, m_keylist->get_keys_count(), *m_keylist));
+        send_multi_get(timestamp);
     } else {
         int iter = obj_iter_type(m_config, 2);
         unsigned int keylen;
@@ -966,27 +1156,19 @@ void crc_verify_client::create_request(struct timeval timestamp)
         m_keylist->add_key(key, keylen);
 
         benchmark_debug_log("CRC verify: GET key=[%.*s]\n", keylen, key);
-        cmd_size = m_protocol->write_command_get_key(key, keylen, m_config->data_offset);
-        m_pipeline.push(new crc_verify_client::verify_request(rt_get, cmd_size, &timestamp, 1, *m_keylist));
+        shard_connection *conn = route(key, keylen);
+        cmd_size = conn->get_protocol()->write_command_get_key(key, keylen, m_config->data_offset);
+        push_request(conn, new crc_verify_client::verify_request(rt_get, cmd_size, timestamp, 1, *m_keylist));
     }
 }
 
-void crc_verify_client::handle_response(struct timeval timestamp, request *request, protocol_response *response)
+void crc_verify_client::handle_response(uint64_t timestamp, request *request, protocol_response *response)
 {
     unsigned int values_count = response->get_values_count();
     verify_request *vr = static_cast<verify_request *>(request);
 
     assert(vr->m_type == rt_get);
-    m_stats.update_get_op(&timestamp,
-                          request->m_size + response->get_total_len(),
-                          ts_diff(request->m_sent_time, timestamp),
-                          response->get_hits(),
-                          request->m_keys - response->get_hits());
-
-    unsigned int latencies_size = response->get_latencies_count();
-    for (unsigned int i = 0; i < latencies_size; i++) {
-        m_stats.update_get_latency_map(response->get_latency());
-    }
+    update_get_stats(timestamp, request, response);
 
     if (strcmp(response->get_status(), "PROTOCOL_BINARY_RESPONSE_KEY_ENOENT") == 0 ||
                                                 response->is_error() || !values_count) {
@@ -1032,10 +1214,184 @@ void crc_verify_client::handle_response(struct timeval timestamp, request *reque
 
 ///////////////////////////////////////////////////////////////////////////
 
+// splits a comma separated list, skipping empty items
+static void split_list(const char *list, std::vector<std::string> *items)
+{
+    const char *pos = list;
+
+    while (*pos != '\0') {
+        const char *end = strchr(pos, ',');
+        if (end == NULL)
+            end = pos + strlen(pos);
+        if (end > pos)
+            items->push_back(std::string(pos, end - pos));
+        pos = *end == ',' ? end + 1 : end;
+    }
+}
+
+publisher_client::publisher_client(client_group* group) :
+        client(group),
+        m_next_channel(0)
+{
+    split_list(m_config->pubsub_channels, &m_channels);
+    assert(!m_channels.empty());
+
+    // the requested rate is shared by publishers only
+    if (m_rate_interval > 0) {
+        unsigned int publishers = (m_config->clients - m_config->pubsub_subscribers) * m_config->threads;
+        m_rate_interval = (double) NSEC_PER_SEC * publishers / m_config->request_rate;
+    }
+}
+
+void publisher_client::create_request(uint64_t timestamp)
+{
+    data_object *obj = m_obj_gen->get_object(obj_iter_type(m_config, 0));
+    unsigned int value_len;
+    const char *value = obj->get_value(&value_len);
+
+    // the send time takes the place of the start of the value
+    unsigned int payload_len = value_len > sizeof(timestamp) ? value_len : sizeof(timestamp);
+    if (m_payload.size() < payload_len)
+        m_payload.resize(payload_len);
+    memcpy(&m_payload[0], value, value_len);
+    memcpy(&m_payload[0], &timestamp, sizeof(timestamp));
+
+    const std::string& channel = m_channels[m_next_channel];
+    m_next_channel = (m_next_channel + 1) % m_channels.size();
+
+    benchmark_debug_log("PUBLISH channel=[%s] payload_len=%u\n", channel.c_str(), payload_len);
+    shard_connection *conn = m_connections[0];
+    int cmd_size = conn->get_protocol()->write_command_publish(channel.data(), channel.size(),
+        &m_payload[0], payload_len);
+
+    push_request(conn, new client::request(rt_publish, cmd_size, timestamp, 1));
+}
+
+void publisher_client::handle_response(uint64_t timestamp, request *request, protocol_response *response)
+{
+    assert(request->m_type == rt_publish);
+    m_stats.update_set_op(timestamp,
+        request->m_size + response->get_total_len(),
+        timestamp - request->m_sent_time);
+}
+
+void subscriber_end_event_handler(evutil_socket_t sfd, short evtype, void *opaque)
+{
+    subscriber_client *c = (subscriber_client *) opaque;
+
+    assert(c != NULL);
+    c->m_now = clock_now();
+    c->handle_end_event();
+}
+
+subscriber_client::subscriber_client(client_group* group) :
+        client(group),
+        m_patterns(false), m_subscribed(false), m_end_event(NULL)
+{
+    if (m_config->pubsub_patterns != NULL) {
+        split_list(m_config->pubsub_patterns, &m_channels);
+        m_patterns = true;
+    } else {
+        split_list(m_config->pubsub_channels, &m_channels);
+    }
+    assert(!m_channels.empty());
+
+    m_end_event = evtimer_new(m_event_base, subscriber_end_event_handler, (void *)this);
+    assert(m_end_event != NULL);
+}
+
+subscriber_client::~subscriber_client()
+{
+    if (m_end_event != NULL) {
+        event_free(m_end_event);
+        m_end_event = NULL;
+    }
+}
+
+// subscribes once the connection is ready; nothing is sent after that
+void subscriber_client::fill_pipeline(void)
+{
+    if (m_subscribed || finished() || !connections_ready(m_now))
+        return;
+
+    shard_connection *conn = m_connections[0];
+    for (unsigned int i = 0; i < m_channels.size(); i++) {
+        const std::string& channel = m_channels[i];
+
+        benchmark_debug_log("%s [%s]\n", m_patterns ? "PSUBSCRIBE" : "SUBSCRIBE", channel.c_str());
+        int cmd_size = conn->get_protocol()->write_command_subscribe(channel.data(), channel.size(), m_patterns);
+        push_request(conn, new client::request(rt_subscribe, cmd_size, m_now, 0));
+    }
+    m_subscribed = true;
+
+    struct timeval delay = clock_ns_to_timeval((uint64_t) m_config->test_time * NSEC_PER_SEC);
+    int ret = evtimer_add(m_end_event, &delay);
+    assert(ret == 0);
+}
+
+void subscriber_client::handle_response(uint64_t timestamp, request *request, protocol_response *response)
+{
+    // errors were already reported; confirmations need no accounting
+    assert(request->m_type == rt_subscribe);
+}
+
+void subscriber_client::handle_message(uint64_t timestamp, protocol_response *response)
+{
+    if (response->get_values_count() == 0)
+        return;
+
+    unsigned int payload_len, channel_len;
+    const char *channel;
+    const char *payload = response->get_value(&payload_len, &channel, &channel_len);
+    uint64_t sent_time = 0;
+
+    if (payload_len >= sizeof(sent_time))
+        memcpy(&sent_time, payload, sizeof(sent_time));
+    free((void *) payload);
+
+    // e.g. a message that was not published by us
+    if (sent_time == 0 || sent_time > timestamp) {
+        benchmark_debug_log("message without a send time ignored.\n");
+        return;
+    }
+
+    m_stats.update_get_op(timestamp, response->get_total_len(), timestamp - sent_time, 1, 0);
+    m_stats.update_get_latency_histogram(timestamp - sent_time);
+
+    // the test is about to stop, no need to wait for the timer
+    if (finished())
+        event_del(m_end_event);
+}
+
+void subscriber_client::handle_end_event(void)
+{
+    if (stop_if_finished())
+        return;
+
+    // the timer may fire a little early by our clock
+    uint64_t end_time = m_stats.get_start_time() + (uint64_t) m_config->test_time * NSEC_PER_SEC;
+    struct timeval delay = clock_ns_to_timeval(end_time > m_now ? end_time - m_now : 0);
+    int ret = evtimer_add(m_end_event, &delay);
+    assert(ret == 0);
+}
+
+///////////////////////////////////////////////////////////////////////////
+
 client_group::client_group(benchmark_config* config, abstract_protocol *protocol, object_generator* obj_gen) : 
     m_base(NULL), m_config(config), m_protocol(protocol), m_obj_gen(obj_gen)
 {
-    m_base = event_base_new();
+    // in open-loop mode requests are scheduled with timers, which need better
+    // than the default (millisecond) resolution
+    if (config->request_rate) {
+        struct event_config* ev_cfg = event_config_new();
+        assert(ev_cfg != NULL);
+
+        event_config_set_flag(ev_cfg, EVENT_BASE_FLAG_PRECISE_TIMER);
+        m_base = event_base_new_with_config(ev_cfg);
+        event_config_free(ev_cfg);
+    } else {
+        m_base = event_base_new();
+    }
     assert(m_base != NULL);
 
     assert(protocol != NULL);
@@ -1086,41 +1442,46 @@ int client_group::prepare(void)
    return 0;
 }
 
+void client_group::set_time_series_base(uint64_t base)
+{
+    for (std::vector<client*>::iterator i = m_clients.begin(); i != m_clients.end(); i++) {
+        (*i)->get_stats()->set_time_series_base(base);
+    }
+}
+
 void client_group::run(void)
 {
+#ifdef HAVE_IO_URING
+    if (strcmp(m_config->io_engine, "io_uring") == 0) {
+        io_uring_engine engine;
+        if (!engine.init(m_clients.size())) {
+            benchmark_error_log("error: failed to set up io_uring: %s\n", strerror(errno));
+            return;
+        }
+
+        engine.run(m_clients);
+        return;
+    }
+#endif
     event_base_dispatch(m_base);
 }
 
 unsigned long int client_group::get_total_bytes(void)
 {
-    unsigned long int total_bytes = 0;
-    for (std::vector<client*>::iterator i = m_clients.begin(); i != m_clients.end(); i++) {
-        total_bytes += (*i)->get_stats()->get_total_bytes();
-    }
-
-    return total_bytes;
+    return m_live_stats.get_total_bytes();
 }
 
 unsigned long int client_group::get_total_ops(void)
 {
-    unsigned long int total_ops = 0;
-    for (std::vector<client*>::iterator i = m_clients.begin(); i != m_clients.end(); i++) {
-        total_ops += (*i)->get_stats()->get_total_ops();
-    }
-
-    return total_ops;
+    return m_live_stats.get_total_ops();
 }
 
 unsigned long int client_group::get_total_latency(void)
 {
-    unsigned long int total_latency = 0;
-    for (std::vector<client*>::iterator i = m_clients.begin(); i != m_clients.end(); i++) {
-        total_latency += (*i)->get_stats()->get_total_latency();
-    }
-
-    return total_latency;
+    return m_live_stats.get_total_latency();
 }
 
+// reads the clients' own stats, so may only be used once the thread is done
 unsigned long int client_group::get_duration_usec(void)
 {
     unsigned long int duration = 0;
@@ -1133,6 +1494,11 @@ unsigned long int client_group::get_duration_usec(void)
     return duration;
 }
 
+void client_group::collect_interval(live_stats_interval* target)
+{
+    m_live_stats.collect_interval(target);
+}
+
 void client_group::merge_run_stats(run_stats* target)
 {
     assert(target != NULL);
@@ -1150,7 +1516,7 @@ void client_group::write_client_stats(const char *prefix)
         char filename[PATH_MAX];
 
         snprintf(filename, sizeof(filename)-1, "%s-%u.csv", prefix, client_id++);
-        if (!(*i)->get_stats()->save_csv(filename)) {
+        if (!(*i)->get_stats()->save_csv(filename, m_config->print_percentiles.quantile_list)) {
             fprintf(stderr, "error: %s: failed to write client stats.\n", filename);
         }
     }        
@@ -1158,6 +1524,32 @@ void client_group::write_client_stats(const char *prefix)
 
 ///////////////////////////////////////////////////////////////////////////
 
+pubsub_client_group::pubsub_client_group(benchmark_config *cfg, abstract_protocol *protocol, object_generator* obj_gen) :
+        client_group(cfg, protocol, obj_gen)
+{
+}
+
+int pubsub_client_group::create_clients(int num)
+{
+    for (int i = 0; i < num; i++) {
+        client* c;
+        if (i < (int) m_config->pubsub_subscribers)
+            c = new subscriber_client(this);
+        else
+            c = new publisher_client(this);
+        assert(c != NULL);
+
+        if (!c->initialized()) {
+            delete c;
+            return i;
+        }
+
+        m_clients.push_back(c);
+    }
+
+    return num;
+}
+
 verify_client_group::verify_client_group(benchmark_config *cfg, abstract_protocol *protocol, object_generator* obj_gen) :
         client_group(cfg, protocol, obj_gen)
 {
@@ -1197,7 +1589,10 @@ void verify_client_group::merge_run_stats(run_stats* target)
 
 ///////////////////////////////////////////////////////////////////////////
 
-run_stats::one_second_stats::one_second_stats(unsigned int second)
+run_stats::one_second_stats::one_second_stats(unsigned int second) :
+    m_get_latency_histogram(latency_histogram::per_second()),
+    m_set_latency_histogram(latency_histogram::per_second()),
+    m_wait_latency_histogram(latency_histogram::per_second())
 {
     reset(second);
 }
@@ -1211,9 +1606,20 @@ void run_stats::one_second_stats::reset(unsigned int second)
     m_total_get_latency = 0;
     m_total_set_latency = 0;
     m_total_wait_latency = 0;
+    m_get_latency_histogram.reset();
+    m_set_latency_histogram.reset();
+    m_wait_latency_histogram.reset();
 }
 
 void run_stats::one_second_stats::merge(const one_second_stats& other)
+{
+    merge_counters(other);
+    m_get_latency_histogram.add(other.m_get_latency_histogram);
+    m_set_latency_histogram.add(other.m_set_latency_histogram);
+    m_wait_latency_histogram.add(other.m_wait_latency_histogram);
+}
+
+void run_stats::one_second_stats::merge_counters(const one_second_stats& other)
 {
     m_bytes_get += other.m_bytes_get;
     m_bytes_set += other.m_bytes_set;
@@ -1275,45 +1681,90 @@ void run_stats::totals::add(const run_stats::totals& other)
     m_errors += other.m_errors;
 }
 
+run_stats::shard_stats::shard_stats() :
+    m_ops(0), m_bytes(0), m_total_latency(0)
+{
+}
+
+void run_stats::shard_stats::update_op(unsigned int ops, unsigned int bytes, uint64_t latency)
+{
+    m_ops += ops;
+    m_bytes += bytes;
+    m_total_latency += latency;
+    m_latency_histogram.record_value(latency);
+}
+
+void run_stats::shard_stats::merge(const shard_stats& other)
+{
+    m_ops += other.m_ops;
+    m_bytes += other.m_bytes;
+    m_total_latency += other.m_total_latency;
+    m_latency_histogram.add(other.m_latency_histogram);
+}
+
+///////////////////////////////////////////////////////////////////////////
+
 run_stats::run_stats() :
-    m_cur_stats(0)
+    m_start_time(0),
+    m_end_time(0),
+    m_time_series_base(0),
+    m_cur_stats(0),
+    m_run_totals(0),
+    m_intervals(0),
+    m_keep_time_series(true),
+    m_live_stats(NULL)
 {
-    memset(&m_start_time, 0, sizeof(m_start_time));
-    memset(&m_end_time, 0, sizeof(m_end_time));
 }
 
-void run_stats::set_start_time(struct timeval* start_time)
+void run_stats::set_start_time(uint64_t start_time)
 {
-    struct timeval tv;
-    if (!start_time) {
-        gettimeofday(&tv, NULL);
-        start_time = &tv;
-    }
-    
-    m_start_time = *start_time;
+    m_start_time = start_time;
+    if (!m_time_series_base)
+        m_time_series_base = start_time;
+}
+
+void run_stats::set_time_series_base(uint64_t base)
+{
+    m_time_series_base = base;
+}
+
+void run_stats::set_end_time(uint64_t end_time)
+{
+    m_end_time = end_time;
+    complete_cur_stats();
+}
+
+void run_stats::set_live_stats(live_stats* stats)
+{
+    m_live_stats = stats;
 }
 
-void run_stats::set_end_time(struct timeval* end_time)
+void run_stats::set_keep_time_series(bool keep)
 {
-    struct timeval tv;
-    if (!end_time) {
-        gettimeofday(&tv, NULL);
-        end_time = &tv;
+    m_keep_time_series = keep;
+}
+
+void run_stats::complete_cur_stats(void)
+{
+    m_run_totals.merge_counters(m_cur_stats);
+    m_intervals++;
+
+    if (m_keep_time_series) {
+        extend_time_series(m_cur_stats.m_second);
+        m_stats.push_back(m_cur_stats);
     }
-    m_end_time = *end_time;
-    m_stats.push_back(m_cur_stats);
 }
 
-void run_stats::roll_cur_stats(struct timeval* ts)
+void run_stats::roll_cur_stats(uint64_t ts)
 {
-    unsigned int sec = ts_diff(m_start_time, *ts) / 1000000;
+    unsigned int sec = (ts - m_time_series_base) / NSEC_PER_SEC;
     if (sec > m_cur_stats.m_second) {
-        m_stats.push_back(m_cur_stats);
+        complete_cur_stats();
         m_cur_stats.reset(sec);
     }        
 }
 
-void run_stats::update_get_op(struct timeval* ts, unsigned int bytes, unsigned int latency, unsigned int hits, unsigned int misses)
+void run_stats::update_get_op(uint64_t ts, unsigned int bytes, uint64_t latency, unsigned int hits, unsigned int misses)
 {
     roll_cur_stats(ts);
     m_cur_stats.m_bytes_get += bytes;
@@ -1326,14 +1777,31 @@ void run_stats::update_get_op(struct timeval* ts, unsigned int bytes, unsigned i
     m_totals.m_bytes += bytes;
     m_totals.m_ops+= hits + misses;
     m_totals.m_latency += latency;
+
+    if (m_live_stats != NULL)
+        m_live_stats->record_get(bytes, latency, hits, misses);
+}
+
+void run_stats::update_get_latency_histogram(uint64_t latency)
+{
+    if (m_keep_time_series)
+        m_cur_stats.m_get_latency_histogram.record_value(latency);
+    m_get_latency_histogram.record_value(latency);
+}
+
+void run_stats::update_latency_breakdown(uint64_t queueing, uint64_t server, uint64_t receive)
+{
+    m_queueing_latency_histogram.record_value(queueing);
+    m_server_latency_histogram.record_value(server);
+    m_receive_latency_histogram.record_value(receive);
 }
 
-void run_stats::update_get_latency_map(unsigned int latency)
+run_stats::shard_stats* run_stats::get_shard_stats(const char *name)
 {
-    m_get_latency_map[get_2_meaningful_digits((float)latency/1000)]++;
+    return &m_shards[name];
 }
 
-void run_stats::update_set_op(struct timeval* ts, unsigned int bytes, unsigned int latency)
+void run_stats::update_set_op(uint64_t ts, unsigned int bytes, uint64_t latency)
 {
     roll_cur_stats(ts);
     m_cur_stats.m_bytes_set += bytes;
@@ -1345,10 +1813,15 @@ void run_stats::update_set_op(struct timeval* ts, unsigned int bytes, unsigned i
     m_totals.m_ops++;
     m_totals.m_latency += latency;
 
-    m_set_latency_map[get_2_meaningful_digits((float)latency/1000)]++;
+    if (m_live_stats != NULL)
+        m_live_stats->record_set(bytes, latency);
+
+    if (m_keep_time_series)
+        m_cur_stats.m_set_latency_histogram.record_value(latency);
+    m_set_latency_histogram.record_value(latency);
 }
 
-void run_stats::update_wait_op(struct timeval *ts, unsigned int latency)
+void run_stats::update_wait_op(uint64_t ts, uint64_t latency)
 {
     roll_cur_stats(ts);
     m_cur_stats.m_ops_wait++;
@@ -1358,7 +1831,12 @@ void run_stats::update_wait_op(struct timeval *ts, unsigned int latency)
     m_totals.m_ops++;
     m_totals.m_latency += latency;
 
-    m_wait_latency_map[get_2_meaningful_digits((float)latency/1000)]++;
+    if (m_live_stats != NULL)
+        m_live_stats->record_wait(latency);
+
+    if (m_keep_time_series)
+        m_cur_stats.m_wait_latency_histogram.record_value(latency);
+    m_wait_latency_histogram.record_value(latency);
 }
 
 void run_stats::update_verified_keys(unsigned long int keys)
@@ -1371,19 +1849,14 @@ void run_stats::update_errors(unsigned long int errors)
     m_totals.m_errors += errors;
 }
 
-unsigned int run_stats::get_duration(void)
-{
-    return m_cur_stats.m_second;
-}
-
 unsigned long int run_stats::get_duration_usec(void)
 {
-    if (!m_start_time.tv_sec)
+    if (!m_start_time)
         return 0;
-    if (m_end_time.tv_sec > 0) {
-        return ts_diff(m_start_time, m_end_time);
+    if (m_end_time > 0) {
+        return (m_end_time - m_start_time) / NSEC_PER_USEC;
     } else {
-        return ts_diff_now(m_start_time);
+        return (clock_now() - m_start_time) / NSEC_PER_USEC;
     }
 }
 
@@ -1412,12 +1885,31 @@ unsigned long int run_stats::get_errors()
     return m_totals.m_errors;
 }
 
+// number of percentile steps reported per halving of the distance to 100%
+#define LATENCY_HDR_RESULTS_TICKS   10
+
+// average of nsec latencies, in usec
 #define AVERAGE(total, count) \
-    ((unsigned int) ((count) > 0 ? (total) / (count) : 0))
+    ((unsigned int) ((count) > 0 ? (total) / (count) / NSEC_PER_USEC : 0))
 #define USEC_FORMAT(value) \
     (value) / 1000000, (value) % 1000000
 
-bool run_stats::save_csv(const char *filename)
+static void csv_print_quantiles_header(FILE *f, const char *type, const std::vector<float>& quantiles)
+{
+    for (std::vector<float>::const_iterator i = quantiles.begin(); i != quantiles.end(); i++) {
+        fprintf(f, ",%s p%g Latency", type, *i);
+    }
+}
+
+static void csv_print_quantiles(FILE *f, const latency_histogram& histogram, const std::vector<float>& quantiles)
+{
+    for (std::vector<float>::const_iterator i = quantiles.begin(); i != quantiles.end(); i++) {
+        unsigned int latency = (unsigned int) (histogram.value_at_percentile(*i) / NSEC_PER_USEC);
+        fprintf(f, ",%u.%06u", USEC_FORMAT(latency));
+    }
+}
+
+bool run_stats::save_csv(const char *filename, const std::vector<float>& quantiles)
 {
     FILE *f = fopen(filename, "w");
     if (!f) {
@@ -1428,16 +1920,16 @@ bool run_stats::save_csv(const char *filename)
     fprintf(f, "Per-Second Benchmark Data\n");
     fprintf(f, "Second,SET Requests,SET Average Latency,SET Total Bytes,"
                "GET Requests,GET Average Latency,GET Total Bytes,GET Misses, GET Hits,"
-               "WAIT Requests,WAIT Average Latency\n");
-
-    unsigned long int total_get_ops = 0;
-    unsigned long int total_set_ops = 0;
-    unsigned long int total_wait_ops = 0;
+               "WAIT Requests,WAIT Average Latency");
+    csv_print_quantiles_header(f, "SET", quantiles);
+    csv_print_quantiles_header(f, "GET", quantiles);
+    csv_print_quantiles_header(f, "WAIT", quantiles);
+    fprintf(f, "\n");
 
     for (std::vector<one_second_stats>::iterator i = m_stats.begin();
             i != m_stats.end(); i++) {
 
-        fprintf(f, "%u,%lu,%u.%06u,%lu,%lu,%u.%06u,%lu,%u,%u,%lu,%u.%06u\n",
+        fprintf(f, "%u,%lu,%u.%06u,%lu,%lu,%u.%06u,%lu,%u,%u,%lu,%u.%06u",
             i->m_second,
             i->m_ops_set,
             USEC_FORMAT(AVERAGE(i->m_total_set_latency, i->m_ops_set)),
@@ -1449,46 +1941,192 @@ bool run_stats::save_csv(const char *filename)
             i->m_get_hits,
             i->m_ops_wait,
             USEC_FORMAT(AVERAGE(i->m_total_wait_latency, i->m_ops_wait)));
-
-        total_get_ops += i->m_ops_get;
-        total_set_ops += i->m_ops_set;
-        total_wait_ops += i->m_ops_wait;
+        csv_print_quantiles(f, i->m_set_latency_histogram, quantiles);
+        csv_print_quantiles(f, i->m_get_latency_histogram, quantiles);
+        csv_print_quantiles(f, i->m_wait_latency_histogram, quantiles);
+        fprintf(f, "\n");
     }
 
 
-    double total_count_float = 0;
     fprintf(f, "\n" "Full-Test GET Latency\n");
     fprintf(f, "Latency (<= msec),Percent\n");
-    for ( latency_map_itr it = m_get_latency_map.begin() ; it != m_get_latency_map.end() ; it++ ) {
-        total_count_float += it->second;
-        fprintf(f, "%8.3f,%.2f\n", it->first, total_count_float / total_get_ops * 100);
+    latency_histogram::percentile_iterator get_it(&m_get_latency_histogram, LATENCY_HDR_RESULTS_TICKS);
+    while (get_it.next()) {
+        fprintf(f, "%8.3f,%.2f\n", get_it.value / (double) NSEC_PER_MSEC, get_it.percentile);
     }
 
-    total_count_float = 0;
     fprintf(f, "\n" "Full-Test SET Latency\n");
     fprintf(f, "Latency (<= msec),Percent\n");
-    for ( latency_map_itr it = m_set_latency_map.begin(); it != m_set_latency_map.end() ; it++ ) {
-        total_count_float += it->second;
-        fprintf(f, "%8.3f,%.2f\n", it->first, total_count_float / total_set_ops * 100);
+    latency_histogram::percentile_iterator set_it(&m_set_latency_histogram, LATENCY_HDR_RESULTS_TICKS);
+    while (set_it.next()) {
+        fprintf(f, "%8.3f,%.2f\n", set_it.value / (double) NSEC_PER_MSEC, set_it.percentile);
     }
 
-    total_count_float = 0;
     fprintf(f, "\n" "Full-Test WAIT Latency\n");
     fprintf(f, "Latency (<= msec),Percent\n");
-    for ( latency_map_itr it = m_wait_latency_map.begin(); it != m_wait_latency_map.end() ; it++ ) {
-        total_count_float += it->second;
-        fprintf(f, "%8.3f,%.2f\n", it->first, total_count_float / total_wait_ops * 100);
+    latency_histogram::percentile_iterator wait_it(&m_wait_latency_histogram, LATENCY_HDR_RESULTS_TICKS);
+    while (wait_it.next()) {
+        fprintf(f, "%8.3f,%.2f\n", wait_it.value / (double) NSEC_PER_MSEC, wait_it.percentile);
+    }
+
+    fclose(f);
+    return true;
+}
+
+#define STATS_EXPORT_VERSION    1
+
+static void export_histogram(FILE *f, const char *name, const latency_histogram& histogram)
+{
+    unsigned int buckets = 0;
+    latency_histogram::recorded_iterator count_it(&histogram);
+    while (count_it.next()) {
+        buckets++;
+    }
+
+    fprintf(f, "histogram %s %u\n", name, buckets);
+    latency_histogram::recorded_iterator it(&histogram);
+    while (it.next()) {
+        fprintf(f, "%llu %llu\n", (unsigned long long) it.value, (unsigned long long) it.count);
+    }
+}
+
+// writes everything needed to reproduce the summary of this run, with the
+// raw latency histograms, so that runs of several hosts can be merged later
+// (see import_stats).  the format is plain text: "key value" lines, each
+// histogram followed by one "value count" line per recorded bucket (nsec).
+bool run_stats::export_stats(const char *filename)
+{
+    FILE *f = fopen(filename, "w");
+    if (!f) {
+        perror(filename);
+        return false;
+    }
+
+    fprintf(f, "# memtier_benchmark stats export\n");
+    fprintf(f, "version %u\n", STATS_EXPORT_VERSION);
+    fprintf(f, "hdr_significant_figures %d\n", m_get_latency_histogram.get_significant_figures());
+    fprintf(f, "hdr_max_value %llu\n", (unsigned long long) m_get_latency_histogram.get_highest_trackable_value());
+    fprintf(f, "duration_usec %lu\n", get_duration_usec());
+    fprintf(f, "ops_get %lu\n", m_run_totals.m_ops_get);
+    fprintf(f, "ops_set %lu\n", m_run_totals.m_ops_set);
+    fprintf(f, "ops_wait %lu\n", m_run_totals.m_ops_wait);
+    fprintf(f, "bytes_get %lu\n", m_run_totals.m_bytes_get);
+    fprintf(f, "bytes_set %lu\n", m_run_totals.m_bytes_set);
+    fprintf(f, "get_hits %u\n", m_run_totals.m_get_hits);
+    fprintf(f, "get_misses %u\n", m_run_totals.m_get_misses);
+    fprintf(f, "total_get_latency %llu\n", m_run_totals.m_total_get_latency);
+    fprintf(f, "total_set_latency %llu\n", m_run_totals.m_total_set_latency);
+    fprintf(f, "total_wait_latency %llu\n", m_run_totals.m_total_wait_latency);
+
+    export_histogram(f, "get", m_get_latency_histogram);
+    export_histogram(f, "set", m_set_latency_histogram);
+    export_histogram(f, "wait", m_wait_latency_histogram);
+    if (m_queueing_latency_histogram.get_total_count() > 0) {
+        export_histogram(f, "queueing", m_queueing_latency_histogram);
+        export_histogram(f, "server", m_server_latency_histogram);
+        export_histogram(f, "receive", m_receive_latency_histogram);
+    }
+
+    fclose(f);
+    return true;
+}
+
+// loads a file written by export_stats, into an empty run_stats; the
+// histograms must have been recorded with the layout used here, so that
+// the merged percentiles keep the precision every host measured with.
+bool run_stats::import_stats(const char *filename)
+{
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        perror(filename);
+        return false;
     }
 
+    char line[256];
+    char key[64];
+    unsigned long long value;
+    unsigned int version = 0;
+    unsigned long int duration_usec = 0;
+    int significant_figures = LATENCY_HDR_SIGFIGS;
+    unsigned long long max_value = LATENCY_HDR_MAX_VALUE;
+    bool ok = true;
+
+    while (ok && fgets(line, sizeof(line), f) != NULL) {
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+
+        unsigned int buckets;
+        if (sscanf(line, "histogram %63s %u", key, &buckets) == 2) {
+            latency_histogram* histogram = NULL;
+            if (!strcmp(key, "get")) histogram = &m_get_latency_histogram;
+            else if (!strcmp(key, "set")) histogram = &m_set_latency_histogram;
+            else if (!strcmp(key, "wait")) histogram = &m_wait_latency_histogram;
+            else if (!strcmp(key, "queueing")) histogram = &m_queueing_latency_histogram;
+            else if (!strcmp(key, "server")) histogram = &m_server_latency_histogram;
+            else if (!strcmp(key, "receive")) histogram = &m_receive_latency_histogram;
+
+            for (unsigned int i = 0; ok && i < buckets; i++) {
+                unsigned long long count;
+                if (fgets(line, sizeof(line), f) == NULL ||
+                    sscanf(line, "%llu %llu", &value, &count) != 2) {
+                    ok = false;
+                } else if (histogram != NULL) {
+                    histogram->record_values(value, count);
+                }
+            }
+            continue;
+        }
+
+        if (sscanf(line, "%63s %llu", key, &value) != 2) {
+            ok = false;
+            break;
+        }
+
+        if (!strcmp(key, "version")) version = value;
+        else if (!strcmp(key, "hdr_significant_figures")) significant_figures = value;
+        else if (!strcmp(key, "hdr_max_value")) max_value = value;
+        else if (!strcmp(key, "duration_usec")) duration_usec = value;
+        else if (!strcmp(key, "ops_get")) m_run_totals.m_ops_get = value;
+        else if (!strcmp(key, "ops_set")) m_run_totals.m_ops_set = value;
+        else if (!strcmp(key, "ops_wait")) m_run_totals.m_ops_wait = value;
+        else if (!strcmp(key, "bytes_get")) m_run_totals.m_bytes_get = value;
+        else if (!strcmp(key, "bytes_set")) m_run_totals.m_bytes_set = value;
+        else if (!strcmp(key, "get_hits")) m_run_totals.m_get_hits = value;
+        else if (!strcmp(key, "get_misses")) m_run_totals.m_get_misses = value;
+        else if (!strcmp(key, "total_get_latency")) m_run_totals.m_total_get_latency = value;
+        else if (!strcmp(key, "total_set_latency")) m_run_totals.m_total_set_latency = value;
+        else if (!strcmp(key, "total_wait_latency")) m_run_totals.m_total_wait_latency = value;
+    }
     fclose(f);
+
+    if (!ok || version != STATS_EXPORT_VERSION) {
+        fprintf(stderr, "%s: not a valid stats export file.\n", filename);
+        return false;
+    }
+    if (significant_figures != m_get_latency_histogram.get_significant_figures() ||
+        max_value != m_get_latency_histogram.get_highest_trackable_value()) {
+        fprintf(stderr, "%s: recorded with --hdr-significant-figures=%d --hdr-max-latency=%llu, "
+                "merge it with the same options.\n",
+                filename, significant_figures, max_value / NSEC_PER_MSEC);
+        return false;
+    }
+
+    // hosts don't share a clock, only the duration of each run matters
+    m_start_time = 0;
+    m_end_time = duration_usec * NSEC_PER_USEC;
+    m_intervals = 1;
+
+    m_totals.m_ops = m_run_totals.m_ops_get + m_run_totals.m_ops_set + m_run_totals.m_ops_wait;
+    m_totals.m_bytes = m_run_totals.m_bytes_get + m_run_totals.m_bytes_set;
+    m_totals.m_latency = m_run_totals.m_total_get_latency + m_run_totals.m_total_set_latency + m_run_totals.m_total_wait_latency;
+
     return true;
 }
     
 void run_stats::debug_dump(void)
 {
-    benchmark_debug_log("run_stats: start_time={%u,%u} end_time={%u,%u}\n",
-        m_start_time.tv_sec, m_start_time.tv_usec,
-        m_end_time.tv_sec, m_end_time.tv_usec);
+    benchmark_debug_log("run_stats: start_time=%llu end_time=%llu\n",
+        m_start_time, m_end_time);
     
     for (std::vector<one_second_stats>::iterator i = m_stats.begin();
             i != m_stats.end(); i++) {
@@ -1509,25 +2147,20 @@ void run_stats::debug_dump(void)
     }
 
 
-    for( latency_map_itr it = m_get_latency_map.begin() ; it != m_get_latency_map.end() ; it++) {
-        if (it->second)
-            benchmark_debug_log("  GET <= %u msec: %u\n", it->first, it->second);
+    latency_histogram::recorded_iterator get_it(&m_get_latency_histogram);
+    while (get_it.next()) {
+        benchmark_debug_log("  GET <= %llu nsec: %llu\n", get_it.value, get_it.count);
     }
-    for(  latency_map_itr it = m_set_latency_map.begin() ; it != m_set_latency_map.end() ; it++) {
-        if (it->second)
-            benchmark_debug_log("  SET <= %u msec: %u\n", it->first, it->second);
+    latency_histogram::recorded_iterator set_it(&m_set_latency_histogram);
+    while (set_it.next()) {
+        benchmark_debug_log("  SET <= %llu nsec: %llu\n", set_it.value, set_it.count);
     }
-    for(  latency_map_itr it = m_wait_latency_map.begin() ; it != m_wait_latency_map.end() ; it++) {
-        if (it->second)
-            benchmark_debug_log("  WAIT <= %u msec: %u\n", it->first, it->second);
+    latency_histogram::recorded_iterator wait_it(&m_wait_latency_histogram);
+    while (wait_it.next()) {
+        benchmark_debug_log("  WAIT <= %llu nsec: %llu\n", wait_it.value, wait_it.count);
     }
 }
 
-bool one_second_stats_predicate(const run_stats::one_second_stats& a, const run_stats::one_second_stats& b)
-{
-    return a.m_second < b.m_second;
-}
-
 void run_stats::aggregate_average(const std::vector<run_stats>& all_stats)
 {
     for (std::vector<run_stats>::const_iterator i = all_stats.begin(); 
@@ -1537,16 +2170,12 @@ void run_stats::aggregate_average(const std::vector<run_stats>& all_stats)
             m_totals.add(i_totals);
 
             // aggregate latency data
-
-        for (latency_map_itr_const it = i->m_get_latency_map.begin() ; it != i->m_get_latency_map.end() ; it++) {
-            m_get_latency_map[it->first] += it->second;
-        }
-        for (latency_map_itr_const it = i->m_set_latency_map.begin() ; it != i->m_set_latency_map.end() ; it++) {
-            m_set_latency_map[it->first] += it->second;
-        }
-        for (latency_map_itr_const it = i->m_wait_latency_map.begin() ; it != i->m_wait_latency_map.end() ; it++) {
-            m_wait_latency_map[it->first] += it->second;
-        }
+            m_get_latency_histogram.add(i->m_get_latency_histogram);
+            m_set_latency_histogram.add(i->m_set_latency_histogram);
+            m_wait_latency_histogram.add(i->m_wait_latency_histogram);
+            m_queueing_latency_histogram.add(i->m_queueing_latency_histogram);
+            m_server_latency_histogram.add(i->m_server_latency_histogram);
+            m_receive_latency_histogram.add(i->m_receive_latency_histogram);
     }
     m_totals.m_ops_sec_set /= all_stats.size();
     m_totals.m_ops_sec_get /= all_stats.size();
@@ -1564,65 +2193,69 @@ void run_stats::aggregate_average(const std::vector<run_stats>& all_stats)
 
 }
 
+// makes sure the time series covers seconds [0, seconds)
+void run_stats::extend_time_series(unsigned int seconds)
+{
+    while (m_stats.size() < seconds) {
+        m_stats.push_back(one_second_stats(m_stats.size()));
+    }
+}
+
 void run_stats::merge(const run_stats& other, int iteration)
 {
-    bool new_stats = false;
-
-    m_start_time = timeval_factorial_average( m_start_time, other.m_start_time, iteration );
-    m_end_time =   timeval_factorial_average( m_end_time,   other.m_end_time,   iteration );
-
-    // aggregate the one_second_stats vectors. this is not efficient
-    // but it's not really important (small numbers, not realtime)
-    for (std::vector<one_second_stats>::const_iterator other_i = other.m_stats.begin();
-            other_i != other.m_stats.end(); other_i++) {
-
-        // find ours
-        bool merged = false;
-        for (std::vector<one_second_stats>::iterator i = m_stats.begin(); 
-                i != m_stats.end(); i++) {
-                    if (i->m_second == other_i->m_second) {
-                        i->merge(*other_i);
-                        merged = true;
-                        break;
-                    }
+    m_start_time = ts_factorial_average( m_start_time, other.m_start_time, iteration );
+    m_end_time =   ts_factorial_average( m_end_time,   other.m_end_time,   iteration );
+
+    // both time series are dense and indexed by second from their base, so
+    // they are merged in a single pass once the bases are lined up.  all
+    // clients of a run normally share the same base; if they don't, seconds
+    // are shifted by the (whole seconds) difference between the bases.
+    if (!other.m_stats.empty()) {
+        if (m_stats.empty()) {
+            m_time_series_base = other.m_time_series_base;
+        } else if (other.m_time_series_base < m_time_series_base) {
+            unsigned int shift = (m_time_series_base - other.m_time_series_base) / NSEC_PER_SEC;
+            if (shift > 0) {
+                m_stats.insert(m_stats.begin(), shift, one_second_stats(0));
+                for (unsigned int i = 0; i < m_stats.size(); i++) {
+                    m_stats[i].m_second = i;
+                }
+            }
+            m_time_series_base = other.m_time_series_base;
         }
 
-        if (!merged) {
-            m_stats.push_back(*other_i);
-            new_stats = true;
+        unsigned int offset = (other.m_time_series_base - m_time_series_base) / NSEC_PER_SEC;
+        extend_time_series(offset + other.m_stats.size());
+        for (unsigned int i = 0; i < other.m_stats.size(); i++) {
+            m_stats[offset + i].merge(other.m_stats[i]);
         }
     }
 
-    if (new_stats) {
-        sort(m_stats.begin(), m_stats.end(), one_second_stats_predicate);
-    }
-
     // aggregate totals
+    m_run_totals.merge_counters(other.m_run_totals);
+    m_intervals += other.m_intervals;
     m_totals.m_bytes += other.m_totals.m_bytes;
     m_totals.m_ops += other.m_totals.m_ops;
     
     // aggregate latency data
-    for (latency_map_itr_const it = other.m_get_latency_map.begin() ; it != other.m_get_latency_map.end() ; it++) {
-	    m_get_latency_map[it->first] += it->second;
-    }
-    for (latency_map_itr_const it = other.m_set_latency_map.begin() ; it != other.m_set_latency_map.end() ; it++) {
-	    m_set_latency_map[it->first] += it->second;
-    }
-    for (latency_map_itr_const it = other.m_wait_latency_map.begin() ; it != other.m_wait_latency_map.end() ; it++) {
-        m_wait_latency_map[it->first] += it->second;
+    m_get_latency_histogram.add(other.m_get_latency_histogram);
+    m_set_latency_histogram.add(other.m_set_latency_histogram);
+    m_wait_latency_histogram.add(other.m_wait_latency_histogram);
+    m_queueing_latency_histogram.add(other.m_queueing_latency_histogram);
+    m_server_latency_histogram.add(other.m_server_latency_histogram);
+    m_receive_latency_histogram.add(other.m_receive_latency_histogram);
+
+    for (std::map<std::string, shard_stats>::const_iterator i = other.m_shards.begin();
+         i != other.m_shards.end(); i++) {
+        m_shards[i->first].merge(i->second);
     }
 }
 
 void run_stats::summarize(totals& result) const
 {
-    // aggregate all one_second_stats
-    one_second_stats totals(0);
-    for (std::vector<one_second_stats>::const_iterator i = m_stats.begin();
-            i != m_stats.end(); i++) {
-                totals.merge(*i);
-    }
+    const one_second_stats& totals = m_run_totals;
 
-    unsigned long int test_duration_usec = ts_diff(m_start_time, m_end_time);
+    unsigned long int test_duration_usec = (m_end_time - m_start_time) / NSEC_PER_USEC;
 
     result.m_ops_set = totals.m_ops_set;
     result.m_ops_get = totals.m_ops_get;
@@ -1633,7 +2266,7 @@ void run_stats::summarize(totals& result) const
 
     result.m_ops_sec_set = (double) totals.m_ops_set / test_duration_usec * 1000000;
     if (totals.m_ops_set > 0) {
-        result.m_latency_set = (double) (totals.m_total_set_latency / totals.m_ops_set) / 1000;
+        result.m_latency_set = (double) totals.m_total_set_latency / totals.m_ops_set / NSEC_PER_MSEC;
     } else {
         result.m_latency_set = 0;
     }
@@ -1641,7 +2274,7 @@ void run_stats::summarize(totals& result) const
 
     result.m_ops_sec_get = (double) totals.m_ops_get / test_duration_usec * 1000000;
     if (totals.m_ops_get > 0) {
-        result.m_latency_get = (double) (totals.m_total_get_latency / totals.m_ops_get) / 1000;
+        result.m_latency_get = (double) totals.m_total_get_latency / totals.m_ops_get / NSEC_PER_MSEC;
     } else {
         result.m_latency_get = 0;
     }
@@ -1651,21 +2284,22 @@ void run_stats::summarize(totals& result) const
 
     result.m_ops_sec_wait =  (double) totals.m_ops_wait / test_duration_usec * 1000000;
     if (totals.m_ops_wait > 0) {
-        result.m_latency_wait = (double) (totals.m_total_wait_latency / totals.m_ops_wait) / 1000;
+        result.m_latency_wait = (double) totals.m_total_wait_latency / totals.m_ops_wait / NSEC_PER_MSEC;
     } else {
         result.m_latency_wait = 0;
     }
 
     result.m_ops_sec = (double) result.m_ops / test_duration_usec * 1000000;
     if (result.m_ops > 0) {
-        result.m_latency = (double) ((totals.m_total_get_latency + totals.m_total_set_latency + totals.m_total_wait_latency) / result.m_ops) / 1000;
+        result.m_latency = (double) (totals.m_total_get_latency + totals.m_total_set_latency + totals.m_total_wait_latency) / result.m_ops / NSEC_PER_MSEC;
     } else {
         result.m_latency = 0;
     }
     result.m_bytes_sec = (result.m_bytes / 1024.0) / test_duration_usec * 1000000;
 }
 
-void result_print_to_json(json_handler * jsonhandler, const char * type, unsigned long int total_ops, float ops, float hits, float miss, float latency, float kbs)
+void result_print_to_json(json_handler * jsonhandler, const char * type, unsigned long int total_ops, float ops, float hits, float miss, float latency, float kbs,
+                          const latency_histogram& histogram, const std::vector<float>& quantiles)
 {
     if (jsonhandler != NULL){ // Added for double verification in case someone accidently send NULL.
         jsonhandler->open_nesting(type);
@@ -1674,6 +2308,13 @@ void result_print_to_json(json_handler * jsonhandler, const char * type, unsigne
         jsonhandler->write_obj("Hits/sec","%.2f", hits);
         jsonhandler->write_obj("Misses/sec","%.2f", miss);
         jsonhandler->write_obj("Latency","%.2f", latency);
+        jsonhandler->open_nesting("Percentile Latencies");
+        for (std::vector<float>::const_iterator i = quantiles.begin(); i != quantiles.end(); i++) {
+            char quantile_name[32];
+            snprintf(quantile_name, sizeof(quantile_name)-1, "p%.2f", *i);
+            jsonhandler->write_obj(quantile_name, "%.3f", histogram.value_at_percentile(*i) / (double) NSEC_PER_MSEC);
+        }
+        jsonhandler->close_nesting();
         jsonhandler->write_obj("KB/sec","%.2f", kbs);
         jsonhandler->close_nesting();
     }
@@ -1690,7 +2331,145 @@ void histogram_print(FILE * out, json_handler * jsonhandler, const char * type,
     }            
 }
 
-void run_stats::print(FILE *out, bool histogram, const char * header/*=NULL*/,  json_handler * jsonhandler/*=NULL*/)
+static void histogram_print_distribution(FILE * out, json_handler * jsonhandler, const char * type, const latency_histogram& histogram)
+{
+    if (jsonhandler != NULL){ jsonhandler->open_nesting(type, NESTED_ARRAY);}
+    latency_histogram::percentile_iterator it(&histogram, LATENCY_HDR_RESULTS_TICKS);
+    while (it.next()) {
+        histogram_print(out, jsonhandler, type, it.value / (double) NSEC_PER_MSEC, it.percentile);
+    }
+    if (jsonhandler != NULL){ jsonhandler->close_nesting();}
+}
+
+static void quantiles_print(FILE * out, const latency_histogram& histogram, const std::vector<float>& quantiles)
+{
+    for (std::vector<float>::const_iterator i = quantiles.begin(); i != quantiles.end(); i++) {
+        fprintf(out, " %14.05f", histogram.value_at_percentile(*i) / (double) NSEC_PER_MSEC);
+    }
+    fprintf(out, "\n");
+}
+
+static void time_series_print_to_json(json_handler * jsonhandler, const char * type, unsigned long int ops, unsigned long long int total_latency,
+                                      const latency_histogram& histogram, const std::vector<float>& quantiles)
+{
+    jsonhandler->open_nesting(type);
+    jsonhandler->write_obj("Count","%lu", ops);
+    jsonhandler->write_obj("Average Latency","%.3f", ops > 0 ? (double) total_latency / ops / NSEC_PER_MSEC : 0.0);
+    jsonhandler->write_obj("Max Latency","%.3f", histogram.get_max() / (double) NSEC_PER_MSEC);
+    for (std::vector<float>::const_iterator i = quantiles.begin(); i != quantiles.end(); i++) {
+        char quantile_name[32];
+        snprintf(quantile_name, sizeof(quantile_name)-1, "p%.2f", *i);
+        jsonhandler->write_obj(quantile_name, "%.3f", histogram.value_at_percentile(*i) / (double) NSEC_PER_MSEC);
+    }
+    jsonhandler->close_nesting();
+}
+
+static void latency_breakdown_print(FILE * out, json_handler * jsonhandler, const char * stage,
+                                    const latency_histogram& histogram, const std::vector<float>& quantiles)
+{
+    fprintf(out, "%-15s %12lu %12.05f",
+            stage, (unsigned long) histogram.get_total_count(), histogram.get_mean() / NSEC_PER_MSEC);
+    quantiles_print(out, histogram, quantiles);
+
+    if (jsonhandler != NULL) {
+        jsonhandler->open_nesting(stage);
+        jsonhandler->write_obj("Count","%lu", (unsigned long) histogram.get_total_count());
+        jsonhandler->write_obj("Average Latency","%.3f", histogram.get_mean() / NSEC_PER_MSEC);
+        jsonhandler->write_obj("Max Latency","%.3f", histogram.get_max() / (double) NSEC_PER_MSEC);
+        for (std::vector<float>::const_iterator i = quantiles.begin(); i != quantiles.end(); i++) {
+            char quantile_name[32];
+            snprintf(quantile_name, sizeof(quantile_name)-1, "p%.2f", *i);
+            jsonhandler->write_obj(quantile_name, "%.3f", histogram.value_at_percentile(*i) / (double) NSEC_PER_MSEC);
+        }
+        jsonhandler->close_nesting();
+    }
+}
+
+void run_stats::print_latency_breakdown(FILE *out, json_handler* jsonhandler, const std::vector<float>& quantiles)
+{
+    fprintf(out,
+           "\n\n"
+           "Latency Breakdown\n"
+           "%-15s %12s %12s",
+           "Stage", "Count", "Latency");
+    for (std::vector<float>::const_iterator i = quantiles.begin(); i != quantiles.end(); i++) {
+        char quantile_header[32];
+        snprintf(quantile_header, sizeof(quantile_header)-1, "p%g Latency", *i);
+        fprintf(out, " %14s", quantile_header);
+    }
+    fprintf(out, "\n"
+           "------------------------------------------------------------------------");
+    for (unsigned int i = 0; i < quantiles.size(); i++) {
+        fprintf(out, "---------------");
+    }
+    fprintf(out, "\n");
+
+    if (jsonhandler != NULL) { jsonhandler->open_nesting("Latency Breakdown"); }
+    latency_breakdown_print(out, jsonhandler, "Queueing", m_queueing_latency_histogram, quantiles);
+    latency_breakdown_print(out, jsonhandler, "Network+Server", m_server_latency_histogram, quantiles);
+    latency_breakdown_print(out, jsonhandler, "Receive", m_receive_latency_histogram, quantiles);
+    if (jsonhandler != NULL) { jsonhandler->close_nesting(); }
+}
+
+void run_stats::print_shards(FILE *out, json_handler* jsonhandler, const std::vector<float>& quantiles)
+{
+    unsigned long int test_duration_usec = (m_end_time - m_start_time) / NSEC_PER_USEC;
+
+    fprintf(out,
+           "\n\n"
+           "Shards\n"
+           "%-21s %12s %12s %12s",
+           "Shard", "Ops/sec", "Latency", "KB/sec");
+    for (std::vector<float>::const_iterator i = quantiles.begin(); i != quantiles.end(); i++) {
+        char quantile_header[32];
+        snprintf(quantile_header, sizeof(quantile_header)-1, "p%g Latency", *i);
+        fprintf(out, " %14s", quantile_header);
+    }
+    fprintf(out, "\n"
+           "------------------------------------------------------------------------");
+    for (unsigned int i = 0; i < quantiles.size(); i++) {
+        fprintf(out, "---------------");
+    }
+    fprintf(out, "\n");
+
+    if (jsonhandler != NULL) { jsonhandler->open_nesting("Shards"); }
+    for (std::map<std::string, shard_stats>::const_iterator i = m_shards.begin(); i != m_shards.end(); i++) {
+        const shard_stats& shard = i->second;
+        double ops_sec = test_duration_usec > 0 ? (double) shard.m_ops / test_duration_usec * 1000000 : 0;
+        double kb_sec = test_duration_usec > 0 ? (shard.m_bytes / 1024.0) / test_duration_usec * 1000000 : 0;
+        double latency = shard.m_latency_histogram.get_total_count() > 0 ?
+            (double) shard.m_total_latency / shard.m_latency_histogram.get_total_count() / NSEC_PER_MSEC : 0;
+
+        fprintf(out, "%-21s %12.2f %12.05f %12.2f", i->first.c_str(), ops_sec, latency, kb_sec);
+        quantiles_print(out, shard.m_latency_histogram, quantiles);
+
+        result_print_to_json(jsonhandler, i->first.c_str(), shard.m_ops, ops_sec, 0.0, 0.0,
+                             latency, kb_sec, shard.m_latency_histogram, quantiles);
+    }
+    if (jsonhandler != NULL) { jsonhandler->close_nesting(); }
+}
+
+void run_stats::print_json_time_series(json_handler* jsonhandler, const std::vector<float>& quantiles)
+{
+    jsonhandler->open_nesting("Time-Serie");
+    for (std::vector<one_second_stats>::const_iterator i = m_stats.begin();
+            i != m_stats.end(); i++) {
+        char second[32];
+        snprintf(second, sizeof(second)-1, "%u", i->m_second);
+
+        jsonhandler->open_nesting(second);
+        time_series_print_to_json(jsonhandler, "Sets", i->m_ops_set, i->m_total_set_latency,
+                                  i->m_set_latency_histogram, quantiles);
+        time_series_print_to_json(jsonhandler, "Gets", i->m_ops_get, i->m_total_get_latency,
+                                  i->m_get_latency_histogram, quantiles);
+        time_series_print_to_json(jsonhandler, "Waits", i->m_ops_wait, i->m_total_wait_latency,
+                                  i->m_wait_latency_histogram, quantiles);
+        jsonhandler->close_nesting();
+    }
+    jsonhandler->close_nesting();
+}
+
+void run_stats::print(FILE *out, bool histogram, const std::vector<float>& quantiles, const char * header/*=NULL*/,  json_handler * jsonhandler/*=NULL*/)
 {
     // Add header if not printed:
     if (header != NULL){
@@ -1707,48 +2486,68 @@ void run_stats::print(FILE *out, bool histogram, const char * header/*=NULL*/,
     // aggregate all one_second_stats; we do this only if we have
     // one_second_stats, otherwise it means we're probably printing previously
     // aggregated data
-    if (m_stats.size() > 0) {
+    if (m_intervals > 0) {
         summarize(m_totals);
     }
 
+    latency_histogram total_latency_histogram;
+    total_latency_histogram.add(m_set_latency_histogram);
+    total_latency_histogram.add(m_get_latency_histogram);
+    total_latency_histogram.add(m_wait_latency_histogram);
+
     // print results
     fprintf(out,
-           "%-6s %12s %12s %12s %12s %12s\n"
-           "------------------------------------------------------------------------\n",
+           "%-6s %12s %12s %12s %12s %12s",
            "Type", "Ops/sec", "Hits/sec", "Misses/sec", "Latency", "KB/sec");
+    for (std::vector<float>::const_iterator i = quantiles.begin(); i != quantiles.end(); i++) {
+        char quantile_header[32];
+        snprintf(quantile_header, sizeof(quantile_header)-1, "p%g Latency", *i);
+        fprintf(out, " %14s", quantile_header);
+    }
+    fprintf(out, "\n"
+           "------------------------------------------------------------------------");
+    for (unsigned int i = 0; i < quantiles.size(); i++) {
+        fprintf(out, "---------------");
+    }
+    fprintf(out, "\n");
+
     fprintf(out,
-           "%-6s %12.2f %12s %12s %12.05f %12.2f\n",
+           "%-6s %12.2f %12s %12s %12.05f %12.2f",
            "Sets",
            m_totals.m_ops_sec_set,
            "---", "---",
            m_totals.m_latency_set,
            m_totals.m_bytes_sec_set);
+    quantiles_print(out, m_set_latency_histogram, quantiles);
 
     fprintf(out,
-           "%-6s %12.2f %12.2f %12.2f %12.05f %12.2f\n",
+           "%-6s %12.2f %12.2f %12.2f %12.05f %12.2f",
            "Gets",
            m_totals.m_ops_sec_get,
            m_totals.m_hits_sec,
            m_totals.m_misses_sec,
            m_totals.m_latency_get,
            m_totals.m_bytes_sec_get);
+    quantiles_print(out, m_get_latency_histogram, quantiles);
 
     fprintf(out,
-            "%-6s %12.2f %12s %12s %12.05f %12s\n",
+            "%-6s %12.2f %12s %12s %12.05f %12s",
             "Waits",
             m_totals.m_ops_sec_wait,
             "---", "---",
             m_totals.m_latency_wait,
             "---");
+    quantiles_print(out, m_wait_latency_histogram, quantiles);
 
     fprintf(out,
-           "%-6s %12.2f %12.2f %12.2f %12.05f %12.2f\n",
+           "%-6s %12.2f %12.2f %12.2f %12.05f %12.2f",
            "Totals",
            m_totals.m_ops_sec,
            m_totals.m_hits_sec,
            m_totals.m_misses_sec,
            m_totals.m_latency,
            m_totals.m_bytes_sec);
+    quantiles_print(out, total_latency_histogram, quantiles);
 
     ////////////////////////////////////////
     // JSON print handling
@@ -1759,25 +2558,44 @@ void run_stats::print(FILE *out, bool histogram, const char * header/*=NULL*/,
                                                 0.0,
                                                 0.0,
                                                 m_totals.m_latency_set,
-                                                m_totals.m_bytes_sec_set);
+                                                m_totals.m_bytes_sec_set,
+                                                m_set_latency_histogram,
+                                                quantiles);
         result_print_to_json(jsonhandler,"Gets",m_totals.m_ops_get,
                                                 m_totals.m_ops_sec_get,
                                                 m_totals.m_hits_sec,
                                                 m_totals.m_misses_sec,
                                                 m_totals.m_latency_get,
-                                                m_totals.m_bytes_sec_get);
+                                                m_totals.m_bytes_sec_get,
+                                                m_get_latency_histogram,
+                                                quantiles);
         result_print_to_json(jsonhandler,"Waits",m_totals.m_ops_wait,
                                                 m_totals.m_ops_sec_wait,
                                                 0.0,
                                                 0.0,
                                                 m_totals.m_latency_wait,
-                                                0.0);
+                                                0.0,
+                                                m_wait_latency_histogram,
+                                                quantiles);
         result_print_to_json(jsonhandler,"Totals", m_totals.m_ops,
                                                 m_totals.m_ops_sec,
                                                 m_totals.m_hits_sec,
                                                 m_totals.m_misses_sec,
                                                 m_totals.m_latency,
-                                                m_totals.m_bytes_sec);
+                                                m_totals.m_bytes_sec,
+                                                total_latency_histogram,
+                                                quantiles);
+        print_json_time_series(jsonhandler, quantiles);
+    }
+
+    // only recorded with --latency-breakdown
+    if (m_queueing_latency_histogram.get_total_count() > 0) {
+        print_latency_breakdown(out, jsonhandler, quantiles);
+    }
+
+    // only kept with --cluster-mode or --servers
+    if (!m_shards.empty()) {
+        print_shards(out, jsonhandler, quantiles);
     }
 
     if (histogram)
@@ -1789,35 +2607,17 @@ void run_stats::print(FILE *out, bool histogram, const char * header/*=NULL*/,
             "------------------------------------------------------------------------\n",
             "Type", "<= msec   ", "Percent");    
             
-        unsigned long int total_count = 0;
         // SETs
         // ----
-        if (jsonhandler != NULL){ jsonhandler->open_nesting("SET",NESTED_ARRAY);}
-        for( latency_map_itr_const it = m_set_latency_map.begin() ; it != m_set_latency_map.end() ; it++) {
-            total_count += it->second;
-            histogram_print(out, jsonhandler, "SET",it->first,(double) total_count / m_totals.m_ops_set * 100);
-        }
-        if (jsonhandler != NULL){ jsonhandler->close_nesting();}
+        histogram_print_distribution(out, jsonhandler, "SET", m_set_latency_histogram);
         fprintf(out, "---\n");
         // GETs
         // ----
-        total_count = 0;
-        if (jsonhandler != NULL){ jsonhandler->open_nesting("GET",NESTED_ARRAY);}
-        for( latency_map_itr_const it = m_get_latency_map.begin() ; it != m_get_latency_map.end() ; it++) {
-            total_count += it->second;
-            histogram_print(out, jsonhandler, "GET",it->first,(double) total_count / m_totals.m_ops_get * 100);
-        }
-        if (jsonhandler != NULL){ jsonhandler->close_nesting();}
+        histogram_print_distribution(out, jsonhandler, "GET", m_get_latency_histogram);
         fprintf(out, "---\n");
         // WAITs
         // ----
-        total_count = 0;
-        if (jsonhandler != NULL){ jsonhandler->open_nesting("WAIT",NESTED_ARRAY);}
-        for( latency_map_itr_const it = m_wait_latency_map.begin() ; it != m_wait_latency_map.end() ; it++) {
-            total_count += it->second;
-            histogram_print(out, jsonhandler, "WAIT",it->first,(double) total_count / m_totals.m_ops_wait * 100);
-        }
-        if (jsonhandler != NULL){ jsonhandler->close_nesting();}
+        histogram_print_distribution(out, jsonhandler, "WAIT", m_wait_latency_histogram);
     }
     // This close_nesting closes either:
     //      jsonhandler->open_nesting(header); or
@@ -1825,4 +2625,3 @@ void run_stats::print(FILE *out, bool histogram, const char * header/*=NULL*/,
     //      From the top (beginning of function). 
     if (jsonhandler != NULL){ jsonhandler->close_nesting();}
 }
-
@@ -25,16 +25,22 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <vector>
-#include <queue>
+#include <deque>
 #include <map>
 #include <iterator>
+#include <string>
 #include <event2/event.h>
 #include <event2/buffer.h>
 
 #include "protocol.h"
 #include "JSON_handler.h"
+#include "histogram.h"
+#include "obj_gen.h"
+#include "live_stats.h"
+#include "clock_source.h"
 
 class client;               // forward decl
+class shard_connection;     // forward decl
 class client_group;         // forward decl
 struct benchmark_config;
 class verify_client_group;  // forward decl
@@ -42,10 +48,6 @@ class verify_client_group;  // forward decl
 class object_generator;
 class data_object;
 
-typedef std::map<float, int> latency_map;
-typedef std::map<float, int>::iterator latency_map_itr;
-typedef std::map<float, int>::const_iterator latency_map_itr_const;
-
 class run_stats {
 protected:
     struct one_second_stats {
@@ -63,15 +65,19 @@ protected:
         unsigned long long int m_total_set_latency;
         unsigned long long int m_total_wait_latency;
 
+        latency_histogram m_get_latency_histogram;
+        latency_histogram m_set_latency_histogram;
+        latency_histogram m_wait_latency_histogram;
+
         one_second_stats(unsigned int second);
         void reset(unsigned int second);
         void merge(const one_second_stats& other);
+        void merge_counters(const one_second_stats& other);
     };
 
-    friend bool one_second_stats_predicate(const run_stats::one_second_stats& a, const run_stats::one_second_stats& b);    
-
-    struct timeval m_start_time;
-    struct timeval m_end_time;
+    uint64_t m_start_time;            // clock_now() nsec
+    uint64_t m_end_time;
+    uint64_t m_time_series_base;      // m_stats[i] covers [base + i sec, base + i + 1 sec)
 
     struct totals {
         double m_ops_sec_set;
@@ -104,24 +110,61 @@ protected:
         void add(const totals& other);
     } m_totals;
 
-    std::vector<one_second_stats> m_stats;
+    std::vector<one_second_stats> m_stats;     // dense, indexed by m_second
     one_second_stats m_cur_stats;
+    one_second_stats m_run_totals;      // counters of all completed seconds, without histograms
+    unsigned int m_intervals;           // number of completed seconds
+    bool m_keep_time_series;            // keep completed seconds in m_stats
+
+    latency_histogram m_get_latency_histogram;
+    latency_histogram m_set_latency_histogram;
+    latency_histogram m_wait_latency_histogram;
+
+    // --latency-breakdown: where the time of each request went
+    latency_histogram m_queueing_latency_histogram;     // created -> written to the socket
+    latency_histogram m_server_latency_histogram;       // written -> first response byte read
+    latency_histogram m_receive_latency_histogram;      // first response byte -> response parsed
+
+    live_stats* m_live_stats;           // running totals visible to the reporting thread
+
+public:
+    // results of the requests sent to one server, when there are several
+    struct shard_stats {
+        unsigned long int m_ops;
+        unsigned long int m_bytes;
+        unsigned long long int m_total_latency;
+        latency_histogram m_latency_histogram;
 
-    latency_map m_get_latency_map;
-    latency_map m_set_latency_map;
-    latency_map m_wait_latency_map;
-    void roll_cur_stats(struct timeval* ts);
+        shard_stats();
+        void update_op(unsigned int ops, unsigned int bytes, uint64_t latency);
+        void merge(const shard_stats& other);
+    };
+protected:
+    std::map<std::string, shard_stats> m_shards;    // by host:port
+
+    void extend_time_series(unsigned int seconds);
+    void complete_cur_stats(void);
+    void roll_cur_stats(uint64_t ts);
+    void print_json_time_series(json_handler* jsonhandler, const std::vector<float>& quantiles);
+    void print_latency_breakdown(FILE *out, json_handler* jsonhandler, const std::vector<float>& quantiles);
+    void print_shards(FILE *out, json_handler* jsonhandler, const std::vector<float>& quantiles);
 
 public:
     run_stats();
-    void set_start_time(struct timeval* start_time);
-    void set_end_time(struct timeval* end_time);
+    void set_start_time(uint64_t start_time);
+    void set_time_series_base(uint64_t base);
+    void set_end_time(uint64_t end_time);
+    void set_live_stats(live_stats* stats);
+    void set_keep_time_series(bool keep);
 
-    void update_get_op(struct timeval* ts, unsigned int bytes, unsigned int latency, unsigned int hits, unsigned int misses);
-    void update_set_op(struct timeval* ts, unsigned int bytes, unsigned int latency);
-    void update_wait_op(struct timeval* ts, unsigned int latency);
+    // timestamps and latencies are in nsec
+    void update_get_op(uint64_t ts, unsigned int bytes, uint64_t latency, unsigned int hits, unsigned int misses);
+    void update_set_op(uint64_t ts, unsigned int bytes, uint64_t latency);
+    void update_wait_op(uint64_t ts, uint64_t latency);
 
-	void update_get_latency_map(unsigned int latency);
+    void update_get_latency_histogram(uint64_t latency);
+    void update_latency_breakdown(uint64_t queueing, uint64_t server, uint64_t receive);
+    shard_stats* get_shard_stats(const char *name);
 
     void update_verified_keys(unsigned long int keys);
     void update_errors(unsigned long int errors);
@@ -129,11 +172,13 @@ public:
     void aggregate_average(const std::vector<run_stats>& all_stats);
     void summarize(totals& result) const;
     void merge(const run_stats& other, int iteration);
-    bool save_csv(const char *filename);
+    bool save_csv(const char *filename, const std::vector<float>& quantiles);
+    bool export_stats(const char *filename);
+    bool import_stats(const char *filename);
     void debug_dump(void);
-    void print(FILE *file, bool histogram, const char* header = NULL, json_handler* jsonhandler = NULL);
+    void print(FILE *file, bool histogram, const std::vector<float>& quantiles, const char* header = NULL, json_handler* jsonhandler = NULL);
     
-    unsigned int get_duration(void);
+    uint64_t get_start_time(void) { return m_start_time; }
     unsigned long int get_duration_usec(void);
     unsigned long int get_total_bytes(void);
     unsigned long int get_total_ops(void);
@@ -144,38 +189,72 @@ public:
 
 class client {
 protected:
-    friend void client_event_handler(evutil_socket_t sfd, short evtype, void *opaque);
+    friend class shard_connection;
+    friend void shard_connection_event_handler(evutil_socket_t sfd, short evtype, void *opaque);
+    friend void client_rate_event_handler(evutil_socket_t sfd, short evtype, void *opaque);
+    friend class io_uring_engine;
 
     // connection related
-    int m_sockfd;
-    struct sockaddr_un* m_unix_sockaddr;
-    struct event* m_event;
     struct event_base* m_event_base;
-    struct evbuffer *m_read_buf;
-    struct evbuffer *m_write_buf;
     bool m_initialized;
-    bool m_connected;
-    enum authentication_state { auth_none, auth_sent, auth_done } m_authentication;
-    enum select_db_state { select_none, select_sent, select_done } m_db_selection;
+    uint64_t m_now;                     // clock_now(), cached at the start of every event callback
+    std::vector<shard_connection*> m_connections;
+    std::vector<unsigned short> m_slot_connections;     // cluster mode: hash slot -> index in m_connections
+    std::vector<keylist*> m_server_keylists;            // server pool: keys of a multi-get, by connection
 
     // test related
     benchmark_config* m_config;
-    abstract_protocol* m_protocol;
+    abstract_protocol* m_base_protocol; // cloned by every connection, not owned
+    bool m_keep_value;                  // connections' protocols keep received values
     object_generator* m_obj_gen;
     run_stats m_stats;
 
     // pipeline management
-    enum request_type { rt_unknown, rt_set, rt_get, rt_wait,rt_auth, rt_select_db };
+    enum request_type { rt_unknown, rt_set, rt_get, rt_wait,rt_auth, rt_select_db, rt_handshake, rt_asking, rt_publish, rt_subscribe };
+
+    // a multi-get sent to several servers, one request per server; it
+    // completes (and is accounted for as one operation) with its last part
+    struct split_request {
+        unsigned int m_parts;           // parts not answered yet
+        unsigned int m_refs;            // parts not deleted yet
+        unsigned int m_keys;
+        unsigned int m_bytes;
+        unsigned int m_hits;
+
+        split_request(unsigned int parts, unsigned int keys);
+    };
+
+    // cluster mode: the arguments of a SET or GET, to write it again on the
+    // connection it is redirected to.  pool values never change, so a value
+    // is only copied if the generator modifies its buffer in place.
+    struct command_args {
+        std::string m_key;
+        const char *m_value;            // NULL for a GET
+        unsigned int m_value_len;
+        unsigned int m_expiry;
+        std::string m_value_copy;
+
+        command_args(const char *key, unsigned int key_len, const char *value, unsigned int value_len,
+            unsigned int expiry, bool copy_value);
+    };
+
     struct request {
         request_type m_type;
-        struct timeval m_sent_time;
+        uint64_t m_sent_time;           // intended send time when rate limited
+        uint64_t m_write_end;           // m_bytes_written of its connection once the request is fully written
+        uint64_t m_write_time;          // when the request was fully written to the socket
+        uint64_t m_first_byte_time;     // when the first byte of the response was read
         unsigned int m_size;
         unsigned int m_keys;
+        command_args *m_args;           // cluster mode: to write the command again when redirected
+        unsigned int m_redirects;       // cluster mode: times the request was redirected
+        split_request *m_split;         // server pool: the multi-get this is a part of, if split
 
-        request(request_type type, unsigned int size, struct timeval* sent_time, unsigned int keys);
-        virtual ~request(void) {}
+        request(request_type type, unsigned int size, uint64_t sent_time, unsigned int keys);
+        virtual ~request(void);
     };
-    std::queue<request *> m_pipeline;
+    unsigned int m_pending_requests;    // requests created for any connection and not yet answered
+                                        // (a split multi-get counts once)
 
     unsigned int m_reqs_processed;      // requests processed (responses received)
     unsigned int m_set_ratio_count;     // number of sets counter (overlaps on ratio)
@@ -186,22 +265,47 @@ protected:
 
     keylist *m_keylist;                 // used to construct multi commands
 
+    // open-loop (rate limited) mode
+    struct event* m_rate_event;         // fires when the next request is due
+    random_generator m_rate_random;
+    uint64_t m_rate_start;
+    double m_rate_interval;             // mean nsec between requests, 0 if not rate limited
+    double m_next_request_offset;       // nsec from m_rate_start to the next intended send
+
     bool setup_client(benchmark_config *config, abstract_protocol *protocol, object_generator *obj_gen);
+    shard_connection* add_connection(struct server_addr *addr, bool addr_owned, const char *name);
+    shard_connection* get_connection(const char *host, unsigned int port);
     int connect(void);
     void disconnect(void);
 
-    void handle_event(short evtype);
-    int get_sockfd(void) { return m_sockfd; }
+    void connection_ready(shard_connection *conn);
+    void write_pending(void);
+    bool stop_if_finished(void);
+    void set_keep_value(bool flag);
 
     virtual bool finished();
-    virtual void create_request(struct timeval timestamp);
-    virtual void handle_response(struct timeval timestamp, request *request, protocol_response *response);
-
-    bool send_conn_setup_commands(struct timeval timestamp);
-    bool is_conn_setup_done(void);
-    void fill_pipeline(void);
+    virtual void create_request(uint64_t timestamp);
+    virtual void handle_response(uint64_t timestamp, request *request, protocol_response *response);
+    virtual void handle_message(uint64_t timestamp, protocol_response *response);
+    virtual request* create_multi_get_request(unsigned int size, uint64_t timestamp, keylist *keys);
+
+    void update_get_stats(uint64_t timestamp, request *request, protocol_response *response);
+    void send_multi_get(uint64_t timestamp);
+    shard_connection* route(const char *key, unsigned int key_len);
+    void push_request(shard_connection *conn, request *req);
+    void save_command_args(request *req, const char *key, unsigned int key_len,
+        const char *value, unsigned int value_len, unsigned int expiry);
+    bool connections_ready(uint64_t timestamp);
+    bool pipeline_full(void);
+    virtual void fill_pipeline(void);
+    void handle_rate_event(void);
+    uint64_t get_next_request_time(void);
+    void advance_next_request_time(void);
     void process_first_request(void);
-    void process_response(void);
+    void record_latency_breakdown(request *req);
+    bool redirect_request(shard_connection *conn, request *req, protocol_response *response);
+    bool process_reply(shard_connection *conn, request *req, protocol_response *response);
+    void responses_processed(bool handled);
 public:
     client(client_group* group);
     client(struct event_base *event_base, benchmark_config *config, abstract_protocol *protocol, object_generator *obj_gen);
@@ -222,7 +326,7 @@ protected:
 
         verify_request(request_type type, 
             unsigned int size, 
-            struct timeval* sent_time,
+            uint64_t sent_time,
             unsigned int keys,
             const char *key,
             unsigned int key_len,
@@ -235,8 +339,8 @@ protected:
     unsigned long long int m_errors;
 
     virtual bool finished(void);
-    virtual void create_request(struct timeval timestamp);
-    virtual void handle_response(struct timeval timestamp, request *request, protocol_response *response);
+    virtual void create_request(uint64_t timestamp);
+    virtual void handle_response(uint64_t timestamp, request *request, protocol_response *response);
 public:
     verify_client(struct event_base *event_base, benchmark_config *config, abstract_protocol *protocol, object_generator *obj_gen);
     unsigned long long int get_verified_keys(void);
@@ -250,7 +354,7 @@ protected:
 
         verify_request(request_type type,
                        unsigned int size,
-                       struct timeval* sent_time,
+                       uint64_t sent_time,
                        unsigned int keys,
                        keylist keylist);
         virtual ~verify_request(void);
@@ -258,14 +362,48 @@ protected:
     unsigned long int m_verified_keys;
     unsigned long int m_errors;
 
-    virtual void create_request(struct timeval timestamp);
-    virtual void handle_response(struct timeval timestamp, request *request, protocol_response *response);
+    virtual void create_request(uint64_t timestamp);
+    virtual void handle_response(uint64_t timestamp, request *request, protocol_response *response);
+    virtual request* create_multi_get_request(unsigned int size, uint64_t timestamp, keylist *keys);
 public:
     explicit crc_verify_client(verify_client_group* group);
     unsigned long int get_verified_keys(void);
     unsigned long int get_errors(void);
 };
 
+// pub/sub mode: publishes to the channels, with the send time at the start
+// of every payload.  Publishes are accounted for as sets.
+class publisher_client : public client {
+protected:
+    std::vector<std::string> m_channels;
+    unsigned int m_next_channel;
+    std::vector<char> m_payload;
+
+    virtual void create_request(uint64_t timestamp);
+    virtual void handle_response(uint64_t timestamp, request *request, protocol_response *response);
+public:
+    explicit publisher_client(client_group* group);
+};
+
+// pub/sub mode: subscribes to the channels (or patterns) and accounts for
+// every message received as a get hit, with its publish to delivery latency
+class subscriber_client : public client {
+    friend void subscriber_end_event_handler(evutil_socket_t sfd, short evtype, void *opaque);
+protected:
+    std::vector<std::string> m_channels;
+    bool m_patterns;
+    bool m_subscribed;
+    struct event* m_end_event;          // fires when the test time is up, as messages may not
+
+    virtual void fill_pipeline(void);
+    virtual void handle_response(uint64_t timestamp, request *request, protocol_response *response);
+    virtual void handle_message(uint64_t timestamp, protocol_response *response);
+    void handle_end_event(void);
+public:
+    explicit subscriber_client(client_group* group);
+    virtual ~subscriber_client();
+};
+
 class client_group {
 protected:
     struct event_base* m_base;
@@ -273,12 +411,15 @@ protected:
     abstract_protocol* m_protocol;
     object_generator* m_obj_gen;
     std::vector<client*> m_clients;
+
+    live_stats m_live_stats;
 public:
     client_group(benchmark_config *cfg, abstract_protocol *protocol, object_generator* obj_gen);
     virtual ~client_group();
 
     virtual int create_clients(int count);
     int prepare(void);
+    void set_time_series_base(uint64_t base);
     void run(void);
 
     void write_client_stats(const char *prefix);
@@ -286,16 +427,26 @@ public:
     struct event_base *get_event_base(void) { return m_base; }
     benchmark_config *get_config(void) { return m_config; }
     abstract_protocol* get_protocol(void) { return m_protocol; }
-    object_generator* get_obj_gen(void) { return m_obj_gen; }    
+    object_generator* get_obj_gen(void) { return m_obj_gen; }
+    live_stats* get_live_stats(void) { return &m_live_stats; }    
 
     unsigned long int get_total_bytes(void);
     unsigned long int get_total_ops(void);
     unsigned long int get_total_latency(void);
     unsigned long int get_duration_usec(void);
+    void collect_interval(live_stats_interval* target);
 
     virtual void merge_run_stats(run_stats* target);
 };
 
+// the first --pubsub-subscribers clients subscribe, the others publish
+class pubsub_client_group : public client_group {
+public:
+    pubsub_client_group(benchmark_config *cfg, abstract_protocol *protocol, object_generator* obj_gen);
+
+    virtual int create_clients(int count);
+};
+
 class verify_client_group : public client_group {
 public:
     verify_client_group(benchmark_config *cfg, abstract_protocol *protocol, object_generator* obj_gen);
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2011-2017 Redis Labs Ltd.
+ *
+ * This file is part of memtier_benchmark.
+ *
+ * memtier_benchmark is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * memtier_benchmark is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memtier_benchmark.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <time.h>
+
+#ifdef HAVE_ASSERT_H
+#include <assert.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define CLOCK_SOURCE_HAVE_TSC
+#endif
+
+#include "clock_source.h"
+
+// how long to measure the TSC frequency against CLOCK_MONOTONIC
+#define TSC_CALIBRATION_NSEC    (50 * NSEC_PER_MSEC)
+
+enum clock_source_type { clock_source_monotonic, clock_source_tsc };
+
+static clock_source_type s_clock_source = clock_source_monotonic;
+
+#ifdef CLOCK_SOURCE_HAVE_TSC
+static uint64_t s_tsc_base;         // TSC reading at s_tsc_base_ns
+static uint64_t s_tsc_base_ns;
+static double s_tsc_ns_per_tick;
+#endif
+
+static inline uint64_t monotonic_now(void)
+{
+    struct timespec ts;
+
+    int ret = clock_gettime(CLOCK_MONOTONIC, &ts);
+    assert(ret == 0);
+    (void) ret;
+
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+#ifdef CLOCK_SOURCE_HAVE_TSC
+static bool tsc_is_invariant(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (__get_cpuid_max(0x80000000, NULL) < 0x80000007)
+        return false;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+        return false;
+
+    // CPUID.80000007H:EDX[8] - invariant TSC
+    return (edx & (1 << 8)) != 0;
+}
+
+static void tsc_calibrate(void)
+{
+    uint64_t start_ns = monotonic_now();
+    uint64_t start_tsc = __rdtsc();
+    uint64_t end_ns, end_tsc;
+
+    do {
+        end_ns = monotonic_now();
+        end_tsc = __rdtsc();
+    } while (end_ns - start_ns < TSC_CALIBRATION_NSEC);
+
+    s_tsc_ns_per_tick = (double) (end_ns - start_ns) / (end_tsc - start_tsc);
+    s_tsc_base = end_tsc;
+    s_tsc_base_ns = end_ns;
+}
+#endif
+
+bool clock_source_init(const char *name)
+{
+    if (name == NULL || strcmp(name, "monotonic") == 0) {
+        s_clock_source = clock_source_monotonic;
+        return true;
+    }
+
+    if (strcmp(name, "tsc") == 0) {
+#ifdef CLOCK_SOURCE_HAVE_TSC
+        if (!tsc_is_invariant())
+            return false;
+
+        tsc_calibrate();
+        s_clock_source = clock_source_tsc;
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    return false;
+}
+
+const char *clock_source_name(void)
+{
+    return s_clock_source == clock_source_tsc ? "tsc" : "monotonic";
+}
+
+uint64_t clock_now(void)
+{
+#ifdef CLOCK_SOURCE_HAVE_TSC
+    if (s_clock_source == clock_source_tsc) {
+        return s_tsc_base_ns + (uint64_t) ((int64_t) (__rdtsc() - s_tsc_base) * s_tsc_ns_per_tick);
+    }
+#endif
+    return monotonic_now();
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2011-2017 Redis Labs Ltd.
+ *
+ * This file is part of memtier_benchmark.
+ *
+ * memtier_benchmark is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * memtier_benchmark is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memtier_benchmark.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CLOCK_SOURCE_H
+#define _CLOCK_SOURCE_H
+
+#include <stdint.h>
+#include <sys/time.h>
+
+#define NSEC_PER_USEC   1000ULL
+#define NSEC_PER_MSEC   1000000ULL
+#define NSEC_PER_SEC    1000000000ULL
+
+/*
+ * All request timing goes through this clock: a monotonic time in
+ * nanoseconds since an arbitrary (but fixed, and shared by all threads)
+ * point in the past.  It is never affected by wall clock changes.
+ *
+ * Supported sources are:
+ *   monotonic  - clock_gettime(CLOCK_MONOTONIC), the default
+ *   tsc        - the CPU time stamp counter, calibrated against
+ *                CLOCK_MONOTONIC; only available on x86 CPUs with an
+ *                invariant TSC.
+ */
+
+// selects the clock source; must be called before any thread is started.
+// returns false if the source is unknown or not supported on this host.
+bool clock_source_init(const char *name);
+const char *clock_source_name(void);
+
+uint64_t clock_now(void);
+
+inline struct timeval clock_ns_to_timeval(uint64_t ns)
+{
+    struct timeval tv;
+
+    tv.tv_sec = ns / NSEC_PER_SEC;
+    tv.tv_usec = (ns % NSEC_PER_SEC) / NSEC_PER_USEC;
+    return tv;
+}
+
+#endif /* _CLOCK_SOURCE_H */
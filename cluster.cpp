@@ -0,0 +1,438 @@
+/*
+ * Copyright (C) 2011-2017 Redis Labs Ltd.
+ *
+ * This file is part of memtier_benchmark.
+ *
+ * memtier_benchmark is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * memtier_benchmark is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memtier_benchmark.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+#ifdef HAVE_ASSERT_H
+#include <assert.h>
+#endif
+
+#include <stdexcept>
+
+#include "cluster.h"
+#include "protocol.h"
+#include "memtier_benchmark.h"
+
+// CRC16-CCITT (XMODEM), as used by Redis Cluster for key hashing
+static const unsigned short crc16_table[256] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+    0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+    0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+    0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+    0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+    0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+    0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+    0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+    0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+    0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+    0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+    0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+    0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+    0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+    0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+    0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+    0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+    0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+    0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+    0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+    0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+    0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0,
+};
+
+static unsigned short crc16(const char *buf, unsigned int len)
+{
+    unsigned short crc = 0;
+
+    for (unsigned int i = 0; i < len; i++)
+        crc = (crc << 8) ^ crc16_table[((crc >> 8) ^ (unsigned char) buf[i]) & 0xff];
+    return crc;
+}
+
+unsigned int cluster_key_slot(const char *key, unsigned int key_len)
+{
+    const char *open = (const char *) memchr(key, '{', key_len);
+    if (open != NULL) {
+        const char *tag = open + 1;
+        const char *close = (const char *) memchr(tag, '}', key + key_len - tag);
+        if (close != NULL && close > tag)
+            return crc16(tag, close - tag) & (CLUSTER_SLOTS - 1);
+    }
+
+    return crc16(key, key_len) & (CLUSTER_SLOTS - 1);
+}
+
+///////////////////////////////////////////////////////////////////////////
+
+/*
+ * Reads RESP values from a buffer.  Every read returns 1 on success, 0 if
+ * the buffer ends before the value does, and -1 if it is not valid RESP
+ * (or not of the expected type).  skip() also takes RESP3 values, which a
+ * node replies with once the redis3 handshake is done.
+ */
+class resp_reader {
+protected:
+    const char *m_pos;
+    const char *m_end;
+
+    int read_line(char type, const char **line, unsigned int *len) {
+        if (m_pos >= m_end)
+            return 0;
+        if (*m_pos != type)
+            return -1;
+
+        const char *eol = (const char *) memchr(m_pos, '\n', m_end - m_pos);
+        if (eol == NULL)
+            return 0;
+        if (eol - m_pos < 2 || eol[-1] != '\r')
+            return -1;
+
+        *line = m_pos + 1;
+        *len = eol - 1 - *line;
+        m_pos = eol + 1;
+        return 1;
+    }
+
+    int read_number(char type, long long *value) {
+        const char *line;
+        unsigned int len;
+        int ret = read_line(type, &line, &len);
+        if (ret <= 0)
+            return ret;
+
+        char *end;
+        *value = strtoll(line, &end, 10);
+        return end == line + len ? 1 : -1;
+    }
+public:
+    resp_reader(const char *buf, unsigned int len) : m_pos(buf), m_end(buf + len) {}
+
+    int read_array(long long *count) { return read_number('*', count); }
+    int read_integer(long long *value) { return read_number(':', value); }
+
+    int read_bulk(std::string *value) {
+        long long len;
+        int ret = read_number('$', &len);
+        if (ret <= 0)
+            return ret;
+        if (len < 0)
+            return -1;
+        if (m_end - m_pos < len + 2)
+            return 0;
+
+        value->assign(m_pos, len);
+        m_pos += len + 2;
+        return 1;
+    }
+
+    int skip(void) {
+        const char *line;
+        unsigned int len;
+        long long count;
+        std::string value;
+
+        if (m_pos >= m_end)
+            return 0;
+        switch (*m_pos) {
+            case '+':
+            case '-':
+            case '_':
+            case '#':
+            case ',':
+            case '(':
+                return read_line(*m_pos, &line, &len);
+            case ':':
+                return read_integer(&count);
+            case '$':
+                return read_bulk(&value);
+            case '!':
+            case '=': {
+                // blob error and verbatim string: a bulk string by another name
+                char type = *m_pos;
+                int ret = read_number(type, &count);
+                if (ret <= 0)
+                    return ret;
+                if (count < 0)
+                    return -1;
+                if (m_end - m_pos < count + 2)
+                    return 0;
+                m_pos += count + 2;
+                return 1;
+            }
+            case '*':
+            case '~':
+            case '>':
+            case '%':
+            case '|': {
+                // a map or attribute has a key and a value per entry
+                char type = *m_pos;
+                int ret = read_number(type, &count);
+                if (ret <= 0)
+                    return ret;
+                if (type == '%' || type == '|')
+                    count *= 2;
+                for (long long i = 0; ret > 0 && i < count; i++)
+                    ret = skip();
+                // an attribute precedes the value it describes
+                if (ret > 0 && type == '|')
+                    ret = skip();
+                return ret;
+            }
+            default:
+                return -1;
+        }
+    }
+};
+
+///////////////////////////////////////////////////////////////////////////
+
+cluster_slot_map::cluster_slot_map() :
+    m_slots(CLUSTER_SLOTS, 0)
+{
+}
+
+cluster_slot_map::~cluster_slot_map()
+{
+    for (std::vector<node>::iterator i = m_nodes.begin(); i != m_nodes.end(); i++) {
+        delete i->m_addr;
+    }
+    m_nodes.clear();
+}
+
+unsigned int cluster_slot_map::add_node(const std::string& host, unsigned int port)
+{
+    char name[300];
+    snprintf(name, sizeof(name), "%s:%u", host.c_str(), port);
+
+    for (unsigned int i = 0; i < m_nodes.size(); i++) {
+        if (m_nodes[i].m_name == name)
+            return i;
+    }
+
+    node n;
+    n.m_host = host;
+    n.m_port = port;
+    n.m_name = name;
+    n.m_addr = new server_addr(host.c_str(), port);
+    m_nodes.push_back(n);
+
+    return m_nodes.size() - 1;
+}
+
+// CLUSTER SLOTS replies with one entry per slot range:
+// [start, end, [master host, port, ...], [replica host, port, ...], ...]
+bool cluster_slot_map::parse_slots(const char *reply, unsigned int len, const char *seed_host)
+{
+    resp_reader reader(reply, len);
+    std::vector<bool> covered(CLUSTER_SLOTS, false);
+    long long ranges;
+
+    if (reader.read_array(&ranges) <= 0) {
+        benchmark_error_log("error: unexpected CLUSTER SLOTS reply: %.*s\n",
+            len > 100 ? 100 : len, reply);
+        return false;
+    }
+
+    for (long long i = 0; i < ranges; i++) {
+        long long entries, start, end, fields, port;
+        std::string host;
+
+        if (reader.read_array(&entries) <= 0 || entries < 3 ||
+            reader.read_integer(&start) <= 0 ||
+            reader.read_integer(&end) <= 0 ||
+            reader.read_array(&fields) <= 0 || fields < 2 ||
+            reader.read_bulk(&host) <= 0 ||
+            reader.read_integer(&port) <= 0) {
+            benchmark_error_log("error: failed to parse CLUSTER SLOTS reply.\n");
+            return false;
+        }
+        for (long long j = 2; j < fields; j++)
+            reader.skip();
+        for (long long j = 3; j < entries; j++)
+            reader.skip();
+
+        if (start < 0 || end >= CLUSTER_SLOTS || start > end || port <= 0 || port > 65535) {
+            benchmark_error_log("error: invalid slot range %lld-%lld in CLUSTER SLOTS reply.\n", start, end);
+            return false;
+        }
+
+        // an empty host means the node we asked
+        if (host.empty() || host == "?")
+            host = seed_host;
+
+        unsigned int index;
+        try {
+            index = add_node(host, port);
+        } catch (std::runtime_error& e) {
+            benchmark_error_log("%s:%lld: error: %s\n", host.c_str(), port, e.what());
+            return false;
+        }
+
+        for (long long slot = start; slot <= end; slot++) {
+            m_slots[slot] = index;
+            covered[slot] = true;
+        }
+    }
+
+    for (unsigned int slot = 0; slot < CLUSTER_SLOTS; slot++) {
+        if (!covered[slot]) {
+            benchmark_error_log("error: cluster slot %u is not served by any node.\n", slot);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool send_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t ret = send(fd, buf, len, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+// reads until buf holds one complete reply
+static bool recv_reply(int fd, std::string *buf)
+{
+    char chunk[16384];
+
+    buf->clear();
+    while (true) {
+        ssize_t ret = recv(fd, chunk, sizeof(chunk), 0);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+        buf->append(chunk, ret);
+
+        resp_reader reader(buf->data(), buf->size());
+        int complete = reader.skip();
+        if (complete != 0)
+            return complete > 0;
+    }
+}
+
+// sets the connection up the way the data connections do: with the
+// protocol's handshake, which may carry the credentials, or else AUTH.
+static bool send_setup_commands(int fd, const char *host, unsigned int port,
+                                abstract_protocol *protocol, const char *authenticate)
+{
+    struct evbuffer *read_buf = evbuffer_new();
+    struct evbuffer *write_buf = evbuffer_new();
+    assert(read_buf != NULL && write_buf != NULL);
+    protocol->set_buffers(read_buf, write_buf);
+
+    const char *setup = NULL;
+    if (protocol->write_command_handshake(authenticate) > 0) {
+        setup = "protocol handshake";
+    } else if (authenticate) {
+        protocol->authenticate(authenticate);
+        setup = "authentication";
+    }
+
+    bool ok = true;
+    if (setup != NULL) {
+        std::string cmd(evbuffer_get_length(write_buf), '\0');
+        evbuffer_remove(write_buf, &cmd[0], cmd.size());
+
+        std::string reply;
+        if (!send_all(fd, cmd.data(), cmd.size()) || !recv_reply(fd, &reply)) {
+            benchmark_error_log("error: %s:%u: %s failed: %s\n", host, port, setup, strerror(errno));
+            ok = false;
+        } else if (reply[0] == '-' || reply[0] == '!') {
+            benchmark_error_log("error: %s:%u: %s failed [%.*s]\n",
+                host, port, setup, (int) reply.size() - 2, reply.data());
+            ok = false;
+        }
+    }
+
+    protocol->set_buffers(NULL, NULL);
+    evbuffer_free(read_buf);
+    evbuffer_free(write_buf);
+    return ok;
+}
+
+bool cluster_slot_map::load(const char *host, unsigned int port, struct server_addr *seed,
+                            abstract_protocol *protocol, const char *authenticate)
+{
+    struct connect_info addr;
+    std::string reply;
+
+    if (seed->get_connect_info(&addr) != 0) {
+        benchmark_error_log("error: %s:%u: resolve error: %s\n", host, port, seed->get_last_error());
+        return false;
+    }
+
+    int fd = socket(addr.ci_family, addr.ci_socktype, addr.ci_protocol);
+    if (fd < 0) {
+        benchmark_error_log("error: socket: %s\n", strerror(errno));
+        return false;
+    }
+    if (connect(fd, addr.ci_addr, addr.ci_addrlen) < 0) {
+        benchmark_error_log("error: %s:%u: connect failed: %s\n", host, port, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    bool ok = send_setup_commands(fd, host, port, protocol, authenticate);
+    if (ok) {
+        static const char cmd[] = "*2\r\n$7\r\nCLUSTER\r\n$5\r\nSLOTS\r\n";
+
+        if (!send_all(fd, cmd, sizeof(cmd) - 1) || !recv_reply(fd, &reply)) {
+            benchmark_error_log("error: %s:%u: CLUSTER SLOTS failed: %s\n", host, port, strerror(errno));
+            ok = false;
+        } else if (reply[0] == '-') {
+            benchmark_error_log("error: %s:%u: CLUSTER SLOTS failed [%.*s]\n",
+                host, port, (int) reply.size() - 2, reply.data());
+            ok = false;
+        }
+    }
+    close(fd);
+
+    if (ok)
+        ok = parse_slots(reply.data(), reply.size(), host);
+    return ok;
+}
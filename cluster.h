@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2011-2017 Redis Labs Ltd.
+ *
+ * This file is part of memtier_benchmark.
+ *
+ * memtier_benchmark is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * memtier_benchmark is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memtier_benchmark.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CLUSTER_H
+#define _CLUSTER_H
+
+#include <string>
+#include <vector>
+
+#define CLUSTER_SLOTS           16384
+
+// sent ahead of a command redirected by an -ASK reply
+#define CLUSTER_ASKING_COMMAND  "*1\r\n$6\r\nASKING\r\n"
+
+// a request redirected more often than this is failed, rather than
+// bounced between nodes that disagree about who owns its slot
+#define CLUSTER_MAX_REDIRECTS   5
+
+struct server_addr;
+class abstract_protocol;
+
+// hash slot of a key, as computed by Redis Cluster: CRC16 of the key, or of
+// the part between the first '{' and the following '}' if that is not empty.
+unsigned int cluster_key_slot(const char *key, unsigned int key_len);
+
+/*
+ * The slot map of a Redis Cluster, loaded once from CLUSTER SLOTS on one
+ * node before the test starts.  It is shared (read only) by all clients;
+ * each client keeps its own copy of the slot to node mapping, which it
+ * updates as it follows -MOVED redirections.
+ */
+class cluster_slot_map {
+public:
+    struct node {
+        std::string m_host;
+        unsigned int m_port;
+        std::string m_name;             // host:port
+        struct server_addr *m_addr;
+    };
+protected:
+    std::vector<node> m_nodes;
+    std::vector<unsigned short> m_slots;    // slot -> index in m_nodes
+
+    unsigned int add_node(const std::string& host, unsigned int port);
+    bool parse_slots(const char *reply, unsigned int len, const char *seed_host);
+public:
+    cluster_slot_map();
+    ~cluster_slot_map();
+
+    // fetches the slot map from a node, connecting with the given protocol
+    // (not owned) as the clients do; returns false (after logging why) if
+    // it can't, or if it does not cover all slots
+    bool load(const char *host, unsigned int port, struct server_addr *seed,
+              abstract_protocol *protocol, const char *authenticate);
+
+    unsigned int get_nodes_count(void) const { return m_nodes.size(); }
+    const node& get_node(unsigned int index) const { return m_nodes[index]; }
+    const std::vector<unsigned short>& get_slots(void) const { return m_slots; }
+};
+
+#endif /* _CLUSTER_H */
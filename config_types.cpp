@@ -195,6 +195,50 @@ const char* config_weight_list::print(char *buf, int buf_len)
     return start;
 }
 
+config_quantiles::config_quantiles()
+{
+}
+
+config_quantiles::config_quantiles(const char *str)
+{
+    assert(str != NULL);
+
+    do {
+        char *p = NULL;
+        float quantile = strtof(str, &p);
+        if (!p || (*p != ',' && *p != '\0') || quantile <= 0 || quantile > 100) {
+            quantile_list.clear();
+            return;
+        }
+        quantile_list.push_back(quantile);
+
+        str = p;
+        if (*str) str++;
+    } while (*str);
+}
+
+bool config_quantiles::is_defined(void)
+{
+    return quantile_list.size() > 0;
+}
+
+const char* config_quantiles::print(char *buf, int buf_len)
+{
+    const char* start = buf;
+    assert(buf != NULL && buf_len > 0);
+
+    *buf = '\0';
+    for (std::vector<float>::iterator i = quantile_list.begin(); i != quantile_list.end(); i++) {
+        int n = snprintf(buf, buf_len, "%s%g",
+                i != quantile_list.begin() ? "," : "", *i);
+        buf += n;
+        buf_len -= n;
+        if (buf_len <= 0)
+            return NULL;
+    }
+
+    return start;
+}
 
 server_addr::server_addr(const char *hostname, int port) :
     m_hostname(hostname), m_port(port), m_server_addr(NULL), m_used_addr(NULL), m_last_error(0)
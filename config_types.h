@@ -68,6 +68,15 @@ struct config_weight_list {
     unsigned int get_next_size(void);
 };
 
+struct config_quantiles {
+    std::vector<float> quantile_list;
+
+    config_quantiles();
+    config_quantiles(const char *str);
+    bool is_defined(void);
+    const char *print(char *buf, int buf_len);
+};
+
 struct connect_info {
     int ci_family;
     int ci_socktype;
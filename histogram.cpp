@@ -0,0 +1,358 @@
+/*
+ * Copyright (C) 2011-2017 Redis Labs Ltd.
+ *
+ * This file is part of memtier_benchmark.
+ *
+ * memtier_benchmark is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * memtier_benchmark is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memtier_benchmark.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <math.h>
+
+#ifdef HAVE_ASSERT_H
+#include <assert.h>
+#endif
+
+#include "histogram.h"
+
+static inline int count_leading_zeros_64(uint64_t value)
+{
+    return __builtin_clzll(value);
+}
+
+uint64_t latency_histogram::s_default_highest_trackable_value = LATENCY_HDR_MAX_VALUE;
+int latency_histogram::s_default_significant_figures = LATENCY_HDR_SIGFIGS;
+
+void latency_histogram::set_default_layout(uint64_t highest_trackable_value, int significant_figures)
+{
+    s_default_highest_trackable_value = highest_trackable_value;
+    s_default_significant_figures = significant_figures;
+}
+
+latency_histogram latency_histogram::per_second(void)
+{
+    int significant_figures = s_default_significant_figures;
+    if (significant_figures > LATENCY_HDR_SEC_SIGFIGS)
+        significant_figures = LATENCY_HDR_SEC_SIGFIGS;
+
+    return latency_histogram(LATENCY_HDR_MIN_VALUE, s_default_highest_trackable_value, significant_figures);
+}
+
+latency_histogram::latency_histogram(uint64_t lowest_trackable_value,
+                                     uint64_t highest_trackable_value,
+                                     int significant_figures) :
+    m_lowest_trackable_value(lowest_trackable_value),
+    m_highest_trackable_value(highest_trackable_value),
+    m_significant_figures(significant_figures),
+    m_counts_base(0),
+    m_total_count(0),
+    m_min_value(UINT64_MAX),
+    m_max_value(0)
+{
+    assert(lowest_trackable_value >= 1);
+    assert(significant_figures >= 1 && significant_figures <= LATENCY_HDR_MAX_SIGFIGS);
+    assert(lowest_trackable_value * 2 <= highest_trackable_value);
+
+    uint64_t largest_value_with_single_unit_resolution = 2 * (uint64_t) pow(10, significant_figures);
+    int sub_bucket_count_magnitude = (int) ceil(log((double) largest_value_with_single_unit_resolution) / log(2.0));
+
+    m_sub_bucket_half_count_magnitude = (sub_bucket_count_magnitude > 1 ? sub_bucket_count_magnitude : 1) - 1;
+    m_unit_magnitude = (int) floor(log((double) lowest_trackable_value) / log(2.0));
+    m_sub_bucket_count = (int32_t) pow(2, m_sub_bucket_half_count_magnitude + 1);
+    m_sub_bucket_half_count = m_sub_bucket_count / 2;
+    m_sub_bucket_mask = ((uint64_t) m_sub_bucket_count - 1) << m_unit_magnitude;
+
+    // number of power-of-two buckets needed to cover the trackable range
+    uint64_t smallest_untrackable_value = ((uint64_t) m_sub_bucket_count) << m_unit_magnitude;
+    int32_t buckets_needed = 1;
+    while (smallest_untrackable_value <= highest_trackable_value) {
+        if (smallest_untrackable_value > INT64_MAX / 2) {
+            buckets_needed++;
+            break;
+        }
+        smallest_untrackable_value <<= 1;
+        buckets_needed++;
+    }
+
+    m_counts_len = (buckets_needed + 1) * (m_sub_bucket_count / 2);
+}
+
+int latency_histogram::get_bucket_index(uint64_t value) const
+{
+    int pow2ceiling = 64 - count_leading_zeros_64(value | m_sub_bucket_mask);
+    return pow2ceiling - m_unit_magnitude - (m_sub_bucket_half_count_magnitude + 1);
+}
+
+int32_t latency_histogram::counts_index_for(uint64_t value) const
+{
+    int bucket_index = get_bucket_index(value);
+    int32_t sub_bucket_index = (int32_t) (value >> (bucket_index + m_unit_magnitude));
+
+    int32_t bucket_base_index = (bucket_index + 1) << m_sub_bucket_half_count_magnitude;
+    return bucket_base_index + (sub_bucket_index - m_sub_bucket_half_count);
+}
+
+uint64_t latency_histogram::value_at_index(int32_t index) const
+{
+    int32_t bucket_index = (index >> m_sub_bucket_half_count_magnitude) - 1;
+    int32_t sub_bucket_index = (index & (m_sub_bucket_half_count - 1)) + m_sub_bucket_half_count;
+
+    if (bucket_index < 0) {
+        sub_bucket_index -= m_sub_bucket_half_count;
+        bucket_index = 0;
+    }
+
+    return ((uint64_t) sub_bucket_index) << (bucket_index + m_unit_magnitude);
+}
+
+uint64_t latency_histogram::size_of_equivalent_value_range(uint64_t value) const
+{
+    int bucket_index = get_bucket_index(value);
+    int32_t sub_bucket_index = (int32_t) (value >> (bucket_index + m_unit_magnitude));
+    int adjusted_bucket = (sub_bucket_index >= m_sub_bucket_count) ? (bucket_index + 1) : bucket_index;
+
+    return ((uint64_t) 1) << (m_unit_magnitude + adjusted_bucket);
+}
+
+uint64_t latency_histogram::lowest_equivalent_value(uint64_t value) const
+{
+    int bucket_index = get_bucket_index(value);
+    int32_t sub_bucket_index = (int32_t) (value >> (bucket_index + m_unit_magnitude));
+
+    return ((uint64_t) sub_bucket_index) << (bucket_index + m_unit_magnitude);
+}
+
+uint64_t latency_histogram::highest_equivalent_value(uint64_t value) const
+{
+    return lowest_equivalent_value(value) + size_of_equivalent_value_range(value) - 1;
+}
+
+uint64_t latency_histogram::median_equivalent_value(uint64_t value) const
+{
+    return lowest_equivalent_value(value) + (size_of_equivalent_value_range(value) >> 1);
+}
+
+void latency_histogram::record_value(uint64_t value)
+{
+    record_values(value, 1);
+}
+
+void latency_histogram::record_values(uint64_t value, uint64_t count)
+{
+    // out of range values are clamped rather than dropped, so that
+    // every operation is still accounted for
+    if (value > m_highest_trackable_value)
+        value = m_highest_trackable_value;
+
+    int32_t index = counts_index_for(value);
+    assert(index >= 0 && index < m_counts_len);
+
+    if (m_counts.empty()) {
+        m_counts_base = index;
+        m_counts.resize(1, 0);
+    } else if (index < m_counts_base) {
+        m_counts.insert(m_counts.begin(), m_counts_base - index, 0);
+        m_counts_base = index;
+    } else if (index - m_counts_base >= (int32_t) m_counts.size()) {
+        m_counts.resize(index - m_counts_base + 1, 0);
+    }
+
+    m_counts[index - m_counts_base] += count;
+    m_total_count += count;
+
+    if (value < m_min_value)
+        m_min_value = value;
+    if (value > m_max_value)
+        m_max_value = value;
+}
+
+bool latency_histogram::add(const latency_histogram& other)
+{
+    if (other.m_total_count == 0)
+        return true;
+
+    // same layout: merge bucket by bucket
+    if (other.m_unit_magnitude == m_unit_magnitude &&
+        other.m_sub_bucket_half_count_magnitude == m_sub_bucket_half_count_magnitude &&
+        other.m_highest_trackable_value <= m_highest_trackable_value) {
+        int32_t other_end = other.m_counts_base + (int32_t) other.m_counts.size();
+        if (m_counts.empty()) {
+            m_counts_base = other.m_counts_base;
+        } else if (other.m_counts_base < m_counts_base) {
+            m_counts.insert(m_counts.begin(), m_counts_base - other.m_counts_base, 0);
+            m_counts_base = other.m_counts_base;
+        }
+        if (other_end - m_counts_base > (int32_t) m_counts.size())
+            m_counts.resize(other_end - m_counts_base, 0);
+
+        int32_t offset = other.m_counts_base - m_counts_base;
+        for (size_t i = 0; i < other.m_counts.size(); i++)
+            m_counts[offset + i] += other.m_counts[i];
+
+        m_total_count += other.m_total_count;
+        if (other.m_min_value < m_min_value)
+            m_min_value = other.m_min_value;
+        if (other.m_max_value > m_max_value)
+            m_max_value = other.m_max_value;
+        return true;
+    }
+
+    // different layout: re-record each bucket by its median value
+    recorded_iterator it(&other);
+    while (it.next()) {
+        record_values(other.median_equivalent_value(it.value), it.count);
+    }
+
+    return true;
+}
+
+void latency_histogram::reset(void)
+{
+    m_counts.clear();
+    m_counts_base = 0;
+    m_total_count = 0;
+    m_min_value = UINT64_MAX;
+    m_max_value = 0;
+}
+
+uint64_t latency_histogram::get_min(void) const
+{
+    if (!m_total_count)
+        return 0;
+    return lowest_equivalent_value(m_min_value);
+}
+
+uint64_t latency_histogram::get_max(void) const
+{
+    if (!m_total_count)
+        return 0;
+    return highest_equivalent_value(m_max_value);
+}
+
+double latency_histogram::get_mean(void) const
+{
+    if (!m_total_count)
+        return 0;
+
+    double total = 0;
+    for (size_t i = 0; i < m_counts.size(); i++) {
+        if (m_counts[i] > 0)
+            total += (double) m_counts[i] * median_equivalent_value(value_at_index(m_counts_base + i));
+    }
+
+    return total / m_total_count;
+}
+
+uint64_t latency_histogram::value_at_percentile(double percentile) const
+{
+    if (!m_total_count)
+        return 0;
+
+    if (percentile > 100.0)
+        percentile = 100.0;
+
+    uint64_t count_at_percentile = (uint64_t) (((percentile / 100.0) * m_total_count) + 0.5);
+    if (count_at_percentile < 1)
+        count_at_percentile = 1;
+
+    uint64_t total = 0;
+    for (size_t i = 0; i < m_counts.size(); i++) {
+        total += m_counts[i];
+        if (total >= count_at_percentile)
+            return highest_equivalent_value(value_at_index(m_counts_base + i));
+    }
+
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////
+
+latency_histogram::percentile_iterator::percentile_iterator(const latency_histogram* histogram, int ticks_per_half_distance) :
+    m_histogram(histogram),
+    m_ticks_per_half_distance(ticks_per_half_distance),
+    m_index(-1),
+    m_count_to_index(0),
+    m_percentile_to_iterate_to(0.0),
+    m_reached_last(false),
+    value(0),
+    percentile(0.0)
+{
+    assert(histogram != NULL);
+    assert(ticks_per_half_distance > 0);
+}
+
+bool latency_histogram::percentile_iterator::next(void)
+{
+    const std::vector<uint64_t>& counts = m_histogram->m_counts;
+
+    if (m_reached_last || m_histogram->m_total_count == 0)
+        return false;
+
+    while (true) {
+        // still inside the current bucket?
+        if (m_index >= 0 && counts[m_index] > 0) {
+            double current_percentile = (100.0 * m_count_to_index) / m_histogram->m_total_count;
+            if (current_percentile >= m_percentile_to_iterate_to) {
+                value = m_histogram->highest_equivalent_value(m_histogram->value_at_index(m_histogram->m_counts_base + m_index));
+                percentile = current_percentile;
+
+                if (m_count_to_index >= m_histogram->m_total_count) {
+                    m_reached_last = true;
+                    return true;
+                }
+
+                // the step halves every time the remaining distance to 100% halves;
+                // skip all levels already covered by this bucket
+                while (m_percentile_to_iterate_to <= current_percentile) {
+                    double half_distance = pow(2, floor(log(100.0 / (100.0 - m_percentile_to_iterate_to)) / log(2.0)) + 1);
+                    m_percentile_to_iterate_to += 100.0 / (half_distance * m_ticks_per_half_distance);
+                }
+                return true;
+            }
+        }
+
+        if (++m_index >= (int32_t) counts.size())
+            return false;
+        m_count_to_index += counts[m_index];
+    }
+}
+
+latency_histogram::recorded_iterator::recorded_iterator(const latency_histogram* histogram) :
+    m_histogram(histogram),
+    m_index(-1),
+    index(0),
+    value(0),
+    count(0)
+{
+    assert(histogram != NULL);
+}
+
+bool latency_histogram::recorded_iterator::next(void)
+{
+    const std::vector<uint64_t>& counts = m_histogram->m_counts;
+
+    while (++m_index < (int32_t) counts.size()) {
+        if (counts[m_index] > 0) {
+            index = m_histogram->m_counts_base + m_index;
+            value = m_histogram->highest_equivalent_value(m_histogram->value_at_index(index));
+            count = counts[m_index];
+            return true;
+        }
+    }
+
+    return false;
+}
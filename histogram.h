@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2011-2017 Redis Labs Ltd.
+ *
+ * This file is part of memtier_benchmark.
+ *
+ * memtier_benchmark is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * memtier_benchmark is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memtier_benchmark.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HISTOGRAM_H
+#define _HISTOGRAM_H
+
+#include <stdint.h>
+#include <vector>
+
+// latencies are recorded in nsec, by default up to one hour with 3
+// significant digits (--hdr-max-latency, --hdr-significant-figures)
+#define LATENCY_HDR_MIN_VALUE   1
+#define LATENCY_HDR_MAX_VALUE   3600000000000ULL
+#define LATENCY_HDR_SIGFIGS     3
+#define LATENCY_HDR_MAX_SIGFIGS 5
+
+// per-second histograms are kept for the whole run, so trade some
+// resolution for a much smaller footprint
+#define LATENCY_HDR_SEC_SIGFIGS 2
+
+/*
+ * A log-linear bucketed histogram in the spirit of HdrHistogram.
+ *
+ * Values are grouped into power-of-two buckets, each split linearly into
+ * enough sub-buckets to keep the requested number of significant digits.
+ * Recording is O(1) (a couple of shifts and an increment), merging two
+ * histograms with the same layout is a single pass over the counts array.
+ *
+ * The counts array only spans the range between the lowest and highest
+ * recorded values and is grown on demand, so histograms that only ever see
+ * a narrow range of values stay small.
+ */
+class latency_histogram {
+protected:
+    static uint64_t s_default_highest_trackable_value;
+    static int s_default_significant_figures;
+
+    uint64_t m_lowest_trackable_value;
+    uint64_t m_highest_trackable_value;
+    int m_significant_figures;
+
+    int m_unit_magnitude;
+    int m_sub_bucket_half_count_magnitude;
+    int32_t m_sub_bucket_count;
+    int32_t m_sub_bucket_half_count;
+    uint64_t m_sub_bucket_mask;
+    int32_t m_counts_len;
+
+    std::vector<uint64_t> m_counts;     // counts for indexes [m_counts_base, m_counts_base + size)
+    int32_t m_counts_base;
+    uint64_t m_total_count;
+    uint64_t m_min_value;
+    uint64_t m_max_value;
+
+    int get_bucket_index(uint64_t value) const;
+    int32_t counts_index_for(uint64_t value) const;
+    uint64_t value_at_index(int32_t index) const;
+    uint64_t size_of_equivalent_value_range(uint64_t value) const;
+    uint64_t lowest_equivalent_value(uint64_t value) const;
+public:
+    latency_histogram(uint64_t lowest_trackable_value = LATENCY_HDR_MIN_VALUE,
+                      uint64_t highest_trackable_value = s_default_highest_trackable_value,
+                      int significant_figures = s_default_significant_figures);
+
+    // the layout of histograms created without one; set from the command
+    // line before any histogram is created, so all of them can be merged
+    // bucket by bucket.
+    static void set_default_layout(uint64_t highest_trackable_value, int significant_figures);
+    static uint64_t get_default_highest_trackable_value(void) { return s_default_highest_trackable_value; }
+    static int get_default_significant_figures(void) { return s_default_significant_figures; }
+    // a histogram of the default range, with per-second resolution
+    static latency_histogram per_second(void);
+
+    void record_value(uint64_t value);
+    void record_values(uint64_t value, uint64_t count);
+    bool add(const latency_histogram& other);
+    void reset(void);
+
+    uint64_t get_total_count(void) const { return m_total_count; }
+    uint64_t get_min(void) const;
+    uint64_t get_max(void) const;
+    double get_mean(void) const;
+    uint64_t value_at_percentile(double percentile) const;
+
+    uint64_t highest_equivalent_value(uint64_t value) const;
+    uint64_t median_equivalent_value(uint64_t value) const;
+
+    int get_significant_figures(void) const { return m_significant_figures; }
+    uint64_t get_lowest_trackable_value(void) const { return m_lowest_trackable_value; }
+    uint64_t get_highest_trackable_value(void) const { return m_highest_trackable_value; }
+
+    // walks the recorded values, reporting percentile levels that get closer
+    // together as they approach 100% (the classic HdrHistogram percentile
+    // distribution), so the tail is visible without printing every bucket.
+    class percentile_iterator {
+    protected:
+        const latency_histogram* m_histogram;
+        int m_ticks_per_half_distance;
+        int32_t m_index;
+        uint64_t m_count_to_index;
+        double m_percentile_to_iterate_to;
+        bool m_reached_last;
+    public:
+        percentile_iterator(const latency_histogram* histogram, int ticks_per_half_distance);
+        bool next(void);
+
+        uint64_t value;         // highest value equivalent to the current bucket
+        double percentile;      // percentage of values <= value
+    };
+
+    // walks only the non-empty buckets, in value order.
+    class recorded_iterator {
+    protected:
+        const latency_histogram* m_histogram;
+        int32_t m_index;
+    public:
+        explicit recorded_iterator(const latency_histogram* histogram);
+        bool next(void);
+
+        int32_t index;
+        uint64_t value;         // highest value equivalent to the current bucket
+        uint64_t count;
+    };
+};
+
+#endif /* _HISTOGRAM_H */
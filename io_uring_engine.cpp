@@ -0,0 +1,486 @@
+/*
+ * Copyright (C) 2011-2017 Redis Labs Ltd.
+ *
+ * This file is part of memtier_benchmark.
+ *
+ * memtier_benchmark is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * memtier_benchmark is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memtier_benchmark.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#ifdef HAVE_ASSERT_H
+#include <assert.h>
+#endif
+
+#include "io_uring_engine.h"
+#include "client.h"
+#include "shard_connection.h"
+#include "clock_source.h"
+#include "memtier_benchmark.h"
+
+#define IO_URING_MIN_ENTRIES    64
+#define IO_URING_MAX_ENTRIES    4096
+#define IO_URING_BUFFERS        1024        // provided buffers, must be a power of 2
+#define IO_URING_BUFFER_SIZE    8192
+#define IO_URING_BUFFER_GROUP   0
+#define IO_URING_MAX_SEND       65536       // bytes handed to a single send
+
+// user_data is (connection index << 8) | operation
+enum engine_op { engine_op_connect = 1, engine_op_recv, engine_op_send, engine_op_cancel };
+
+static inline unsigned long long make_user_data(unsigned int idx, engine_op op)
+{
+    return ((unsigned long long) idx << 8) | op;
+}
+
+static inline int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static inline int sys_io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+io_uring_engine::io_uring_engine() :
+    m_ring_fd(-1),
+    m_sq_ring(MAP_FAILED), m_sq_ring_size(0), m_sq_head(NULL), m_sq_tail(NULL), m_sq_mask(0),
+    m_sqes(NULL), m_sqes_size(0), m_sq_local_tail(0), m_to_submit(0),
+    m_cq_ring(MAP_FAILED), m_cq_ring_size(0), m_cq_head(NULL), m_cq_tail(NULL), m_cq_mask(0), m_cqes(NULL),
+    m_buf_ring(NULL), m_buf_ring_size(0), m_buffers(NULL), m_buf_tail(0),
+    m_active(0), m_inflight(0)
+{
+}
+
+io_uring_engine::~io_uring_engine()
+{
+    if (m_sqes != NULL)
+        munmap(m_sqes, m_sqes_size);
+    if (m_cq_ring != MAP_FAILED && m_cq_ring != m_sq_ring)
+        munmap(m_cq_ring, m_cq_ring_size);
+    if (m_sq_ring != MAP_FAILED)
+        munmap(m_sq_ring, m_sq_ring_size);
+    if (m_ring_fd != -1)
+        close(m_ring_fd);
+
+    if (m_buf_ring != NULL)
+        munmap(m_buf_ring, m_buf_ring_size);
+    free(m_buffers);
+
+    for (std::vector<connection>::iterator i = m_connections.begin(); i != m_connections.end(); i++) {
+        free(i->m_send_buf);
+    }
+}
+
+bool io_uring_engine::init(unsigned int connections)
+{
+    unsigned int entries = IO_URING_MIN_ENTRIES;
+    while (entries < connections * 2 && entries < IO_URING_MAX_ENTRIES)
+        entries <<= 1;
+
+    // every connection has a recv and a send outstanding, and a multishot
+    // recv may post several completions before we get to them
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+
+    m_ring_fd = sys_io_uring_setup(entries, &p);
+    if (m_ring_fd < 0)
+        return false;
+
+    m_sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    m_cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (m_cq_ring_size > m_sq_ring_size)
+            m_sq_ring_size = m_cq_ring_size;
+        m_cq_ring_size = m_sq_ring_size;
+    }
+
+    m_sq_ring = mmap(NULL, m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     m_ring_fd, IORING_OFF_SQ_RING);
+    if (m_sq_ring == MAP_FAILED)
+        return false;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        m_cq_ring = m_sq_ring;
+    } else {
+        m_cq_ring = mmap(NULL, m_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         m_ring_fd, IORING_OFF_CQ_RING);
+        if (m_cq_ring == MAP_FAILED)
+            return false;
+    }
+
+    m_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      m_ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+        return false;
+    m_sqes = (struct io_uring_sqe *) sqes;
+
+    char *sq = (char *) m_sq_ring;
+    m_sq_head = (unsigned int *) (sq + p.sq_off.head);
+    m_sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+    m_sq_mask = *(unsigned int *) (sq + p.sq_off.ring_mask);
+    m_sq_local_tail = *m_sq_tail;
+
+    // sqes are always used in ring order, so the indirection array is fixed
+    unsigned int *sq_array = (unsigned int *) (sq + p.sq_off.array);
+    for (unsigned int i = 0; i < p.sq_entries; i++) {
+        sq_array[i] = i;
+    }
+
+    char *cq = (char *) m_cq_ring;
+    m_cq_head = (unsigned int *) (cq + p.cq_off.head);
+    m_cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+    m_cq_mask = *(unsigned int *) (cq + p.cq_off.ring_mask);
+    m_cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    // provided buffer ring, shared by all connections
+    m_buf_ring_size = IO_URING_BUFFERS * sizeof(struct io_uring_buf);
+    void *buf_ring = mmap(NULL, m_buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf_ring == MAP_FAILED)
+        return false;
+    m_buf_ring = (struct io_uring_buf_ring *) buf_ring;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long) m_buf_ring;
+    reg.ring_entries = IO_URING_BUFFERS;
+    reg.bgid = IO_URING_BUFFER_GROUP;
+    if (sys_io_uring_register(m_ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return false;
+
+    m_buffers = (char *) malloc(IO_URING_BUFFERS * IO_URING_BUFFER_SIZE);
+    if (m_buffers == NULL)
+        return false;
+    for (unsigned int bid = 0; bid < IO_URING_BUFFERS; bid++) {
+        provide_buffer(bid);
+    }
+
+    return true;
+}
+
+bool io_uring_engine::is_supported(void)
+{
+    io_uring_engine engine;
+    return engine.init(1);
+}
+
+struct io_uring_sqe *io_uring_engine::get_sqe(void)
+{
+    // submission queue full: hand what we have to the kernel first
+    while (m_sq_local_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) > m_sq_mask) {
+        submit_and_wait(0);
+    }
+
+    struct io_uring_sqe *sqe = &m_sqes[m_sq_local_tail & m_sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    m_sq_local_tail++;
+    m_to_submit++;
+
+    return sqe;
+}
+
+int io_uring_engine::submit_and_wait(unsigned int wait_nr)
+{
+    __atomic_store_n(m_sq_tail, m_sq_local_tail, __ATOMIC_RELEASE);
+
+    int ret = sys_io_uring_enter(m_ring_fd, m_to_submit, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+    if (ret < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            benchmark_error_log("io_uring_enter failed: %s\n", strerror(errno));
+            abort();
+        }
+        return 0;
+    }
+
+    m_to_submit -= ret;
+    return ret;
+}
+
+void io_uring_engine::provide_buffer(unsigned short bid)
+{
+    // the ring tail overlays the first entry; the entries start at the ring
+    // itself (the flexible array member is misplaced when compiled as C++)
+    struct io_uring_buf *bufs = (struct io_uring_buf *) m_buf_ring;
+    struct io_uring_buf *buf = &bufs[m_buf_tail & (IO_URING_BUFFERS - 1)];
+
+    buf->addr = (unsigned long) (m_buffers + (size_t) bid * IO_URING_BUFFER_SIZE);
+    buf->len = IO_URING_BUFFER_SIZE;
+    buf->bid = bid;
+
+    m_buf_tail++;
+    __atomic_store_n(&m_buf_ring->tail, m_buf_tail, __ATOMIC_RELEASE);
+}
+
+void io_uring_engine::prep_connect_poll(unsigned int idx)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = m_clients[idx]->m_connections[0]->m_sockfd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = make_user_data(idx, engine_op_connect);
+    m_inflight++;
+}
+
+void io_uring_engine::prep_recv(unsigned int idx)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = m_clients[idx]->m_connections[0]->m_sockfd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = IO_URING_BUFFER_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = make_user_data(idx, engine_op_recv);
+    m_inflight++;
+
+    m_connections[idx].m_recv_armed = true;
+}
+
+void io_uring_engine::prep_send(unsigned int idx)
+{
+    shard_connection *sc = m_clients[idx]->m_connections[0];
+    connection& conn = m_connections[idx];
+
+    // the data stays in the write buffer until the send completes, so that
+    // requests created meanwhile still see where their bytes end
+    size_t len = sc->get_writable_length();
+    if (len > IO_URING_MAX_SEND)
+        len = IO_URING_MAX_SEND;
+    if (len > conn.m_send_buf_size) {
+        conn.m_send_buf = (char *) realloc(conn.m_send_buf, len);
+        assert(conn.m_send_buf != NULL);
+        conn.m_send_buf_size = len;
+    }
+    evbuffer_copyout(sc->m_write_buf, conn.m_send_buf, len);
+
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = sc->m_sockfd;
+    sqe->addr = (unsigned long) conn.m_send_buf;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = make_user_data(idx, engine_op_send);
+    m_inflight++;
+
+    conn.m_send_inflight = true;
+}
+
+void io_uring_engine::close_connection(unsigned int idx)
+{
+    connection& conn = m_connections[idx];
+
+    conn.m_done = true;
+    m_active--;
+
+    // stop receiving; the cancelled recv still posts a final completion
+    if (conn.m_recv_armed) {
+        struct io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = make_user_data(idx, engine_op_recv);
+        sqe->user_data = make_user_data(idx, engine_op_cancel);
+    }
+}
+
+// same decisions as the end of client::handle_event()
+void io_uring_engine::update_connection(unsigned int idx)
+{
+    client *c = m_clients[idx];
+    shard_connection *sc = c->m_connections[0];
+    connection& conn = m_connections[idx];
+
+    if (!sc->m_connected) {
+        close_connection(idx);
+        return;
+    }
+
+    if (c->finished()) {
+        if (!sc->has_pending_writes()) {
+            benchmark_debug_log("nothing else to do, test is finished.\n");
+            c->m_stats.set_end_time(c->m_now);
+        }
+        close_connection(idx);
+        return;
+    }
+
+    if (!conn.m_recv_armed)
+        prep_recv(idx);
+    if (!conn.m_send_inflight && sc->has_pending_writes())
+        prep_send(idx);
+}
+
+void io_uring_engine::handle_connect(unsigned int idx, int res)
+{
+    shard_connection *sc = m_clients[idx]->m_connections[0];
+
+    if (res < 0) {
+        benchmark_error_log("connect: poll failed: %s\n", strerror(-res));
+        return;
+    }
+
+    if (!sc->complete_connect())
+        return;
+
+    // from now on io_uring does the waiting
+    int flags = fcntl(sc->m_sockfd, F_GETFL, 0);
+    if (flags >= 0)
+        fcntl(sc->m_sockfd, F_SETFL, flags & ~O_NONBLOCK);
+}
+
+void io_uring_engine::handle_recv(unsigned int idx, int res, unsigned int flags)
+{
+    client *c = m_clients[idx];
+    shard_connection *sc = c->m_connections[0];
+    connection& conn = m_connections[idx];
+
+    if (res > 0) {
+        assert(flags & IORING_CQE_F_BUFFER);
+        unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+        if (!conn.m_done) {
+            // anything read into an empty buffer starts the next response
+            if (evbuffer_get_length(sc->m_read_buf) == 0)
+                sc->m_read_buf_time = c->m_now;
+            evbuffer_add(sc->m_read_buf, m_buffers + (size_t) bid * IO_URING_BUFFER_SIZE, res);
+        }
+        provide_buffer(bid);
+
+        if (!conn.m_done)
+            sc->process_response();
+        return;
+    }
+
+    if (conn.m_done)
+        return;
+
+    // out of provided buffers: the recv is simply re-armed
+    if (res == -ENOBUFS || res == -EAGAIN || res == -EINTR)
+        return;
+
+    if (res == 0) {
+        benchmark_error_log("connection dropped.\n");
+    } else {
+        benchmark_error_log("read error: %s\n", strerror(-res));
+    }
+    c->disconnect();
+}
+
+void io_uring_engine::handle_send(unsigned int idx, int res)
+{
+    client *c = m_clients[idx];
+    shard_connection *sc = c->m_connections[0];
+
+    if (m_connections[idx].m_done)
+        return;
+
+    if (res < 0) {
+        if (res == -EAGAIN || res == -EINTR)
+            return;
+
+        benchmark_error_log("write error: %s\n", strerror(-res));
+        c->disconnect();
+        return;
+    }
+
+    evbuffer_drain(sc->m_write_buf, res);
+    sc->requests_written(res);
+}
+
+void io_uring_engine::handle_completion(struct io_uring_cqe *cqe, unsigned long long now)
+{
+    unsigned int idx = cqe->user_data >> 8;
+    engine_op op = (engine_op) (cqe->user_data & 0xff);
+
+    if (op == engine_op_cancel)
+        return;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        m_inflight--;
+
+    connection& conn = m_connections[idx];
+    m_clients[idx]->m_now = now;
+
+    switch (op) {
+        case engine_op_connect:
+            handle_connect(idx, cqe->res);
+            break;
+        case engine_op_recv:
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                conn.m_recv_armed = false;
+            handle_recv(idx, cqe->res, cqe->flags);
+            break;
+        case engine_op_send:
+            conn.m_send_inflight = false;
+            handle_send(idx, cqe->res);
+            break;
+        default:
+            assert(0);
+            break;
+    }
+
+    if (!conn.m_done)
+        update_connection(idx);
+}
+
+void io_uring_engine::run(const std::vector<client*>& clients)
+{
+    m_clients = clients;
+    m_connections.resize(clients.size());
+    m_active = clients.size();
+
+    for (unsigned int i = 0; i < m_clients.size(); i++) {
+        prep_connect_poll(i);
+    }
+
+    // keep going until every connection is done, and then until nothing
+    // the kernel may still write to is outstanding
+    while (m_active > 0 || m_inflight > 0) {
+        submit_and_wait(1);
+
+        unsigned long long now = clock_now();
+        unsigned int head = *m_cq_head;
+        unsigned int tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+
+        while (head != tail) {
+            handle_completion(&m_cqes[head & m_cq_mask], now);
+            head++;
+        }
+        __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2011-2017 Redis Labs Ltd.
+ *
+ * This file is part of memtier_benchmark.
+ *
+ * memtier_benchmark is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * memtier_benchmark is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memtier_benchmark.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _IO_URING_ENGINE_H
+#define _IO_URING_ENGINE_H
+
+#ifdef HAVE_IO_URING
+
+#include <stddef.h>
+#include <vector>
+#include <linux/io_uring.h>
+
+class client;
+
+/*
+ * Drives all connections of a client_group through an io_uring instead of
+ * libevent readiness events:
+ *
+ * - Every connection has a single multishot recv outstanding, receiving
+ *   into buffers picked by the kernel from a ring of provided buffers;
+ *   data is copied into the client's read buffer and the provided buffer
+ *   is returned to the ring right away.
+ *
+ * - Sends for all connections with pending data are queued after each
+ *   batch of completions and submitted together with the next wait, so
+ *   one io_uring_enter() serves the whole group.
+ *
+ * The engine talks to the kernel through the raw system calls, so it does
+ * not depend on liburing.  It requires Linux 6.0 or later (multishot recv).
+ */
+class io_uring_engine {
+protected:
+    struct connection {
+        bool m_done;            // test finished or connection failed; ignore completions
+        bool m_recv_armed;      // a multishot recv is outstanding
+        bool m_send_inflight;   // a send is outstanding
+        char *m_send_buf;       // stable copy of the data being sent
+        unsigned int m_send_buf_size;
+
+        connection() : m_done(false), m_recv_armed(false), m_send_inflight(false),
+            m_send_buf(NULL), m_send_buf_size(0) {}
+    };
+
+    int m_ring_fd;
+
+    // submission queue
+    void *m_sq_ring;
+    size_t m_sq_ring_size;
+    unsigned int *m_sq_head;
+    unsigned int *m_sq_tail;
+    unsigned int m_sq_mask;
+    struct io_uring_sqe *m_sqes;
+    size_t m_sqes_size;
+    unsigned int m_sq_local_tail;
+    unsigned int m_to_submit;
+
+    // completion queue
+    void *m_cq_ring;
+    size_t m_cq_ring_size;
+    unsigned int *m_cq_head;
+    unsigned int *m_cq_tail;
+    unsigned int m_cq_mask;
+    struct io_uring_cqe *m_cqes;
+
+    // provided receive buffers
+    struct io_uring_buf_ring *m_buf_ring;
+    size_t m_buf_ring_size;
+    char *m_buffers;
+    unsigned short m_buf_tail;
+
+    std::vector<client*> m_clients;
+    std::vector<connection> m_connections;
+    unsigned int m_active;              // connections not done yet
+    unsigned int m_inflight;            // operations that will still post a completion
+
+    struct io_uring_sqe *get_sqe(void);
+    int submit_and_wait(unsigned int wait_nr);
+    void provide_buffer(unsigned short bid);
+
+    void prep_connect_poll(unsigned int idx);
+    void prep_recv(unsigned int idx);
+    void prep_send(unsigned int idx);
+
+    void handle_completion(struct io_uring_cqe *cqe, unsigned long long now);
+    void handle_connect(unsigned int idx, int res);
+    void handle_recv(unsigned int idx, int res, unsigned int flags);
+    void handle_send(unsigned int idx, int res);
+    void update_connection(unsigned int idx);
+    void close_connection(unsigned int idx);
+public:
+    io_uring_engine();
+    ~io_uring_engine();
+
+    // returns false (with errno set) if io_uring is unusable on this host
+    bool init(unsigned int connections);
+    void run(const std::vector<client*>& clients);
+
+    static bool is_supported(void);
+};
+
+#endif /* HAVE_IO_URING */
+
+#endif /* _IO_URING_ENGINE_H */
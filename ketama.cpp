@@ -0,0 +1,274 @@
+/*
+ * Copyright (C) 2011-2017 Redis Labs Ltd.
+ *
+ * This file is part of memtier_benchmark.
+ *
+ * memtier_benchmark is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * memtier_benchmark is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memtier_benchmark.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "ketama.h"
+#include "memtier_benchmark.h"
+
+/*
+ * MD5 (RFC 1321), only what's needed to hash short strings.
+ */
+static const uint32_t md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const unsigned int md5_r[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+static void md5_block(uint32_t state[4], const unsigned char *block)
+{
+    uint32_t m[16];
+    for (unsigned int i = 0; i < 16; i++) {
+        m[i] = (uint32_t) block[i * 4] | ((uint32_t) block[i * 4 + 1] << 8) |
+               ((uint32_t) block[i * 4 + 2] << 16) | ((uint32_t) block[i * 4 + 3] << 24);
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    for (unsigned int i = 0; i < 64; i++) {
+        uint32_t f;
+        unsigned int g;
+
+        if (i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if (i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) % 16;
+        } else if (i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) % 16;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) % 16;
+        }
+
+        uint32_t tmp = d;
+        d = c;
+        c = b;
+        uint32_t x = a + f + md5_k[i] + m[g];
+        b = b + ((x << md5_r[i]) | (x >> (32 - md5_r[i])));
+        a = tmp;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+static void md5(const char *buf, unsigned int len, unsigned char digest[16])
+{
+    uint32_t state[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    const unsigned char *p = (const unsigned char *) buf;
+    unsigned int left = len;
+
+    while (left >= 64) {
+        md5_block(state, p);
+        p += 64;
+        left -= 64;
+    }
+
+    // the remaining bytes, 0x80, zeros and the length in bits
+    unsigned char tail[128];
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, p, left);
+    tail[left] = 0x80;
+
+    unsigned int tail_len = left < 56 ? 64 : 128;
+    uint64_t bits = (uint64_t) len * 8;
+    for (unsigned int i = 0; i < 8; i++)
+        tail[tail_len - 8 + i] = (unsigned char) (bits >> (i * 8));
+
+    md5_block(state, tail);
+    if (tail_len == 128)
+        md5_block(state, tail + 64);
+
+    for (unsigned int i = 0; i < 4; i++) {
+        digest[i * 4] = (unsigned char) state[i];
+        digest[i * 4 + 1] = (unsigned char) (state[i] >> 8);
+        digest[i * 4 + 2] = (unsigned char) (state[i] >> 16);
+        digest[i * 4 + 3] = (unsigned char) (state[i] >> 24);
+    }
+}
+
+// one of the four 32 bit points held by an MD5 digest, as libmemcached reads them
+static unsigned int ketama_point(const unsigned char digest[16], unsigned int index)
+{
+    return ((unsigned int) digest[3 + index * 4] << 24) |
+           ((unsigned int) digest[2 + index * 4] << 16) |
+           ((unsigned int) digest[1 + index * 4] << 8) |
+           digest[index * 4];
+}
+
+///////////////////////////////////////////////////////////////////////////
+
+ketama_continuum::ketama_continuum()
+{
+}
+
+ketama_continuum::~ketama_continuum()
+{
+    for (std::vector<server>::iterator i = m_servers.begin(); i != m_servers.end(); i++) {
+        delete i->m_addr;
+    }
+    m_servers.clear();
+}
+
+bool ketama_continuum::add_server(const std::string& host, unsigned int port)
+{
+    char name[300];
+    snprintf(name, sizeof(name), "%s:%u", host.c_str(), port);
+
+    for (unsigned int i = 0; i < m_servers.size(); i++) {
+        if (m_servers[i].m_name == name) {
+            benchmark_error_log("error: server %s is listed more than once.\n", name);
+            return false;
+        }
+    }
+
+    server s;
+    s.m_host = host;
+    s.m_port = port;
+    s.m_name = name;
+    try {
+        s.m_addr = new server_addr(host.c_str(), port);
+    } catch (std::runtime_error& e) {
+        benchmark_error_log("%s: error: %s\n", name, e.what());
+        return false;
+    }
+    m_servers.push_back(s);
+
+    return true;
+}
+
+// libmemcached hashes "host-N" for servers on the default port and
+// "host:port-N" for the others, N being the index of the digest
+void ketama_continuum::build(void)
+{
+    m_points.clear();
+    m_points.reserve(m_servers.size() * KETAMA_POINTS_PER_SERVER);
+
+    for (unsigned int i = 0; i < m_servers.size(); i++) {
+        const server& s = m_servers[i];
+
+        for (unsigned int n = 0; n < KETAMA_POINTS_PER_SERVER / KETAMA_POINTS_PER_HASH; n++) {
+            char sort_host[320];
+            int len;
+            unsigned char digest[16];
+
+            if (s.m_port == KETAMA_DEFAULT_PORT)
+                len = snprintf(sort_host, sizeof(sort_host), "%s-%u", s.m_host.c_str(), n);
+            else
+                len = snprintf(sort_host, sizeof(sort_host), "%s:%u-%u", s.m_host.c_str(), s.m_port, n);
+            md5(sort_host, len, digest);
+
+            for (unsigned int x = 0; x < KETAMA_POINTS_PER_HASH; x++) {
+                point p;
+                p.m_value = ketama_point(digest, x);
+                p.m_server = i;
+                m_points.push_back(p);
+            }
+        }
+    }
+
+    std::stable_sort(m_points.begin(), m_points.end());
+}
+
+bool ketama_continuum::load(const char *list)
+{
+    const char *pos = list;
+
+    while (*pos != '\0') {
+        const char *end = strchr(pos, ',');
+        if (end == NULL)
+            end = pos + strlen(pos);
+
+        std::string entry(pos, end - pos);
+        std::string host = entry;
+        unsigned int port = KETAMA_DEFAULT_PORT;
+
+        std::string::size_type colon = entry.rfind(':');
+        if (colon != std::string::npos) {
+            char *endptr = NULL;
+            const char *port_str = entry.c_str() + colon + 1;
+
+            port = (unsigned int) strtoul(port_str, &endptr, 10);
+            if (*port_str == '\0' || *endptr != '\0' || port == 0 || port > 65535) {
+                benchmark_error_log("error: invalid port in server '%s'.\n", entry.c_str());
+                return false;
+            }
+            host = entry.substr(0, colon);
+        }
+        if (host.empty()) {
+            benchmark_error_log("error: missing host in server list '%s'.\n", list);
+            return false;
+        }
+
+        if (!add_server(host, port))
+            return false;
+
+        pos = *end == ',' ? end + 1 : end;
+    }
+
+    if (m_servers.empty()) {
+        benchmark_error_log("error: empty server list.\n");
+        return false;
+    }
+
+    build();
+    return true;
+}
+
+// the first point at or after the MD5 of the key, wrapping around
+unsigned int ketama_continuum::get_server(const char *key, unsigned int key_len) const
+{
+    unsigned char digest[16];
+    point p;
+
+    md5(key, key_len, digest);
+    p.m_value = ketama_point(digest, 0);
+    p.m_server = 0;
+
+    std::vector<point>::const_iterator i = std::lower_bound(m_points.begin(), m_points.end(), p);
+    if (i == m_points.end())
+        i = m_points.begin();
+
+    return i->m_server;
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2011-2017 Redis Labs Ltd.
+ *
+ * This file is part of memtier_benchmark.
+ *
+ * memtier_benchmark is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * memtier_benchmark is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memtier_benchmark.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _KETAMA_H
+#define _KETAMA_H
+
+#include <string>
+#include <vector>
+
+#define KETAMA_DEFAULT_PORT         11211
+#define KETAMA_POINTS_PER_SERVER    160     // 40 MD5 digests, 4 points each
+#define KETAMA_POINTS_PER_HASH      4
+
+struct server_addr;
+
+/*
+ * A pool of memcache servers, with keys distributed over them by a ketama
+ * continuum.  The points are computed the way libmemcached does for
+ * MEMCACHED_BEHAVIOR_KETAMA_WEIGHTED with MD5 hashing and equal weights, so
+ * a key maps to the same server it would with a libmemcached client given
+ * the same server list.
+ *
+ * The pool is built once before the test and shared (read only) by all
+ * clients.
+ */
+class ketama_continuum {
+public:
+    struct server {
+        std::string m_host;
+        unsigned int m_port;
+        std::string m_name;             // host:port
+        struct server_addr *m_addr;
+    };
+protected:
+    struct point {
+        unsigned int m_value;
+        unsigned int m_server;          // index in m_servers
+
+        bool operator<(const point& other) const { return m_value < other.m_value; }
+    };
+    std::vector<server> m_servers;
+    std::vector<point> m_points;        // sorted by m_value
+
+    bool add_server(const std::string& host, unsigned int port);
+    void build(void);
+public:
+    ketama_continuum();
+    ~ketama_continuum();
+
+    // parses and resolves a host[:port],host[:port],... list, returns
+    // false (after logging why) if it can't
+    bool load(const char *list);
+
+    unsigned int get_server(const char *key, unsigned int key_len) const;
+    unsigned int get_servers_count(void) const { return m_servers.size(); }
+    const server& get_server_info(unsigned int index) const { return m_servers[index]; }
+};
+
+#endif /* _KETAMA_H */
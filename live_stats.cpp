@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2011-2017 Redis Labs Ltd.
+ *
+ * This file is part of memtier_benchmark.
+ *
+ * memtier_benchmark is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * memtier_benchmark is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memtier_benchmark.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sched.h>
+
+#include "live_stats.h"
+
+live_stats_interval::live_stats_interval() :
+    m_get_latency_histogram(latency_histogram::per_second()),
+    m_set_latency_histogram(latency_histogram::per_second()),
+    m_wait_latency_histogram(latency_histogram::per_second())
+{
+    reset();
+}
+
+void live_stats_interval::add(const live_stats_interval& other)
+{
+    m_ops_get += other.m_ops_get;
+    m_ops_set += other.m_ops_set;
+    m_ops_wait += other.m_ops_wait;
+    m_bytes_get += other.m_bytes_get;
+    m_bytes_set += other.m_bytes_set;
+    m_get_hits += other.m_get_hits;
+    m_get_misses += other.m_get_misses;
+    m_total_get_latency += other.m_total_get_latency;
+    m_total_set_latency += other.m_total_set_latency;
+    m_total_wait_latency += other.m_total_wait_latency;
+    m_get_latency_histogram.add(other.m_get_latency_histogram);
+    m_set_latency_histogram.add(other.m_set_latency_histogram);
+    m_wait_latency_histogram.add(other.m_wait_latency_histogram);
+}
+
+void live_stats_interval::reset(void)
+{
+    m_ops_get = m_ops_set = m_ops_wait = 0;
+    m_bytes_get = m_bytes_set = 0;
+    m_get_hits = m_get_misses = 0;
+    m_total_get_latency = m_total_set_latency = m_total_wait_latency = 0;
+    m_get_latency_histogram.reset();
+    m_set_latency_histogram.reset();
+    m_wait_latency_histogram.reset();
+}
+
+///////////////////////////////////////////////////////////////////////////
+
+live_stats::live_stats() :
+    m_total_ops(0),
+    m_total_bytes(0),
+    m_total_latency(0),
+    m_record_seq(0),
+    m_active(0)
+{
+}
+
+void live_stats::add_totals(unsigned int ops, unsigned int bytes, uint64_t latency)
+{
+    // we are the only writer, so plain loads are fine; stores are atomic
+    // so the reader never sees a torn value
+    __atomic_store_n(&m_total_ops, m_total_ops + ops, __ATOMIC_RELAXED);
+    __atomic_store_n(&m_total_bytes, m_total_bytes + bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&m_total_latency, m_total_latency + latency, __ATOMIC_RELAXED);
+}
+
+live_stats_interval& live_stats::begin_record(void)
+{
+    // the sequence must be odd before we look at m_active, so that a reader
+    // that switched intervals either sees us in progress or we see its switch
+    __atomic_store_n(&m_record_seq, m_record_seq + 1, __ATOMIC_SEQ_CST);
+    return m_intervals[__atomic_load_n(&m_active, __ATOMIC_SEQ_CST)];
+}
+
+void live_stats::end_record(void)
+{
+    __atomic_store_n(&m_record_seq, m_record_seq + 1, __ATOMIC_RELEASE);
+}
+
+void live_stats::record_get(unsigned int bytes, uint64_t latency, unsigned int hits, unsigned int misses)
+{
+    add_totals(hits + misses, bytes, latency);
+
+    live_stats_interval& interval = begin_record();
+    interval.m_ops_get += hits + misses;
+    interval.m_bytes_get += bytes;
+    interval.m_get_hits += hits;
+    interval.m_get_misses += misses;
+    interval.m_total_get_latency += latency;
+    interval.m_get_latency_histogram.record_value(latency);
+    end_record();
+}
+
+void live_stats::record_set(unsigned int bytes, uint64_t latency)
+{
+    add_totals(1, bytes, latency);
+
+    live_stats_interval& interval = begin_record();
+    interval.m_ops_set++;
+    interval.m_bytes_set += bytes;
+    interval.m_total_set_latency += latency;
+    interval.m_set_latency_histogram.record_value(latency);
+    end_record();
+}
+
+void live_stats::record_wait(uint64_t latency)
+{
+    add_totals(1, 0, latency);
+
+    live_stats_interval& interval = begin_record();
+    interval.m_ops_wait++;
+    interval.m_total_wait_latency += latency;
+    interval.m_wait_latency_histogram.record_value(latency);
+    end_record();
+}
+
+uint64_t live_stats::get_total_ops(void) const
+{
+    return __atomic_load_n(&m_total_ops, __ATOMIC_RELAXED);
+}
+
+uint64_t live_stats::get_total_bytes(void) const
+{
+    return __atomic_load_n(&m_total_bytes, __ATOMIC_RELAXED);
+}
+
+uint64_t live_stats::get_total_latency(void) const
+{
+    return __atomic_load_n(&m_total_latency, __ATOMIC_RELAXED);
+}
+
+// adds everything recorded since the previous call to target, and starts
+// a new interval.
+void live_stats::collect_interval(live_stats_interval* target)
+{
+    unsigned int inactive = m_active;
+    __atomic_store_n(&m_active, 1 - inactive, __ATOMIC_SEQ_CST);
+
+    // wait for a record that may still be using the old interval
+    uint64_t seq = __atomic_load_n(&m_record_seq, __ATOMIC_SEQ_CST);
+    if (seq & 1) {
+        while (__atomic_load_n(&m_record_seq, __ATOMIC_ACQUIRE) == seq)
+            sched_yield();
+    }
+
+    target->add(m_intervals[inactive]);
+    m_intervals[inactive].reset();
+}
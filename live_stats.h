@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2011-2017 Redis Labs Ltd.
+ *
+ * This file is part of memtier_benchmark.
+ *
+ * memtier_benchmark is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * memtier_benchmark is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memtier_benchmark.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LIVE_STATS_H
+#define _LIVE_STATS_H
+
+#include <stdint.h>
+
+#include "histogram.h"
+
+#define LIVE_STATS_CACHE_LINE   64
+
+// everything recorded by a thread during one reporting interval
+struct live_stats_interval {
+    uint64_t m_ops_get;
+    uint64_t m_ops_set;
+    uint64_t m_ops_wait;
+    uint64_t m_bytes_get;
+    uint64_t m_bytes_set;
+    uint64_t m_get_hits;
+    uint64_t m_get_misses;
+    uint64_t m_total_get_latency;
+    uint64_t m_total_set_latency;
+    uint64_t m_total_wait_latency;
+
+    latency_histogram m_get_latency_histogram;
+    latency_histogram m_set_latency_histogram;
+    latency_histogram m_wait_latency_histogram;
+
+    live_stats_interval();
+    void add(const live_stats_interval& other);
+    void reset(void);
+};
+
+/*
+ * Statistics of a single worker thread, as seen by the reporting thread
+ * while the test is running.
+ *
+ * There is exactly one writer (the worker thread) and one reader (the
+ * reporting thread):
+ *
+ * - Running totals are single-writer counters; the writer never needs an
+ *   atomic read-modify-write, and the reader just loads them.
+ *
+ * - Everything else goes to one of two interval blocks.  The reader
+ *   switches the writer to the other block, waits for any record in
+ *   progress to complete (using a sequence counter bumped around every
+ *   record), and then owns the previous block until the next switch.
+ *   Memory use is therefore constant no matter how long the test runs.
+ *
+ * The block is padded on both sides so it never shares a cache line with
+ * data touched by other threads.
+ */
+class live_stats {
+protected:
+    char m_pad_head[LIVE_STATS_CACHE_LINE];
+
+    uint64_t m_total_ops;
+    uint64_t m_total_bytes;
+    uint64_t m_total_latency;
+
+    uint64_t m_record_seq;          // odd while a record is in progress
+    unsigned int m_active;          // interval currently written to
+    live_stats_interval m_intervals[2];
+
+    char m_pad_tail[LIVE_STATS_CACHE_LINE];
+
+    void add_totals(unsigned int ops, unsigned int bytes, uint64_t latency);
+    live_stats_interval& begin_record(void);
+    void end_record(void);
+public:
+    live_stats();
+
+    // writer side
+    void record_get(unsigned int bytes, uint64_t latency, unsigned int hits, unsigned int misses);
+    void record_set(unsigned int bytes, uint64_t latency);
+    void record_wait(uint64_t latency);
+
+    // reader side
+    uint64_t get_total_ops(void) const;
+    uint64_t get_total_bytes(void) const;
+    uint64_t get_total_latency(void) const;
+    void collect_interval(live_stats_interval* target);
+};
+
+#endif /* _LIVE_STATS_H */
@@ -37,8 +37,14 @@
 #include <stdexcept>
 
 #include "client.h"
+#include "cluster.h"
+#include "ketama.h"
+#include "clock_source.h"
+#include "io_uring_engine.h"
 #include "JSON_handler.h"
+#include "stats_stream.h"
 #include "obj_gen.h"
+#include "num_format.h"
 #include "memtier_benchmark.h"
 
 
@@ -72,10 +78,17 @@ void benchmark_log(int level, const char *fmt, ...)
 }
 
 
+// redis and redis3 differ only in the reply format
+static bool is_redis_protocol(const char *protocol)
+{
+    return strcmp(protocol, "redis") == 0 || strcmp(protocol, "redis3") == 0;
+}
+
 static void config_print(FILE *file, struct benchmark_config *cfg)
 {
     char taskset_buf[512];
     char size_list_buf[512];
+    char percentiles_buf[512];
     
     fprintf(file,
         "server = %s\n"
@@ -94,6 +107,8 @@ static void config_print(FILE *file, struct benchmark_config *cfg)
         "test_time = %u\n"
         "ratio = %u:%u\n"
         "pipeline = %u\n"
+        "rate = %u\n"
+        "rate_distribution = %s\n"
         "data_size = %u\n"
         "data_offset = %u\n"
         "random_data = %s\n"
@@ -109,11 +124,14 @@ static void config_print(FILE *file, struct benchmark_config *cfg)
         "crc_verify = %s\n"
         "generate_keys = %s\n"
         "key_prefix = %s\n"
+        "key_width = %u\n"
         "key_minimum = %llu\n"
         "key_maximum = %llu\n"
         "key_pattern = %s\n"
         "key_stddev = %f\n"
         "key_median = %f\n"
+        "key_zipf_exp = %f\n"
+        "key_zipf_scramble = %s\n"
         "reconnect_interval = %u\n"
         "multi_key_get = %u\n"
         "authenticate = %s\n"
@@ -122,7 +140,22 @@ static void config_print(FILE *file, struct benchmark_config *cfg)
         "wait-ratio = %u:%u\n"
         "num-slaves = %u-%u\n"
         "wait-timeout = %u-%u\n"
-        "json-out-file = %s\n",
+        "json-out-file = %s\n"
+        "print-percentiles = %s\n"
+        "hdr-significant-figures = %d\n"
+        "hdr-max-latency = %u\n"
+        "clock-source = %s\n"
+        "latency-breakdown = %s\n"
+        "stats-stream = %s\n"
+        "stats-stream-format = %s\n"
+        "stats-export = %s\n"
+        "io-engine = %s\n"
+        "value-pool = %u\n"
+        "cluster-mode = %s\n"
+        "servers = %s\n"
+        "pubsub-channels = %s\n"
+        "pubsub-patterns = %s\n"
+        "pubsub-subscribers = %u\n",
         cfg->server,
         cfg->port,
         cfg->unix_socket,
@@ -139,6 +172,8 @@ static void config_print(FILE *file, struct benchmark_config *cfg)
         cfg->test_time,
         cfg->ratio.a, cfg->ratio.b,
         cfg->pipeline,
+        cfg->request_rate,
+        cfg->rate_distribution,
         cfg->data_size,
         cfg->data_offset,
         cfg->random_data ? "yes" : "no",
@@ -154,11 +189,14 @@ static void config_print(FILE *file, struct benchmark_config *cfg)
         cfg->crc_verify ? "yes" : "no",
         cfg->generate_keys ? "yes" : "no",
         cfg->key_prefix,
+        cfg->key_width,
         cfg->key_minimum,
         cfg->key_maximum,
         cfg->key_pattern,
         cfg->key_stddev,
         cfg->key_median,
+        cfg->key_zipf_exp,
+        cfg->key_zipf_scramble ? "yes" : "no",
         cfg->reconnect_interval,
         cfg->multi_key_get,
         cfg->authenticate ? cfg->authenticate : "",
@@ -167,7 +205,22 @@ static void config_print(FILE *file, struct benchmark_config *cfg)
         cfg->wait_ratio.a, cfg->wait_ratio.b,
         cfg->num_slaves.min, cfg->num_slaves.max,
         cfg->wait_timeout.min, cfg->wait_timeout.max,
-        cfg->json_out_file);
+        cfg->json_out_file,
+        cfg->print_percentiles.print(percentiles_buf, sizeof(percentiles_buf)-1),
+        cfg->hdr_significant_figures,
+        cfg->hdr_max_latency,
+        cfg->clock_source,
+        cfg->latency_breakdown ? "yes" : "no",
+        cfg->stats_stream,
+        cfg->stats_stream_format,
+        cfg->stats_export,
+        cfg->io_engine,
+        cfg->value_pool,
+        cfg->cluster_mode ? "yes" : "no",
+        cfg->servers,
+        cfg->pubsub_channels,
+        cfg->pubsub_patterns,
+        cfg->pubsub_subscribers);
 }
 
 static void config_print_to_json(json_handler * jsonhandler, struct benchmark_config *cfg)
@@ -192,6 +245,8 @@ static void config_print_to_json(json_handler * jsonhandler, struct benchmark_co
     jsonhandler->write_obj("test_time"         ,"%u",          	cfg->test_time);
     jsonhandler->write_obj("ratio"             ,"\"%u:%u\"",   	cfg->ratio.a, cfg->ratio.b);
     jsonhandler->write_obj("pipeline"          ,"%u",          	cfg->pipeline);
+    jsonhandler->write_obj("rate"              ,"%u",           cfg->request_rate);
+    jsonhandler->write_obj("rate_distribution" ,"\"%s\"",       cfg->rate_distribution);
     jsonhandler->write_obj("data_size"         ,"%u",          	cfg->data_size);
     jsonhandler->write_obj("data_offset"       ,"%u",          	cfg->data_offset);
     jsonhandler->write_obj("random_data"       ,"\"%s\"",      	cfg->random_data ? "true" : "false");
@@ -207,11 +262,14 @@ static void config_print_to_json(json_handler * jsonhandler, struct benchmark_co
     jsonhandler->write_obj("crc_verify"        ,"\"%s\"",       cfg->crc_verify ? "true" : "false");
     jsonhandler->write_obj("generate_keys"     ,"\"%s\"",     	cfg->generate_keys ? "true" : "false");
     jsonhandler->write_obj("key_prefix"        ,"\"%s\"",       cfg->key_prefix);
+    jsonhandler->write_obj("key_width"         ,"%u",           cfg->key_width);
     jsonhandler->write_obj("key_minimum"       ,"%11u",        	cfg->key_minimum);
     jsonhandler->write_obj("key_maximum"       ,"%11u",        	cfg->key_maximum);
     jsonhandler->write_obj("key_pattern"       ,"\"%s\"",       cfg->key_pattern);
     jsonhandler->write_obj("key_stddev"        ,"%f",           cfg->key_stddev);
     jsonhandler->write_obj("key_median"        ,"%f",           cfg->key_median);
+    jsonhandler->write_obj("key_zipf_exp"      ,"%f",           cfg->key_zipf_exp);
+    jsonhandler->write_obj("key_zipf_scramble" ,"\"%s\"",       cfg->key_zipf_scramble ? "true" : "false");
     jsonhandler->write_obj("reconnect_interval","%u",    		cfg->reconnect_interval);
     jsonhandler->write_obj("multi_key_get"     ,"%u",         	cfg->multi_key_get);
     jsonhandler->write_obj("authenticate"      ,"\"%s\"",      	cfg->authenticate ? cfg->authenticate : "");
@@ -220,15 +278,30 @@ static void config_print_to_json(json_handler * jsonhandler, struct benchmark_co
     jsonhandler->write_obj("wait-ratio"        ,"\"%u:%u\"",    cfg->wait_ratio.a, cfg->wait_ratio.b);
     jsonhandler->write_obj("num-slaves"        ,"\"%u:%u\"",    cfg->num_slaves.min, cfg->num_slaves.max);
     jsonhandler->write_obj("wait-timeout"      ,"\"%u-%u\"",   	cfg->wait_timeout.min, cfg->wait_timeout.max);
+    jsonhandler->write_obj("print-percentiles" ,"\"%s\"",       cfg->print_percentiles.print(tmpbuf, sizeof(tmpbuf)-1));
+    jsonhandler->write_obj("hdr-significant-figures","%d",      cfg->hdr_significant_figures);
+    jsonhandler->write_obj("hdr-max-latency"   ,"%u",           cfg->hdr_max_latency);
+    jsonhandler->write_obj("clock-source"      ,"\"%s\"",       cfg->clock_source);
+    jsonhandler->write_obj("latency-breakdown" ,"\"%s\"",       cfg->latency_breakdown ? "true" : "false");
+    jsonhandler->write_obj("stats-stream"      ,"\"%s\"",       cfg->stats_stream);
+    jsonhandler->write_obj("stats-stream-format","\"%s\"",      cfg->stats_stream_format);
+    jsonhandler->write_obj("stats-export"      ,"\"%s\"",       cfg->stats_export);
+    jsonhandler->write_obj("io-engine"         ,"\"%s\"",       cfg->io_engine);
+    jsonhandler->write_obj("value-pool"        ,"%u",           cfg->value_pool);
+    jsonhandler->write_obj("cluster-mode"      ,"\"%s\"",       cfg->cluster_mode ? "true" : "false");
+    jsonhandler->write_obj("servers"           ,"\"%s\"",       cfg->servers);
+    jsonhandler->write_obj("pubsub-channels"   ,"\"%s\"",       cfg->pubsub_channels);
+    jsonhandler->write_obj("pubsub-patterns"   ,"\"%s\"",       cfg->pubsub_patterns);
+    jsonhandler->write_obj("pubsub-subscribers","%u",           cfg->pubsub_subscribers);
 
 	jsonhandler->close_nesting();
 }
 
 static void config_init_defaults(struct benchmark_config *cfg)
 {
-    if (!cfg->server && !cfg->unix_socket)
+    if (!cfg->server && !cfg->unix_socket && !cfg->servers)
         cfg->server = "localhost";
-    if (!cfg->port && !cfg->unix_socket)
+    if (!cfg->port && !cfg->unix_socket && !cfg->servers)
         cfg->port = 6379;
     if (!cfg->protocol)
         cfg->protocol = "redis";
@@ -244,6 +317,14 @@ static void config_init_defaults(struct benchmark_config *cfg)
         cfg->ratio = cfg->crc_verify ? config_ratio("1:0") : config_ratio("1:10");
     if (!cfg->pipeline)
         cfg->pipeline = 1;
+    if (!cfg->rate_distribution)
+        cfg->rate_distribution = "uniform";
+    if (!cfg->stats_stream_format)
+        cfg->stats_stream_format = "csv";
+    if (!cfg->clock_source)
+        cfg->clock_source = "monotonic";
+    if (!cfg->io_engine)
+        cfg->io_engine = "libevent";
     if (!cfg->data_size && !cfg->data_size_list.is_defined() && !cfg->data_size_range.is_defined() && !cfg->data_import)
         cfg->data_size = 32;
     if (cfg->generate_keys || !cfg->data_import) {
@@ -258,6 +339,12 @@ static void config_init_defaults(struct benchmark_config *cfg)
         cfg->data_size_pattern = "R";
     if (!cfg->compression_ratio)
         cfg->compression_ratio = 0;
+    if (!cfg->print_percentiles.is_defined())
+        cfg->print_percentiles = config_quantiles("50,99,99.9");
+    if (!cfg->hdr_significant_figures)
+        cfg->hdr_significant_figures = LATENCY_HDR_SIGFIGS;
+    if (!cfg->hdr_max_latency)
+        cfg->hdr_max_latency = LATENCY_HDR_MAX_VALUE / NSEC_PER_MSEC;
     if (cfg->requests == (unsigned int)-1) {
         cfg->requests = cfg->key_maximum - cfg->key_minimum;
         if (strcmp(cfg->key_pattern, "P:P")==0 || strcmp(cfg->key_pattern, "C:C")==0)
@@ -269,6 +356,8 @@ static void config_init_defaults(struct benchmark_config *cfg)
     }
     if (!cfg->requests && !cfg->test_time)
         cfg->requests = 10000;
+    if (cfg->pubsub_channels && !cfg->pubsub_subscribers)
+        cfg->pubsub_subscribers = cfg->clients / 2;
 }
 
 static int generate_random_seed()
@@ -302,11 +391,14 @@ static int config_parse_args(int argc, char *argv[], struct benchmark_config *cf
         o_verify_only,
         o_verify_set_only,
         o_key_prefix,
+        o_key_width,
         o_key_minimum,
         o_key_maximum,
         o_key_pattern,
         o_key_stddev,
         o_key_median,
+        o_key_zipf_exp,
+        o_key_zipf_scramble,
         o_show_config,
         o_hide_histogram,
         o_distinct_client_seed,
@@ -323,7 +415,25 @@ static int config_parse_args(int argc, char *argv[], struct benchmark_config *cf
         o_json_out_file,
         o_cpu_split,
         o_taskset,
-        o_crc_verify
+        o_crc_verify,
+        o_print_percentiles,
+        o_hdr_significant_figures,
+        o_hdr_max_latency,
+        o_rate,
+        o_rate_distribution,
+        o_clock_source,
+        o_latency_breakdown,
+        o_stats_stream,
+        o_stats_stream_format,
+        o_stats_export,
+        o_merge,
+        o_io_engine,
+        o_value_pool,
+        o_cluster_mode,
+        o_servers,
+        o_pubsub_channels,
+        o_pubsub_patterns,
+        o_pubsub_subscribers
     };
     
     static struct option long_options[] = {
@@ -337,6 +447,9 @@ static int config_parse_args(int argc, char *argv[], struct benchmark_config *cf
         { "debug",                      0, 0, 'D' },
         { "show-config",                0, 0, o_show_config },
         { "hide-histogram",             0, 0, o_hide_histogram },
+        { "print-percentiles",          1, 0, o_print_percentiles },
+        { "hdr-significant-figures",    1, 0, o_hdr_significant_figures },
+        { "hdr-max-latency",            1, 0, o_hdr_max_latency },
         { "distinct-client-seed",       0, 0, o_distinct_client_seed },
         { "randomize",                  0, 0, o_randomize },
         { "requests",                   1, 0, 'n' },
@@ -347,6 +460,8 @@ static int config_parse_args(int argc, char *argv[], struct benchmark_config *cf
         { "test-time",                  1, 0, o_test_time },
         { "ratio",                      1, 0, o_ratio },
         { "pipeline",                   1, 0, o_pipeline },
+        { "rate",                       1, 0, o_rate },
+        { "rate-distribution",          1, 0, o_rate_distribution },
         { "data-size",                  1, 0, 'd' },
         { "data-offset",                1, 0, o_data_offset },
         { "random-data",                0, 0, 'R' },
@@ -362,11 +477,14 @@ static int config_parse_args(int argc, char *argv[], struct benchmark_config *cf
         { "crc-verify",                 0, 0, o_crc_verify },
         { "generate-keys",              0, 0, o_generate_keys },
         { "key-prefix",                 1, 0, o_key_prefix },
+        { "key-width",                  1, 0, o_key_width },
         { "key-minimum",                1, 0, o_key_minimum },
         { "key-maximum",                1, 0, o_key_maximum },
         { "key-pattern",                1, 0, o_key_pattern },
         { "key-stddev",                 1, 0, o_key_stddev },
         { "key-median",                 1, 0, o_key_median },
+        { "key-zipf-exp",               1, 0, o_key_zipf_exp },
+        { "key-zipf-scramble",          0, 0, o_key_zipf_scramble },
         { "reconnect-interval",         1, 0, o_reconnect_interval },
         { "multi-key-get",              1, 0, o_multi_key_get },
         { "authenticate",               1, 0, 'a' },
@@ -376,6 +494,19 @@ static int config_parse_args(int argc, char *argv[], struct benchmark_config *cf
         { "num-slaves",                 1, 0, o_num_slaves },
         { "wait-timeout",               1, 0, o_wait_timeout },
         { "json-out-file",              1, 0, o_json_out_file },
+        { "clock-source",               1, 0, o_clock_source },
+        { "latency-breakdown",          0, 0, o_latency_breakdown },
+        { "stats-stream",               1, 0, o_stats_stream },
+        { "stats-stream-format",        1, 0, o_stats_stream_format },
+        { "stats-export",               1, 0, o_stats_export },
+        { "merge",                      0, 0, o_merge },
+        { "io-engine",                  1, 0, o_io_engine },
+        { "value-pool",                 1, 0, o_value_pool },
+        { "cluster-mode",               0, 0, o_cluster_mode },
+        { "servers",                    1, 0, o_servers },
+        { "pubsub-channels",            1, 0, o_pubsub_channels },
+        { "pubsub-patterns",            1, 0, o_pubsub_patterns },
+        { "pubsub-subscribers",         1, 0, o_pubsub_subscribers },
         { "help",                       0, 0, 'h' },
         { "version",                    0, 0, 'v' },
         { NULL,                         0, 0, 0 }
@@ -415,9 +546,11 @@ static int config_parse_args(int argc, char *argv[], struct benchmark_config *cf
                     break;
                 case 'P':
                     if (strcmp(optarg, "memcache_text") &&
+                        strcmp(optarg, "memcache_meta") &&
                         strcmp(optarg, "memcache_binary") &&
-                        strcmp(optarg, "redis")) {
-                                fprintf(stderr, "error: supported protocols are 'memcache_text', 'memcache_binary' and 'redis'.\n");
+                        strcmp(optarg, "redis") &&
+                        strcmp(optarg, "redis3")) {
+                                fprintf(stderr, "error: supported protocols are 'memcache_text', 'memcache_meta', 'memcache_binary', 'redis' and 'redis3'.\n");
                                 return -1;
                     }
                     cfg->protocol = optarg;
@@ -445,6 +578,30 @@ static int config_parse_args(int argc, char *argv[], struct benchmark_config *cf
                 case o_hide_histogram:
                     cfg->hide_histogram++;
                     break;
+                case o_print_percentiles:
+                    cfg->print_percentiles = config_quantiles(optarg);
+                    if (!cfg->print_percentiles.is_defined()) {
+                        fprintf(stderr, "error: quantiles must be expressed as [0.0-100.0],[0.0-100.0](,...)\n");
+                        return -1;
+                    }
+                    break;
+                case o_hdr_significant_figures:
+                    endptr = NULL;
+                    cfg->hdr_significant_figures = (int) strtoul(optarg, &endptr, 10);
+                    if (cfg->hdr_significant_figures < 1 || cfg->hdr_significant_figures > LATENCY_HDR_MAX_SIGFIGS ||
+                        !endptr || *endptr != '\0') {
+                        fprintf(stderr, "error: hdr-significant-figures must be between 1 and %d.\n", LATENCY_HDR_MAX_SIGFIGS);
+                        return -1;
+                    }
+                    break;
+                case o_hdr_max_latency:
+                    endptr = NULL;
+                    cfg->hdr_max_latency = (unsigned int) strtoul(optarg, &endptr, 10);
+                    if (!cfg->hdr_max_latency || !endptr || *endptr != '\0') {
+                        fprintf(stderr, "error: hdr-max-latency must be greater than zero.\n");
+                        return -1;
+                    }
+                    break;
                 case o_distinct_client_seed:
                     cfg->distinct_client_seed++;
                     break;
@@ -531,6 +688,22 @@ static int config_parse_args(int argc, char *argv[], struct benchmark_config *cf
                         return -1;
                     }
                     break;
+                case o_rate:
+                    endptr = NULL;
+                    cfg->request_rate = (unsigned int) strtoul(optarg, &endptr, 10);
+                    if (!cfg->request_rate || !endptr || *endptr != '\0') {
+                        fprintf(stderr, "error: rate must be greater than zero.\n");
+                        return -1;
+                    }
+                    break;
+                case o_rate_distribution:
+                    cfg->rate_distribution = optarg;
+                    if (strcmp(cfg->rate_distribution, "uniform") != 0 &&
+                        strcmp(cfg->rate_distribution, "poisson") != 0) {
+                        fprintf(stderr, "error: rate-distribution must be either uniform or poisson.\n");
+                        return -1;
+                    }
+                    break;
                 case 'd':
                     endptr = NULL;
                     cfg->data_size = (unsigned int) strtoul(optarg, &endptr, 10);
@@ -614,6 +787,14 @@ static int config_parse_args(int argc, char *argv[], struct benchmark_config *cf
                 case o_key_prefix:
                     cfg->key_prefix = optarg;
                     break;
+                case o_key_width:
+                    endptr = NULL;
+                    cfg->key_width = (unsigned int) strtoul(optarg, &endptr, 10);
+                    if (cfg->key_width < 1 || cfg->key_width > NUM_FORMAT_MAX_DIGITS || !endptr || *endptr != '\0') {
+                        fprintf(stderr, "error: key-width must be between 1 and %u.\n", NUM_FORMAT_MAX_DIGITS);
+                        return -1;
+                    }
+                    break;
                 case o_key_minimum:
                     endptr = NULL;
                     cfg->key_minimum = strtoull(optarg, &endptr, 10);
@@ -646,12 +827,23 @@ static int config_parse_args(int argc, char *argv[], struct benchmark_config *cf
                         return -1;
                     }
                     break;
+                case o_key_zipf_exp:
+                    endptr = NULL;
+                    cfg->key_zipf_exp = strtod(optarg, &endptr);
+                    if (cfg->key_zipf_exp <= 0 || !endptr || *endptr != '\0') {
+                        fprintf(stderr, "error: key-zipf-exp must be greater than zero.\n");
+                        return -1;
+                    }
+                    break;
+                case o_key_zipf_scramble:
+                    cfg->key_zipf_scramble = true;
+                    break;
                 case o_key_pattern:
                     cfg->key_pattern = optarg;
                     if (strlen(cfg->key_pattern) != 3 || cfg->key_pattern[1] != ':' ||
-                        (cfg->key_pattern[0] != 'C' && cfg->key_pattern[0] != 'R' && cfg->key_pattern[0] != 'S' && cfg->key_pattern[0] != 'G' && cfg->key_pattern[0] != 'P') ||
-                        (cfg->key_pattern[2] != 'C' && cfg->key_pattern[2] != 'R' && cfg->key_pattern[2] != 'S' && cfg->key_pattern[2] != 'G' && cfg->key_pattern[2] != 'P')) {
-                            fprintf(stderr, "error: key-pattern must be in the format of [S/R/G/C]:[S/R/G/C].\n");
+                        (cfg->key_pattern[0] != 'C' && cfg->key_pattern[0] != 'R' && cfg->key_pattern[0] != 'S' && cfg->key_pattern[0] != 'G' && cfg->key_pattern[0] != 'P' && cfg->key_pattern[0] != 'Z') ||
+                        (cfg->key_pattern[2] != 'C' && cfg->key_pattern[2] != 'R' && cfg->key_pattern[2] != 'S' && cfg->key_pattern[2] != 'G' && cfg->key_pattern[2] != 'P' && cfg->key_pattern[2] != 'Z')) {
+                            fprintf(stderr, "error: key-pattern must be in the format of [S/R/G/C/Z]:[S/R/G/C/Z].\n");
                             return -1;
                     }
                     break;
@@ -711,12 +903,97 @@ static int config_parse_args(int argc, char *argv[], struct benchmark_config *cf
                 case o_json_out_file:
                     cfg->json_out_file = optarg;
                     break;
+                case o_clock_source:
+                    cfg->clock_source = optarg;
+                    if (strcmp(cfg->clock_source, "monotonic") != 0 &&
+                        strcmp(cfg->clock_source, "tsc") != 0) {
+                        fprintf(stderr, "error: clock-source must be either monotonic or tsc.\n");
+                        return -1;
+                    }
+                    break;
+                case o_latency_breakdown:
+                    cfg->latency_breakdown = 1;
+                    break;
+                case o_stats_stream:
+                    cfg->stats_stream = optarg;
+                    break;
+                case o_stats_stream_format:
+                    cfg->stats_stream_format = optarg;
+                    if (strcmp(cfg->stats_stream_format, "csv") != 0 &&
+                        strcmp(cfg->stats_stream_format, "ndjson") != 0) {
+                        fprintf(stderr, "error: stats-stream-format must be either csv or ndjson.\n");
+                        return -1;
+                    }
+                    break;
+                case o_stats_export:
+                    cfg->stats_export = optarg;
+                    break;
+                case o_merge:
+                    cfg->merge = 1;
+                    break;
+                case o_io_engine:
+                    cfg->io_engine = optarg;
+                    if (strcmp(cfg->io_engine, "libevent") != 0 &&
+                        strcmp(cfg->io_engine, "io_uring") != 0) {
+                        fprintf(stderr, "error: io-engine must be either libevent or io_uring.\n");
+                        return -1;
+                    }
+                    break;
+                case o_value_pool:
+                    endptr = NULL;
+                    cfg->value_pool = (unsigned int) strtoul(optarg, &endptr, 10);
+                    if (!cfg->value_pool || !endptr || *endptr != '\0') {
+                        fprintf(stderr, "error: value-pool must be greater than zero.\n");
+                        return -1;
+                    }
+                    break;
+                case o_cluster_mode:
+                    cfg->cluster_mode = true;
+                    break;
+                case o_servers:
+                    cfg->servers = optarg;
+                    if (!*cfg->servers) {
+                        fprintf(stderr, "error: servers must be a list of host[:port].\n");
+                        return -1;
+                    }
+                    break;
+                case o_pubsub_channels:
+                    cfg->pubsub_channels = optarg;
+                    if (strspn(cfg->pubsub_channels, ",") == strlen(cfg->pubsub_channels)) {
+                        fprintf(stderr, "error: pubsub-channels must be a list of channel names.\n");
+                        return -1;
+                    }
+                    break;
+                case o_pubsub_patterns:
+                    cfg->pubsub_patterns = optarg;
+                    if (strspn(cfg->pubsub_patterns, ",") == strlen(cfg->pubsub_patterns)) {
+                        fprintf(stderr, "error: pubsub-patterns must be a list of channel patterns.\n");
+                        return -1;
+                    }
+                    break;
+                case o_pubsub_subscribers:
+                    endptr = NULL;
+                    cfg->pubsub_subscribers = (unsigned int) strtoul(optarg, &endptr, 10);
+                    if (!cfg->pubsub_subscribers || !endptr || *endptr != '\0') {
+                        fprintf(stderr, "error: pubsub-subscribers must be greater than zero.\n");
+                        return -1;
+                    }
+                    break;
             default:
                     return -1;
                     break;
         }
     }
 
+    if (cfg->merge) {
+        if (optind >= argc) {
+            fprintf(stderr, "error: --merge requires at least one stats export file.\n");
+            return -1;
+        }
+        cfg->merge_files = argv + optind;
+        cfg->merge_files_count = argc - optind;
+    }
+
     if ((cfg->verify_only || cfg->verify_set_only) && cfg->crc_verify)
         cfg->data_verify = 0;
 
@@ -725,11 +1002,82 @@ static int config_parse_args(int argc, char *argv[], struct benchmark_config *cf
 	    return -1;
     }
 
+    // the io_uring engine has no timers
+    if (cfg->io_engine && strcmp(cfg->io_engine, "io_uring") == 0 &&
+        (cfg->request_rate || cfg->reconnect_interval)) {
+        fprintf(stderr, "error: --rate and --reconnect-interval are not supported with --io-engine=io_uring.\n");
+        return -1;
+    }
+
+    if (cfg->cluster_mode) {
+        if (cfg->protocol && !is_redis_protocol(cfg->protocol)) {
+            fprintf(stderr, "error: --cluster-mode requires the redis or redis3 protocol.\n");
+            return -1;
+        }
+        if (cfg->unix_socket) {
+            fprintf(stderr, "error: --cluster-mode can't be used with a UNIX domain socket.\n");
+            return -1;
+        }
+        if (cfg->io_engine && strcmp(cfg->io_engine, "io_uring") == 0) {
+            fprintf(stderr, "error: --cluster-mode is not supported with --io-engine=io_uring.\n");
+            return -1;
+        }
+        // keys of one command must be in the same slot, and WAIT and
+        // SELECT don't apply to the cluster as a whole
+        if (cfg->multi_key_get || cfg->wait_ratio.is_defined() || cfg->select_db) {
+            fprintf(stderr, "error: --multi-key-get, --wait-ratio and --select-db can't be used with --cluster-mode.\n");
+            return -1;
+        }
+    }
+
+    if (cfg->servers) {
+        if (cfg->server || cfg->port || cfg->unix_socket) {
+            fprintf(stderr, "error: --servers can't be used with --server, --port or --unix-socket.\n");
+            return -1;
+        }
+        if (cfg->cluster_mode) {
+            fprintf(stderr, "error: --servers and --cluster-mode are mutually exclusive.\n");
+            return -1;
+        }
+        if (cfg->io_engine && strcmp(cfg->io_engine, "io_uring") == 0) {
+            fprintf(stderr, "error: --servers is not supported with --io-engine=io_uring.\n");
+            return -1;
+        }
+    }
+
+    if ((cfg->pubsub_patterns || cfg->pubsub_subscribers) && !cfg->pubsub_channels) {
+        fprintf(stderr, "error: --pubsub-patterns and --pubsub-subscribers require --pubsub-channels.\n");
+        return -1;
+    }
+    if (cfg->pubsub_channels) {
+        if (cfg->protocol && !is_redis_protocol(cfg->protocol)) {
+            fprintf(stderr, "error: --pubsub-channels requires the redis or redis3 protocol.\n");
+            return -1;
+        }
+        // subscribers can't tell how many messages to expect
+        if (!cfg->test_time) {
+            fprintf(stderr, "error: --pubsub-channels requires --test-time.\n");
+            return -1;
+        }
+        unsigned int clients = cfg->clients ? cfg->clients : 50;
+        if (clients < 2 || cfg->pubsub_subscribers >= clients) {
+            fprintf(stderr, "error: pubsub-subscribers must leave at least one publishing client per thread.\n");
+            return -1;
+        }
+        if (cfg->cluster_mode || cfg->servers || cfg->reconnect_interval || cfg->crc_verify ||
+            (cfg->io_engine && strcmp(cfg->io_engine, "io_uring") == 0)) {
+            fprintf(stderr, "error: --pubsub-channels can't be used with --cluster-mode, --servers, --reconnect-interval,\n"
+                            "       --crc-verify or --io-engine=io_uring.\n");
+            return -1;
+        }
+    }
+
     return 0;
 }
 
 void usage() {
     fprintf(stdout, "Usage: memtier_benchmark [options]\n"
+            "       memtier_benchmark [output options] --merge FILE...\n"
             "A memcache/redis NoSQL traffic generator and performance benchmarking tool.\n"
             "\n"
             "Connection and General Options:\n"
@@ -737,15 +1085,56 @@ void usage() {
             "  -p, --port=PORT                Server port (default: 6379)\n"
             "  -S, --unix-socket=SOCKET       UNIX Domain socket name (default: none)\n"
             "  -P, --protocol=PROTOCOL        Protocol to use (default: redis).  Other\n"
-            "                                 supported protocols are memcache_text,\n"
-            "                                 memcache_binary.\n"
+            "                                 supported protocols are redis3 (RESP3),\n"
+            "                                 memcache_text, memcache_meta (quiet meta\n"
+            "                                 commands), memcache_binary.\n"
             "  -x, --run-count=NUMBER         Number of full-test iterations to perform\n"
             "  -D, --debug                    Print debug output\n"
             "      --client-stats=FILE        Produce per-client stats file\n"
             "      --out-file=FILE            Name of output file (default: stdout)\n"
             "      --json-out-file=FILE       Name of JSON output file, if not set, will not print to json\n"
+            "      --stats-stream=FILE        Append per-second results to FILE while the test runs,\n"
+            "                                 instead of keeping them in memory until it ends\n"
+            "      --stats-stream-format=FMT  Format of the stats stream: csv or ndjson (default: csv)\n"
+            "      --stats-export=FILE        Save the results with their raw latency histograms, to be\n"
+            "                                 combined later with --merge (FILE-RUN with --run-count)\n"
+            "      --merge                    Don't run a test; print the combined results of the stats\n"
+            "                                 export files given as arguments, e.g. from several hosts\n"
             "      --show-config              Print detailed configuration before running\n"
             "      --hide-histogram           Don't print detailed latency histogram\n"
+            "      --print-percentiles        Specify which percentiles info to print on the results\n"
+            "                                 table (by default prints percentiles: 50,99,99.9)\n"
+            "      --hdr-significant-figures=NUM\n"
+            "                                 Precision of the latency histograms, 1-5 significant\n"
+            "                                 digits (default: 3); per-second histograms use at most 2\n"
+            "      --hdr-max-latency=MSEC     Highest latency the histograms track, larger values are\n"
+            "                                 counted as this (default: 3600000)\n"
+            "      --clock-source=SOURCE      Clock used to time requests: monotonic or tsc (calibrated\n"
+            "                                 CPU time stamp counter, requires an invariant TSC)\n"
+            "                                 (default: monotonic)\n"
+            "      --latency-breakdown        Also report where request latency was spent: queued in\n"
+            "                                 the client, on the network and server, and receiving\n"
+            "                                 and parsing the response\n"
+            "      --io-engine=ENGINE         How connections are driven: libevent, or io_uring (Linux,\n"
+            "                                 batched submissions and multishot receives; not with\n"
+            "                                 --rate or --reconnect-interval) (default: libevent)\n"
+            "      --cluster-mode             Run against a Redis Cluster: the slot map is read from\n"
+            "                                 the server with CLUSTER SLOTS, every client connects to\n"
+            "                                 all nodes and follows MOVED/ASK redirections, and results\n"
+            "                                 are also reported per node\n"
+            "      --servers=LIST             Run against a pool of servers, host[:port],...\n"
+            "                                 (default port: 11211); keys are distributed with the\n"
+            "                                 ketama consistent hashing of libmemcached, every client\n"
+            "                                 connects to all servers, and results are also reported\n"
+            "                                 per server\n"
+            "      --pubsub-channels=LIST     Pub/sub test: some clients subscribe to these channels,\n"
+            "                                 the others publish to them in turn, with the send time\n"
+            "                                 in every payload.  Publishes are reported as Sets and\n"
+            "                                 received messages as Gets, with their publish to\n"
+            "                                 delivery latency (requires --test-time)\n"
+            "      --pubsub-patterns=LIST     Subscribe to these patterns (PSUBSCRIBE) instead\n"
+            "      --pubsub-subscribers=NUM   Number of subscribing clients per thread, the others\n"
+            "                                 publish (default: half of the clients)\n"
             "      --help                     Display this help\n"
             "      --version                  Display version information\n"
             "\n"
@@ -759,6 +1148,12 @@ void usage() {
             "      --test-time=SECS           Number of seconds to run the test\n"
             "      --ratio=RATIO              Set:Get ratio (default: 1:10)\n"
             "      --pipeline=NUMBER          Number of concurrent pipelined requests (default: 1)\n"
+            "      --rate=NUMBER              Issue requests at a fixed total rate of NUMBER requests\n"
+            "                                 per second, shared by all connections (open-loop). Latency\n"
+            "                                 is measured from the intended send time. Pipeline limits\n"
+            "                                 the outstanding requests per connection (default: unlimited rate)\n"
+            "      --rate-distribution=DIST   Inter-arrival time distribution with --rate: uniform or\n"
+            "                                 poisson (default: uniform)\n"
             "      --reconnect-interval=NUM   Number of requests after which re-connection is performed\n"
             "      --multi-key-get=NUM        Enable multi-key get commands, up to NUM keys (default: 0)\n"
             "  -a, --authenticate=CREDENTIALS Authenticate to redis using CREDENTIALS, which depending\n"
@@ -779,6 +1174,8 @@ void usage() {
             "                                 when set to S, the defined data sizes will be evenly distributed across\n"
             "                                 the key range, see --key-maximum (default R)\n"
             "      --compression-ratio=RATIO  Indicate how much of the data should be compressible (default: 0.0)\n"
+            "      --value-pool=NUM           Cycle through NUM values generated up front, and send large\n"
+            "                                 ones by reference instead of copying them into each request\n"
             "      --expiry-range=RANGE       Use random expiry values from the specified range\n"
             "\n"
             "Imported Data Options:\n"
@@ -792,6 +1189,8 @@ void usage() {
             "\n"
             "Key Options:\n"
             "      --key-prefix=PREFIX        Prefix for keys (default: \"memtier-\")\n"
+            "      --key-width=DIGITS         Zero-pad key IDs to DIGITS digits, so that all keys\n"
+            "                                 have the same length (default: no padding)\n"
             "      --key-minimum=NUMBER       Key ID minimum value (default: 0)\n"
             "      --key-maximum=NUMBER       Key ID maximum value (default: 10000000)\n"
             "      --key-pattern=PATTERN      Set:Get pattern (default: R:R)\n"
@@ -800,10 +1199,15 @@ void usage() {
             "                                 S for Sequential.\n"
             "                                 P for Parallel (Sequential were each client has a subset of the key-range).\n"
             "                                 C for Random Partitioned.\n"
+            "                                 Z for Zipfian distribution.\n"
             "      --key-stddev               The standard deviation used in the Gaussian distribution\n"
             "                                 (default is key range / 6)\n"
             "      --key-median               The median point used in the Gaussian distribution\n"
             "                                 (default is the center of the key range)\n"
+            "      --key-zipf-exp=EXP         The exponent of the Zipfian distribution; the higher, the\n"
+            "                                 more skewed (default: 0.99)\n"
+            "      --key-zipf-scramble        Spread the most accessed keys of the Zipfian distribution\n"
+            "                                 over the key range, instead of its beginning\n"
             "\n"
             "WAIT Options:\n"
             "      --wait-ratio=RATIO         Set:Wait ratio (default is no WAIT commands - 1:0)\n"
@@ -833,10 +1237,12 @@ struct cg_thread {
         m_protocol = protocol_factory(m_config->protocol);
         assert(m_protocol != NULL);
 
-        if (!verify)
-            m_cg = new client_group(m_config, m_protocol, m_obj_gen);
-        else
+        if (verify)
             m_cg = new verify_client_group(m_config, m_protocol, m_obj_gen);
+        else if (m_config->pubsub_channels)
+            m_cg = new pubsub_client_group(m_config, m_protocol, m_obj_gen);
+        else
+            m_cg = new client_group(m_config, m_protocol, m_obj_gen);
     }
         
     ~cg_thread()
@@ -889,7 +1295,7 @@ static void* cg_thread_start(void *t)
 {
     cg_thread* thread = (cg_thread*) t;
     thread->m_cg->run();
-    thread->m_finished = true;
+    __atomic_store_n(&thread->m_finished, true, __ATOMIC_RELEASE);
     
     return t;
 }
@@ -908,7 +1314,7 @@ void size_to_str(unsigned long int size, char *buf, int buf_len)
     }    
 }
 
-run_stats run_benchmark(int run_id, benchmark_config* cfg, object_generator* obj_gen, bool verify)
+run_stats run_benchmark(int run_id, benchmark_config* cfg, object_generator* obj_gen, bool verify, stats_stream* stream)
 {
     fprintf(stderr, "[RUN #%u] Preparing benchmark client...\n", run_id);
 
@@ -925,6 +1331,13 @@ run_stats run_benchmark(int run_id, benchmark_config* cfg, object_generator* obj
         threads.push_back(t);
     }
 
+    // all clients count their seconds from the same point, so that their
+    // time series line up when merged
+    uint64_t time_series_base = clock_now();
+    for (std::vector<cg_thread*>::iterator i = threads.begin(); i != threads.end(); i++) {
+        (*i)->m_cg->set_time_series_base(time_series_base);
+    }
+
     // launch threads
     fprintf(stderr, "[RUN #%u] Launching threads now...\n", run_id);
     for (std::vector<cg_thread*>::iterator i = threads.begin(); i != threads.end(); i++) {
@@ -942,6 +1355,13 @@ run_stats run_benchmark(int run_id, benchmark_config* cfg, object_generator* obj
     double prev_latency = 0, cur_latency = 0;
     unsigned long int cur_ops_sec = 0;
     unsigned long int cur_bytes_sec = 0;
+    live_stats_interval interval;
+    latency_histogram interval_latency_histogram = latency_histogram::per_second();
+    unsigned int interval_count = 0;
+
+    // rates are computed against our own clock: the threads' stats are
+    // only read through their live_stats blocks while they are running
+    uint64_t start_time = clock_now();
 
     // provide some feedback...
     unsigned int active_threads = 0;
@@ -951,22 +1371,35 @@ run_stats run_benchmark(int run_id, benchmark_config* cfg, object_generator* obj
 
         unsigned long int total_ops = 0;
         unsigned long int total_bytes = 0;
-        unsigned long int duration = 0;
-        unsigned int thread_counter = 0; 
         unsigned long int total_latency = 0;
-        
+
+        interval.reset();
         for (std::vector<cg_thread*>::iterator i = threads.begin(); i != threads.end(); i++) {
-            if (!(*i)->m_finished)
+            if (!__atomic_load_n(&(*i)->m_finished, __ATOMIC_ACQUIRE))
                 active_threads++;
 
             total_ops += (*i)->m_cg->get_total_ops();
             total_bytes += (*i)->m_cg->get_total_bytes();
             total_latency += (*i)->m_cg->get_total_latency();
-            thread_counter++;
-            float factor = ((float)(thread_counter - 1) / thread_counter);
-            duration =  factor * duration +  (float)(*i)->m_cg->get_duration_usec() / thread_counter ;
+            (*i)->m_cg->collect_interval(&interval);
         }
-        
+        interval_latency_histogram.reset();
+        interval_latency_histogram.add(interval.m_set_latency_histogram);
+        interval_latency_histogram.add(interval.m_get_latency_histogram);
+        interval_latency_histogram.add(interval.m_wait_latency_histogram);
+        // once all threads are done, report the duration they actually ran
+        unsigned long int duration = 0;
+        if (active_threads > 0) {
+            duration = (clock_now() - start_time) / NSEC_PER_USEC;
+        } else {
+            unsigned int thread_counter = 0;
+            for (std::vector<cg_thread*>::iterator i = threads.begin(); i != threads.end(); i++) {
+                thread_counter++;
+                float factor = ((float)(thread_counter - 1) / thread_counter);
+                duration =  factor * duration +  (float)(*i)->m_cg->get_duration_usec() / thread_counter ;
+            }
+        }
+
         unsigned long int cur_ops = total_ops-prev_ops;
         unsigned long int cur_bytes = total_bytes-prev_bytes;
         unsigned long int cur_duration = duration-prev_duration;
@@ -975,19 +1408,24 @@ run_stats run_benchmark(int run_id, benchmark_config* cfg, object_generator* obj
         prev_bytes = total_bytes;
         prev_latency = total_latency;
         prev_duration = duration;
-        
+
+        if (stream != NULL)
+            stream->write_interval(run_id, ++interval_count, cur_duration, interval);
+
         unsigned long int ops_sec = 0;
         unsigned long int bytes_sec = 0;
         double avg_latency = 0;
         if (duration > 1) {
             ops_sec = (long)( (double)total_ops / duration * 1000000);
             bytes_sec = (long)( (double)total_bytes / duration * 1000000);
-            avg_latency = ((double) total_latency / 1000 / total_ops) ;
+        }
+        if (total_ops > 0) {
+            avg_latency = ((double) total_latency / NSEC_PER_MSEC / total_ops) ;
         }
         if (cur_duration > 1 && active_threads == cfg->threads) {
             cur_ops_sec = (long)( (double)cur_ops / cur_duration * 1000000);
             cur_bytes_sec = (long)( (double)cur_bytes / cur_duration * 1000000);
-            cur_latency = ((double) cur_total_latency / 1000 / cur_ops) ;
+            cur_latency = cur_ops > 0 ? ((double) cur_total_latency / NSEC_PER_MSEC / cur_ops) : 0;
         }
 
         char bytes_str[40], cur_bytes_str[40];
@@ -1000,8 +1438,12 @@ run_stats run_benchmark(int run_id, benchmark_config* cfg, object_generator* obj
         else
             progress = 100.0 * (duration / 1000000.0)/cfg->test_time;
         
-        fprintf(stderr, "[RUN #%u %.0f%%, %3u secs] %2u threads: %11lu ops, %7lu (avg: %7lu) ops/sec, %s/sec (avg: %s/sec), %5.2f (avg: %5.2f) msec latency\r",
-            run_id, progress, (unsigned int) (duration / 1000000), active_threads, total_ops, cur_ops_sec, ops_sec, cur_bytes_str, bytes_str, cur_latency, avg_latency);
+        fprintf(stderr, "[RUN #%u %.0f%%, %3u secs] %2u threads: %11lu ops, %7lu (avg: %7lu) ops/sec, %s/sec (avg: %s/sec), %5.2f (avg: %5.2f) msec latency, "
+                        "%5.2f/%5.2f/%5.2f p50/p99/p99.9 msec\r",
+            run_id, progress, (unsigned int) (duration / 1000000), active_threads, total_ops, cur_ops_sec, ops_sec, cur_bytes_str, bytes_str, cur_latency, avg_latency,
+            interval_latency_histogram.value_at_percentile(50.0) / (double) NSEC_PER_MSEC,
+            interval_latency_histogram.value_at_percentile(99.0) / (double) NSEC_PER_MSEC,
+            interval_latency_histogram.value_at_percentile(99.9) / (double) NSEC_PER_MSEC);
     } while (active_threads > 0);
 
     fprintf(stderr, "\n\n");
@@ -1037,6 +1479,38 @@ run_stats run_benchmark(int run_id, benchmark_config* cfg, object_generator* obj
 }
 
 
+// combines the results exported by several memtier_benchmark instances
+// that ran at the same time, and prints them as if they were a single run.
+static int merge_exported_stats(benchmark_config *cfg, json_handler *jsonhandler)
+{
+    run_stats stats;
+
+    for (int i = 0; i < cfg->merge_files_count; i++) {
+        run_stats file_stats;
+        if (!file_stats.import_stats(cfg->merge_files[i]))
+            return 1;
+        stats.merge(file_stats, i + 1);
+    }
+
+    FILE *outfile = stdout;
+    if (cfg->out_file != NULL) {
+        fprintf(stderr, "Writing results to %s...\n", cfg->out_file);
+        outfile = fopen(cfg->out_file, "w");
+        if (!outfile) {
+            perror(cfg->out_file);
+            return 1;
+        }
+    }
+
+    fprintf(outfile, "%-9u Merged results\n", cfg->merge_files_count);
+    stats.print(outfile, !cfg->hide_histogram, cfg->print_percentiles.quantile_list, "MERGED STATS", jsonhandler);
+
+    if (outfile != stdout) {
+        fclose(outfile);
+    }
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     struct benchmark_config cfg;
@@ -1048,6 +1522,22 @@ int main(int argc, char *argv[])
 
     config_init_defaults(&cfg);
     log_level = cfg.debug;
+    latency_histogram::set_default_layout((uint64_t) cfg.hdr_max_latency * NSEC_PER_MSEC, cfg.hdr_significant_figures);
+    if (!clock_source_init(cfg.clock_source)) {
+        fprintf(stderr, "error: clock source %s is not available on this host.\n", cfg.clock_source);
+        exit(1);
+    }
+    if (strcmp(cfg.io_engine, "io_uring") == 0) {
+#ifdef HAVE_IO_URING
+        if (!io_uring_engine::is_supported()) {
+            fprintf(stderr, "error: io_uring is not available on this host: %s\n", strerror(errno));
+            exit(1);
+        }
+#else
+        fprintf(stderr, "error: this build does not support io_uring.\n");
+        exit(1);
+#endif
+    }
     if (cfg.show_config) {
         fprintf(stderr, "============== Configuration values: ==============\n");
         config_print(stdout, &cfg);
@@ -1062,6 +1552,22 @@ int main(int argc, char *argv[])
         config_print_to_json(jsonhandler,&cfg);
     }
 
+    if (cfg.merge) {
+        int ret = merge_exported_stats(&cfg, jsonhandler);
+        if (jsonhandler != NULL) {
+            delete jsonhandler;
+        }
+        exit(ret);
+    }
+
+    // per-second results stream
+    stats_stream *stream = NULL;
+    if (cfg.stats_stream != NULL) {
+        stream = new stats_stream();
+        if (!stream->open(cfg.stats_stream, cfg.stats_stream_format, cfg.print_percentiles.quantile_list))
+            exit(1);
+    }
+
     struct rlimit rlim;
     if (getrlimit(RLIMIT_NOFILE, &rlim) != 0) {
         benchmark_error_log("error: getrlimit failed: %s\n", strerror(errno));
@@ -1084,7 +1590,26 @@ int main(int argc, char *argv[])
         }
     }
 
-    unsigned int fds_needed = (cfg.threads * cfg.clients) + (cfg.threads * 10) + 10;
+    // every client connects to every node of the cluster, or server of the pool
+    unsigned int connections_per_client = 1;
+    if (cfg.cluster_mode) {
+        abstract_protocol *protocol = protocol_factory(cfg.protocol);
+        assert(protocol != NULL);
+
+        cfg.cluster_slots = new cluster_slot_map();
+        if (!cfg.cluster_slots->load(cfg.server, cfg.port, cfg.server_addr, protocol, cfg.authenticate))
+            exit(1);
+        delete protocol;
+        connections_per_client = cfg.cluster_slots->get_nodes_count();
+    }
+    if (cfg.servers != NULL) {
+        cfg.server_pool = new ketama_continuum();
+        if (!cfg.server_pool->load(cfg.servers))
+            exit(1);
+        connections_per_client = cfg.server_pool->get_servers_count();
+    }
+
+    unsigned int fds_needed = (cfg.threads * cfg.clients * connections_per_client) + (cfg.threads * 10) + 10;
     if (fds_needed > rlim.rlim_cur) {
         if (fds_needed > rlim.rlim_max && getuid() != 0) {
             benchmark_error_log("error: running the tool with this number of connections requires 'root' privilegs.\n");
@@ -1179,7 +1704,7 @@ int main(int argc, char *argv[])
     }
 
     if (cfg.authenticate) {
-        if (strcmp(cfg.protocol, "redis") != 0  &&
+        if (!is_redis_protocol(cfg.protocol) &&
             strcmp(cfg.protocol, "memcache_binary") != 0) {
                 fprintf(stderr, "error: authenticate can only be used with redis or memcache_binary.\n");
                 usage();
@@ -1199,7 +1724,7 @@ int main(int argc, char *argv[])
         obj_gen->set_compression_ratio(cfg.compression_ratio);
     }
 
-    if (cfg.select_db > 0 && strcmp(cfg.protocol, "redis")) {
+    if (cfg.select_db > 0 && !is_redis_protocol(cfg.protocol)) {
         fprintf(stderr, "error: select-db can only be used with redis protocol.\n");
         usage();
     }
@@ -1208,7 +1733,7 @@ int main(int argc, char *argv[])
             fprintf(stderr, "error: data-offset too long\n");
             usage();
         }
-        if (cfg.expiry_range.min || cfg.expiry_range.max || strcmp(cfg.protocol, "redis")) {
+        if (cfg.expiry_range.min || cfg.expiry_range.max || !is_redis_protocol(cfg.protocol)) {
             fprintf(stderr, "error: data-offset can only be used with redis protocol, and cannot be used with expiry\n");
             usage();
         }
@@ -1236,6 +1761,16 @@ int main(int argc, char *argv[])
     if (!cfg.data_import || cfg.generate_keys) {
         obj_gen->set_key_prefix(cfg.key_prefix);
         obj_gen->set_key_range(cfg.key_minimum, cfg.key_maximum);
+        if (cfg.key_width) {
+            if (num_format_digits(cfg.key_maximum) > cfg.key_width) {
+                fprintf(stderr, "error: key-width is too small for key-maximum.\n");
+                usage();
+            }
+            obj_gen->set_key_width(cfg.key_width);
+        }
+    } else if (cfg.key_width) {
+        fprintf(stderr, "error: key-width is only allowed with generated keys.\n");
+        usage();
     }
     if (cfg.key_stddev>0 || cfg.key_median>0) {
         if (cfg.key_pattern[0]!='G' && cfg.key_pattern[2]!='G') {
@@ -1248,7 +1783,20 @@ int main(int argc, char *argv[])
         }
         obj_gen->set_key_distribution(cfg.key_stddev, cfg.key_median);
     }
+    if (cfg.key_pattern[0] == 'Z' || cfg.key_pattern[2] == 'Z') {
+        obj_gen->set_key_zipf(cfg.key_zipf_exp > 0 ? cfg.key_zipf_exp : 0.99, cfg.key_zipf_scramble);
+    } else if (cfg.key_zipf_exp > 0 || cfg.key_zipf_scramble) {
+        fprintf(stderr, "error: key-zipf-exp and key-zipf-scramble are only allowed together with key-pattern set to Z.\n");
+        usage();
+    }
     obj_gen->set_expiry_range(cfg.expiry_range.min, cfg.expiry_range.max);
+    if (cfg.value_pool) {
+        if (cfg.data_import || cfg.crc_verify) {
+            fprintf(stderr, "error: value-pool cannot be used with data-import or crc-verify.\n");
+            usage();
+        }
+        obj_gen->set_value_pool(cfg.value_pool);
+    }
 
     // Prepare output file
     FILE *outfile;
@@ -1268,8 +1816,17 @@ int main(int argc, char *argv[])
             if (run_id > 1)
                 sleep(1);   // let connections settle
             
-            run_stats stats = run_benchmark(run_id, &cfg, obj_gen, false);
+            run_stats stats = run_benchmark(run_id, &cfg, obj_gen, false, stream);
             all_stats.push_back(stats);
+
+            if (cfg.stats_export != NULL) {
+                char filename[PATH_MAX];
+                if (cfg.run_count > 1)
+                    snprintf(filename, sizeof(filename)-1, "%s-%u", cfg.stats_export, run_id);
+                else
+                    snprintf(filename, sizeof(filename)-1, "%s", cfg.stats_export);
+                stats.export_stats(filename);
+            }
         }
         //
         // Print some run information        
@@ -1309,17 +1866,17 @@ int main(int argc, char *argv[])
             }
 
             // Best results:
-            best->print(outfile, !cfg.hide_histogram, "BEST RUN RESULTS", jsonhandler);
+            best->print(outfile, !cfg.hide_histogram, cfg.print_percentiles.quantile_list, "BEST RUN RESULTS", jsonhandler);
             // worst results:
-            worst->print(outfile, !cfg.hide_histogram, "WORST RUN RESULTS", jsonhandler);
+            worst->print(outfile, !cfg.hide_histogram, cfg.print_percentiles.quantile_list, "WORST RUN RESULTS", jsonhandler);
             // average results:
             run_stats average;
             average.aggregate_average(all_stats);
             char average_header[50];
             sprintf(average_header,"AGGREGATED AVERAGE RESULTS (%u runs)", cfg.run_count);
-            average.print(outfile, !cfg.hide_histogram, average_header, jsonhandler);
+            average.print(outfile, !cfg.hide_histogram, cfg.print_percentiles.quantile_list, average_header, jsonhandler);
         } else {
-            all_stats.begin()->print(outfile, !cfg.hide_histogram, "ALL STATS", jsonhandler);
+            all_stats.begin()->print(outfile, !cfg.hide_histogram, cfg.print_percentiles.quantile_list, "ALL STATS", jsonhandler);
         }
     }
 
@@ -1365,7 +1922,7 @@ int main(int argc, char *argv[])
             if (run_id > 1)
                 sleep(1);   // let connections settle
 
-            run_stats stats = run_benchmark(run_id, &cfg, obj_gen, true);
+            run_stats stats = run_benchmark(run_id, &cfg, obj_gen, true, stream);
             all_stats.push_back(stats);
         }
         //
@@ -1388,7 +1945,7 @@ int main(int argc, char *argv[])
             jsonhandler->close_nesting();
         }
 
-        all_stats.begin()->print(outfile, cfg.hide_histogram, "VERIFICATION STATS", jsonhandler);
+        all_stats.begin()->print(outfile, cfg.hide_histogram, cfg.print_percentiles.quantile_list, "VERIFICATION STATS", jsonhandler);
 
         fprintf(outfile, "\nData verification completed:\n"
                         "%-10lu keys verified successfuly.\n"
@@ -1406,7 +1963,15 @@ int main(int argc, char *argv[])
         delete jsonhandler;
     }
 
+    if (stream != NULL) {
+        delete stream;
+    }
+
     delete obj_gen;
     if (keylist != NULL)
         delete keylist;
+    if (cfg.cluster_slots != NULL)
+        delete cfg.cluster_slots;
+    if (cfg.server_pool != NULL)
+        delete cfg.server_pool;
 }
@@ -43,6 +43,18 @@ struct benchmark_config {
     int debug;
     int show_config;
     int hide_histogram;
+    config_quantiles print_percentiles;
+    int hdr_significant_figures;
+    unsigned int hdr_max_latency;
+    const char *clock_source;
+    int latency_breakdown;
+    const char *stats_stream;
+    const char *stats_stream_format;
+    const char *stats_export;
+    const char *io_engine;
+    int merge;
+    char **merge_files;
+    int merge_files_count;
     int distinct_client_seed;
     int randomize;
     int next_client_idx;
@@ -54,10 +66,13 @@ struct benchmark_config {
     unsigned int test_time;
     config_ratio ratio;
     unsigned int pipeline;
+    unsigned int request_rate;
+    const char *rate_distribution;
     unsigned int data_size;
     unsigned int data_offset;
     bool random_data;
     float compression_ratio;
+    unsigned int value_pool;
     struct config_range data_size_range;
     config_weight_list data_size_list;
     const char *data_size_pattern;
@@ -69,10 +84,13 @@ struct benchmark_config {
     bool crc_verify;
     int generate_keys;
     const char *key_prefix;
+    unsigned int key_width;
     unsigned long long key_minimum;
     unsigned long long key_maximum;
     double key_stddev;
     double key_median;
+    double key_zipf_exp;
+    bool key_zipf_scramble;
     const char *key_pattern;
     unsigned int reconnect_interval;
     int multi_key_get;
@@ -86,6 +104,16 @@ struct benchmark_config {
     config_range wait_timeout;
     // JSON additions
     const char *json_out_file;
+    // cluster mode
+    bool cluster_mode;
+    class cluster_slot_map *cluster_slots;
+    // memcache server pool
+    const char *servers;
+    class ketama_continuum *server_pool;
+    // pub/sub mode
+    const char *pubsub_channels;
+    const char *pubsub_patterns;
+    unsigned int pubsub_subscribers;
 };
 
 
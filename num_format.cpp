@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2011-2017 Redis Labs Ltd.
+ *
+ * This file is part of memtier_benchmark.
+ *
+ * memtier_benchmark is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * memtier_benchmark is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memtier_benchmark.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "num_format.h"
+
+static const char s_digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+unsigned int num_format_digits(unsigned long long v)
+{
+    unsigned int digits = 1;
+
+    // four at a time while the value is large, then one by one
+    while (v >= 10000) {
+        v /= 10000;
+        digits += 4;
+    }
+    if (v >= 10) digits++;
+    if (v >= 100) digits++;
+    if (v >= 1000) digits++;
+
+    return digits;
+}
+
+unsigned int num_format(char *buf, unsigned long long v)
+{
+    unsigned int len = num_format_digits(v);
+    char *p = buf + len;
+
+    while (v >= 100) {
+        unsigned int pair = (unsigned int) (v % 100) * 2;
+        v /= 100;
+        *--p = s_digit_pairs[pair + 1];
+        *--p = s_digit_pairs[pair];
+    }
+
+    if (v >= 10) {
+        unsigned int pair = (unsigned int) v * 2;
+        *--p = s_digit_pairs[pair + 1];
+        *--p = s_digit_pairs[pair];
+    } else {
+        *--p = (char) ('0' + v);
+    }
+
+    return len;
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2011-2017 Redis Labs Ltd.
+ *
+ * This file is part of memtier_benchmark.
+ *
+ * memtier_benchmark is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * memtier_benchmark is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memtier_benchmark.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _NUM_FORMAT_H
+#define _NUM_FORMAT_H
+
+#include <stddef.h>
+
+// longest decimal representation of an unsigned 64-bit value
+#define NUM_FORMAT_MAX_DIGITS   20
+
+/*
+ * Decimal formatting of unsigned integers for request encoding.  Digits are
+ * produced two at a time from a lookup table, without going through
+ * snprintf() and its format parsing and locale handling.
+ */
+
+// number of decimal digits in v
+unsigned int num_format_digits(unsigned long long v);
+
+// writes v in decimal to buf, which must have room for
+// num_format_digits(v) characters; no terminator is added.
+// returns the number of characters written.
+unsigned int num_format(char *buf, unsigned long long v);
+
+#endif /* _NUM_FORMAT_H */
@@ -33,6 +33,7 @@
 
 #include "obj_gen.h"
 #include "memtier_benchmark.h"
+#include "num_format.h"
 
 random_generator::random_generator()
 {
@@ -134,6 +135,118 @@ unsigned long long gaussian_noise::gaussian_distribution_range(double stddev, do
     return val;
 }
 
+zipf_distribution::zipf_distribution() :
+    m_n(0), m_exponent(0), m_h_integral_x1(0), m_h_integral_n(0), m_s(0),
+    m_scramble(false), m_scramble_bits(0)
+{
+}
+
+// log1p(x) / x and expm1(x) / x, accurate near 0
+static double zipf_helper1(double x)
+{
+    if (fabs(x) > 1e-8)
+        return log1p(x) / x;
+    return 1 - x * (0.5 - x * (1.0 / 3 - 0.25 * x));
+}
+
+static double zipf_helper2(double x)
+{
+    if (fabs(x) > 1e-8)
+        return expm1(x) / x;
+    return 1 + x * 0.5 * (1 + x * (1.0 / 3) * (1 + 0.25 * x));
+}
+
+// the (unnormalized) density, and an integral of it and its inverse
+double zipf_distribution::h(double x) const
+{
+    return exp(-m_exponent * log(x));
+}
+
+double zipf_distribution::h_integral(double x) const
+{
+    double log_x = log(x);
+    return zipf_helper2((1 - m_exponent) * log_x) * log_x;
+}
+
+double zipf_distribution::h_integral_inverse(double x) const
+{
+    double t = x * (1 - m_exponent);
+    if (t < -1)
+        t = -1;     // rounding, limit of the domain
+    return exp(zipf_helper1(t) * x);
+}
+
+void zipf_distribution::init(unsigned long long n, double exponent, bool scramble)
+{
+    assert(n > 0);
+    assert(exponent > 0);
+
+    m_n = n;
+    m_exponent = exponent;
+    m_h_integral_x1 = h_integral(1.5) - 1;
+    m_h_integral_n = h_integral(n + 0.5);
+    m_s = 2 - h_integral_inverse(h_integral(2.5) - h(2));
+
+    m_scramble = scramble;
+    m_scramble_bits = 1;
+    while (m_scramble_bits < 32 && (1ULL << (m_scramble_bits * 2)) < n)
+        m_scramble_bits++;
+}
+
+unsigned long long zipf_distribution::sample(random_generator *random)
+{
+    unsigned long long k;
+
+    while (true) {
+        // a uniform double in [0, 1) with 53 random bits: get_random() holds
+        // two independent 31-bit draws, one in each half
+        unsigned long long r = random->get_random();
+        double u = (((r >> 32) << 22) ^ (r & 0x7fffffffULL)) * (1.0 / 9007199254740992.0);
+        u = m_h_integral_n + u * (m_h_integral_x1 - m_h_integral_n);
+        double x = h_integral_inverse(u);
+
+        if (x + 0.5 < 1)
+            k = 1;
+        else if (x + 0.5 >= (double) m_n)
+            k = m_n;
+        else
+            k = (unsigned long long) (x + 0.5);
+
+        if (k - x <= m_s || u >= h_integral(k + 0.5) - h(k))
+            break;
+    }
+
+    return m_scramble ? scramble(k - 1) : k - 1;
+}
+
+// a permutation of [0, n): a balanced Feistel network over the smallest
+// even number of bits that holds n, applied again while the result is out
+// of range (cycle walking).  it is fixed, so all clients agree on which
+// keys are hot.
+unsigned long long zipf_distribution::scramble(unsigned long long index) const
+{
+    static const unsigned long long round_keys[4] = {
+        0x9e3779b97f4a7c15ULL, 0xbf58476d1ce4e5b9ULL, 0x94d049bb133111ebULL, 0x2545f4914f6cdd1dULL
+    };
+    const unsigned long long mask = (1ULL << m_scramble_bits) - 1;
+
+    do {
+        unsigned long long left = index >> m_scramble_bits;
+        unsigned long long right = index & mask;
+
+        for (unsigned int i = 0; i < 4; i++) {
+            unsigned long long f = (right + round_keys[i]) * 0xff51afd7ed558ccdULL;
+            f ^= f >> 33;
+            unsigned long long next = left ^ (f & mask);
+            left = right;
+            right = next;
+        }
+        index = (left << m_scramble_bits) | right;
+    } while (index >= m_n);
+
+    return index;
+}
+
 uint32_t crc32::calc_crc32(const void *buffer, unsigned long length, const void *key, unsigned int key_length)
 {
     const unsigned char *cp = (const unsigned char *) buffer;
@@ -211,15 +324,25 @@ object_generator::object_generator() :
     m_expiry_min(0),
     m_expiry_max(0),
     m_key_prefix(NULL),
+    m_key_prefix_len(0),
+    m_key_width(0),
     m_key_min(0),
     m_key_max(0),
     m_key_stddev(0),
     m_key_median(0),
+    m_key_zipf_exp(0),
+    m_key_zipf_scramble(false),
+    m_key_index(0),
+    m_key_len(0),
     m_value_buffer(NULL),
     m_random_fd(-1),
     m_value_buffer_size(0),
     m_value_buffer_random_part_size(0),
-    m_value_buffer_mutation_pos(0)
+    m_value_buffer_mutation_pos(0),
+    m_value_pool(NULL),
+    m_value_pool_count(0),
+    m_value_pool_next(0),
+    m_value_pool_owner(false)
 {
     for (int i = 0; i < OBJECT_GENERATOR_KEY_ITERATORS; i++)
         m_next_key[i] = 0;
@@ -236,15 +359,26 @@ object_generator::object_generator(const object_generator& copy) :
     m_expiry_min(copy.m_expiry_min),
     m_expiry_max(copy.m_expiry_max),
     m_key_prefix(copy.m_key_prefix),
+    m_key_prefix_len(copy.m_key_prefix_len),
+    m_key_width(copy.m_key_width),
     m_key_min(copy.m_key_min),
     m_key_max(copy.m_key_max),
     m_key_stddev(copy.m_key_stddev),
     m_key_median(copy.m_key_median),
+    m_key_zipf_exp(copy.m_key_zipf_exp),
+    m_key_zipf_scramble(copy.m_key_zipf_scramble),
+    m_key_zipf(copy.m_key_zipf),
+    m_key_index(0),
+    m_key_len(0),
     m_value_buffer(NULL),
     m_random_fd(-1),
     m_value_buffer_size(0),
     m_value_buffer_random_part_size(copy.m_value_buffer_random_part_size),
-    m_value_buffer_mutation_pos(0)
+    m_value_buffer_mutation_pos(0),
+    m_value_pool(copy.m_value_pool),
+    m_value_pool_count(copy.m_value_pool_count),
+    m_value_pool_next(0),
+    m_value_pool_owner(false)
 {
     if (m_data_size_type == data_size_weighted &&
         m_data_size.size_list != NULL) {
@@ -253,12 +387,15 @@ object_generator::object_generator(const object_generator& copy) :
     alloc_value_buffer(copy.m_value_buffer);
     for (int i = 0; i < OBJECT_GENERATOR_KEY_ITERATORS; i++)
         m_next_key[i] = 0;
+    memcpy(m_key_buffer, copy.m_key_buffer, m_key_prefix_len);
 }
 
 object_generator::~object_generator()
 {
     if (m_value_buffer != NULL)
         free(m_value_buffer);
+    if (m_value_pool_owner)
+        free(m_value_pool);
     if (m_data_size_type == data_size_weighted &&
         m_data_size.size_list != NULL) {
         delete m_data_size.size_list;
@@ -382,6 +519,33 @@ void object_generator::set_data_size_list(config_weight_list* size_list)
     alloc_value_buffer();
 }
 
+// generates COUNT values up front and cycles through them instead of
+// mutating the value buffer on every request.  The pool is shared with all
+// clones and never written to again, so protocols may reference its values
+// rather than copy them (see abstract_protocol::set_reference_values).
+void object_generator::set_value_pool(unsigned int count)
+{
+    assert(m_value_pool == NULL);
+    if (count == 0 || m_value_buffer_size == 0)
+        return;
+
+    m_value_pool = (char*) malloc((size_t) count * m_value_buffer_size);
+    assert(m_value_pool != NULL);
+    m_value_pool_count = count;
+    m_value_pool_owner = true;
+
+    // same layout as the value buffer: random part, then compressible part
+    for (unsigned int i = 0; i < count; i++) {
+        char *value = m_value_pool + (size_t) i * m_value_buffer_size;
+
+        memcpy(value, m_value_buffer, m_value_buffer_size);
+        if (m_random_data) {
+            int ret = read(m_random_fd, value, m_value_buffer_random_part_size);
+            assert(ret == (int)m_value_buffer_random_part_size);
+        }
+    }
+}
+
 void object_generator::set_data_size_pattern(const char* pattern)
 {
     m_data_size_pattern = pattern;
@@ -396,12 +560,28 @@ void object_generator::set_expiry_range(unsigned int expiry_min, unsigned int ex
 void object_generator::set_key_prefix(const char *key_prefix)
 {
     m_key_prefix = key_prefix;
+
+    // the prefix is copied once; keys are formatted by writing their number after it
+    m_key_prefix_len = strlen(key_prefix);
+    if (m_key_prefix_len > sizeof(m_key_buffer) - NUM_FORMAT_MAX_DIGITS - 1)
+        m_key_prefix_len = sizeof(m_key_buffer) - NUM_FORMAT_MAX_DIGITS - 1;
+    memcpy(m_key_buffer, key_prefix, m_key_prefix_len);
+    m_key_len = 0;
+}
+
+void object_generator::set_key_width(unsigned int width)
+{
+    assert(width <= NUM_FORMAT_MAX_DIGITS);
+    m_key_width = width;
+    m_key_len = 0;
 }
 
 void object_generator::set_key_range(unsigned long long key_min, unsigned long long key_max)
 {
     m_key_min = key_min;
     m_key_max = key_max;
+    if (m_key_zipf_exp > 0)
+        m_key_zipf.init(m_key_max - m_key_min + 1, m_key_zipf_exp, m_key_zipf_scramble);
 }
 
 void object_generator::set_key_distribution(double key_stddev, double key_median)
@@ -410,6 +590,13 @@ void object_generator::set_key_distribution(double key_stddev, double key_median
     m_key_median = key_median;
 }
 
+void object_generator::set_key_zipf(double exponent, bool scramble)
+{
+    m_key_zipf_exp = exponent;
+    m_key_zipf_scramble = scramble;
+    m_key_zipf.init(m_key_max - m_key_min + 1, m_key_zipf_exp, m_key_zipf_scramble);
+}
+
 // return a random number between r_min and r_max
 unsigned long long object_generator::random_range(unsigned long long r_min, unsigned long long  r_max)
 {
@@ -425,13 +612,16 @@ unsigned long long object_generator::normal_distribution(unsigned long long r_mi
 
 unsigned long long object_generator::get_key_index(int iter)
 {
-    assert(iter < OBJECT_GENERATOR_KEY_ITERATORS && iter >= OBJECT_GENERATOR_KEY_GAUSSIAN);
+    assert(iter < OBJECT_GENERATOR_KEY_ITERATORS && iter >= OBJECT_GENERATOR_KEY_ZIPF);
 
     unsigned long long k;
     if (iter==OBJECT_GENERATOR_KEY_RANDOM) {
         k = random_range(m_key_min, m_key_max);
     } else if(iter==OBJECT_GENERATOR_KEY_GAUSSIAN) {
         k = normal_distribution(m_key_min, m_key_max, m_key_stddev, m_key_median);
+    } else if (iter==OBJECT_GENERATOR_KEY_ZIPF) {
+        assert(m_key_zipf.is_defined());
+        k = m_key_min + m_key_zipf.sample(&m_random);
     } else {
         if (m_next_key[iter] < m_key_min)
             m_next_key[iter] = m_key_min;
@@ -444,15 +634,51 @@ unsigned long long object_generator::get_key_index(int iter)
     return k;
 }
 
+void object_generator::format_key(unsigned long long index)
+{
+    char *p = m_key_buffer + m_key_prefix_len;
+    unsigned int digits = num_format_digits(index);
+
+    if (digits < m_key_width) {
+        memset(p, '0', m_key_width - digits);
+        p += m_key_width - digits;
+    }
+    p += num_format(p, index);
+    *p = '\0';
+
+    m_key_len = p - m_key_buffer;
+}
+
+// turns the key in m_key_buffer into the key of the next index, in place.
+// returns false if the number needs one more digit than the buffer holds.
+bool object_generator::increment_key(void)
+{
+    char *first = m_key_buffer + m_key_prefix_len;
+    char *p = m_key_buffer + m_key_len;
+
+    while (p > first) {
+        p--;
+        if (*p != '9') {
+            (*p)++;
+            return true;
+        }
+        *p = '0';
+    }
+    return false;
+}
+
 const char* object_generator::get_key(int iter, unsigned int *len)
 {
-    unsigned int l;
-    m_key_index = get_key_index(iter);
-    
-    // format key
-    l = snprintf(m_key_buffer, sizeof(m_key_buffer)-1,
-        "%s%llu", m_key_prefix, m_key_index);
-    if (len != NULL) *len = l;
+    unsigned long long index = get_key_index(iter);
+
+    // sequential patterns mostly ask for the key that follows (or repeats)
+    // the previous one, which only needs its last digits updated
+    if (m_key_len == 0 || index != m_key_index) {
+        if (m_key_len == 0 || index != m_key_index + 1 || !increment_key())
+            format_key(index);
+        m_key_index = index;
+    }
+    if (len != NULL) *len = m_key_len;
     
     return m_key_buffer;
 }
@@ -491,6 +717,14 @@ data_object* object_generator::get_object(int iter)
         expiry = random_range(m_expiry_min, m_expiry_max);
     }
     
+    // pool values vary by picking the next one, and are never modified
+    char *value_buffer = m_value_buffer;
+    if (m_value_pool != NULL) {
+        value_buffer = m_value_pool + (size_t) m_value_pool_next * m_value_buffer_size;
+        if (++m_value_pool_next >= m_value_pool_count)
+            m_value_pool_next = 0;
+    }
+
     // modify object content in case of random data
     if (m_random_data) {
         if (m_compression_ratio > 0.0) {
@@ -501,14 +735,16 @@ data_object* object_generator::get_object(int iter)
         }
 
         // modify only the random part, not the compressible part!
-        m_value_buffer[m_value_buffer_mutation_pos++]++;
-        if (m_value_buffer_mutation_pos >= m_value_buffer_random_part_size)
-            m_value_buffer_mutation_pos = 0;
+        if (m_value_pool == NULL) {
+            m_value_buffer[m_value_buffer_mutation_pos++]++;
+            if (m_value_buffer_mutation_pos >= m_value_buffer_random_part_size)
+                m_value_buffer_mutation_pos = 0;
+        }
     }
 
     // set object
-    m_object.set_key(m_key_buffer, strlen(m_key_buffer));
-    m_object.set_value(m_value_buffer + value_buffer_pos, new_size);
+    m_object.set_key(m_key_buffer, m_key_len);
+    m_object.set_value(value_buffer + value_buffer_pos, new_size);
     m_object.set_expiry(expiry);    
     
     return &m_object;
@@ -790,7 +1026,7 @@ data_object* crc_object_generator::get_object(int iter)
     memcpy(m_crc_buffer, &crc, m_crc_size);
 
     // set object
-    m_object.set_key(m_key_buffer, strlen(m_key_buffer));
+    m_object.set_key(m_key_buffer, m_key_len);
     m_object.set_value(m_value_buffer, new_size);
     m_object.set_expiry(expiry);
 
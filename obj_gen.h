@@ -51,6 +51,36 @@ private:
 	double m_spare;
 };
 
+/*
+ * Zipf distribution over n ranks, P(rank k) ~ 1 / k^exponent, sampled in
+ * constant expected time and space by rejection-inversion (Hormann and
+ * Derflinger, 1996), so it suits key ranges of any size.  Optionally the
+ * ranks are scrambled by a pseudo random permutation of the range, so the
+ * hot keys are spread over it rather than adjacent.
+ */
+class zipf_distribution {
+public:
+    zipf_distribution();
+    void init(unsigned long long n, double exponent, bool scramble);
+    bool is_defined(void) const { return m_n > 0; }
+
+    // returns an index in [0, n)
+    unsigned long long sample(random_generator *random);
+private:
+    unsigned long long m_n;
+    double m_exponent;
+    double m_h_integral_x1;
+    double m_h_integral_n;
+    double m_s;
+    bool m_scramble;
+    unsigned int m_scramble_bits;       // half the bits of the permuted domain
+
+    double h(double x) const;
+    double h_integral(double x) const;
+    double h_integral_inverse(double x) const;
+    unsigned long long scramble(unsigned long long index) const;
+};
+
 class data_object {
 protected:    
     const char *m_key;
@@ -84,6 +114,7 @@ private:
 #define OBJECT_GENERATOR_KEY_GET_ITER   0
 #define OBJECT_GENERATOR_KEY_RANDOM    -1
 #define OBJECT_GENERATOR_KEY_GAUSSIAN  -2
+#define OBJECT_GENERATOR_KEY_ZIPF      -3
 
 class object_generator {
 public:
@@ -104,27 +135,39 @@ protected:
     unsigned int m_expiry_min;
     unsigned int m_expiry_max;
     const char *m_key_prefix;
+    unsigned int m_key_prefix_len;
+    unsigned int m_key_width;           // zero-pad key numbers to this many digits
     unsigned long long m_key_min;
     unsigned long long m_key_max;
     double m_key_stddev;
     double m_key_median;
+    double m_key_zipf_exp;
+    bool m_key_zipf_scramble;
+    zipf_distribution m_key_zipf;
     data_object m_object;
 
     unsigned long long m_next_key[OBJECT_GENERATOR_KEY_ITERATORS];
 
     unsigned long long m_key_index;
-    char m_key_buffer[250];
+    char m_key_buffer[250];             // the key prefix, followed by the number of m_key_index
+    unsigned int m_key_len;             // 0 until a key was formatted in m_key_buffer
     char *m_value_buffer;
     int m_random_fd;
     gaussian_noise m_random;
     unsigned int m_value_buffer_size;
     unsigned int m_value_buffer_random_part_size;
     unsigned int m_value_buffer_mutation_pos;
+    char *m_value_pool;                 // m_value_pool_count values of m_value_buffer_size, read-only
+    unsigned int m_value_pool_count;
+    unsigned int m_value_pool_next;
+    bool m_value_pool_owner;            // clones share the pool of the generator they came from
     
     virtual void alloc_value_buffer(void);
     virtual void alloc_value_buffer(const char* copy_from);
     void random_init(void);
     unsigned long long get_key_index(int iter);
+    void format_key(unsigned long long index);
+    bool increment_key(void);
 public:    
     object_generator();
     object_generator(const object_generator& copy);
@@ -140,10 +183,13 @@ public:
     void set_data_size_range(unsigned int size_min, unsigned int size_max);
     void set_data_size_list(config_weight_list* data_size_list);
     void set_data_size_pattern(const char* pattern);
+    void set_value_pool(unsigned int count);
     void set_expiry_range(unsigned int expiry_min, unsigned int expiry_max);
     void set_key_prefix(const char *key_prefix);    
+    void set_key_width(unsigned int width);
     void set_key_range(unsigned long long key_min, unsigned long long key_max);
     void set_key_distribution(double key_stddev, double key_median);
+    void set_key_zipf(double exponent, bool scramble);
     void set_random_seed(int seed);
 
     virtual const char* get_key(int iter, unsigned int *len);
@@ -26,15 +26,17 @@
 #ifdef HAVE_ASSERT_H
 #include <assert.h>
 #endif
+#include <deque>
 
 #include "protocol.h"
+#include "num_format.h"
 #include "memtier_benchmark.h"
 #include "libmemcached_protocol/binary.h"
 
 /////////////////////////////////////////////////////////////////////////
 
 abstract_protocol::abstract_protocol() :
-    m_read_buf(NULL), m_write_buf(NULL), m_keep_value(false)
+    m_read_buf(NULL), m_write_buf(NULL), m_keep_value(false), m_reference_values(false)
 {    
 }
 
@@ -53,10 +55,120 @@ void abstract_protocol::set_keep_value(bool flag)
     m_keep_value = flag;
 }
 
+void abstract_protocol::set_reference_values(bool flag)
+{
+    m_reference_values = flag;
+}
+
+int abstract_protocol::write_command_subscribe(const char *channel, int channel_len, bool pattern)
+{
+    fprintf(stderr, "error: pub/sub is not supported by this protocol.\n");
+    assert(0);
+    return 0;
+}
+
+int abstract_protocol::write_command_publish(const char *channel, int channel_len, const char *payload, int payload_len)
+{
+    fprintf(stderr, "error: pub/sub is not supported by this protocol.\n");
+    assert(0);
+    return 0;
+}
+
+// values that stay unchanged for the whole test (see set_reference_values)
+// are referenced rather than copied, unless copying is cheaper than the
+// extra buffer chain.
+bool abstract_protocol::is_referenced_value(unsigned int value_len) const
+{
+    return m_reference_values && value_len >= PROTOCOL_REFERENCE_MIN_VALUE_LEN;
+}
+
+void abstract_protocol::write_value(const char *value, unsigned int value_len)
+{
+    if (is_referenced_value(value_len)) {
+        evbuffer_add_reference(m_write_buf, value, value_len, NULL, NULL);
+    } else {
+        evbuffer_add(m_write_buf, value, value_len);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////
+
+// room for the fixed parts and numbers of any single key command
+#define COMMAND_MAX_OVERHEAD    128
+
+/*
+ * Builds a command directly in space reserved at the end of the write
+ * buffer: constant parts are copied from pre-serialized templates and
+ * numbers are formatted in place, and the whole command is added with a
+ * single commit.  The caller reserves enough for everything it adds.
+ */
+class command_writer {
+protected:
+    struct evbuffer *m_buf;
+    struct evbuffer_iovec m_iov;
+    char *m_pos;
+    char *m_end;
+public:
+    command_writer(struct evbuffer *buf, size_t max_len) : m_buf(buf) {
+        int n = evbuffer_reserve_space(buf, max_len, &m_iov, 1);
+        assert(n == 1);
+        (void) n;
+
+        m_pos = (char *) m_iov.iov_base;
+        m_end = m_pos + m_iov.iov_len;
+    }
+
+    void add(const char *str, size_t len) {
+        assert(m_pos + len <= m_end);
+        memcpy(m_pos, str, len);
+        m_pos += len;
+    }
+
+    template <size_t N> void add(const char (&str)[N]) {
+        add(str, N - 1);
+    }
+
+    void add_number(unsigned long long v) {
+        assert(m_pos + num_format_digits(v) <= m_end);
+        m_pos += num_format(m_pos, v);
+    }
+
+    // RESP bulk string header: $<len>\r\n
+    void add_bulk_header(unsigned long long len) {
+        add("$");
+        add_number(len);
+        add("\r\n");
+    }
+
+    void add_bulk(const char *str, unsigned int len) {
+        add_bulk_header(len);
+        add(str, len);
+        add("\r\n");
+    }
+
+    void add_bulk_number(unsigned long long v) {
+        add_bulk_header(num_format_digits(v));
+        add_number(v);
+        add("\r\n");
+    }
+
+    // returns the length of the command
+    int commit(void) {
+        m_iov.iov_len = m_pos - (char *) m_iov.iov_base;
+
+        int ret = evbuffer_commit_space(m_buf, &m_iov, 1);
+        assert(ret == 0);
+        (void) ret;
+
+        return m_iov.iov_len;
+    }
+};
+
 /////////////////////////////////////////////////////////////////////////
 
 protocol_response::protocol_response()
-    : m_status(NULL), m_value(NULL), m_value_len(0), m_hits(0), m_error(false)
+    : m_status(NULL), m_status_owned(false), m_value(NULL), m_value_len(0), m_hits(0), m_elements(0), m_error(false),
+      m_push(false)
 {
 }
 
@@ -75,11 +187,31 @@ bool protocol_response::is_error(void)
     return m_error;
 }
 
+void protocol_response::set_push(bool push)
+{
+    m_push = push;
+}
+
+bool protocol_response::is_push(void)
+{
+    return m_push;
+}
+
 void protocol_response::set_status(const char* status)
 {
-    if (m_status != NULL)
+    if (m_status != NULL && m_status_owned)
         free((void *)m_status);
     m_status = status;
+    m_status_owned = true;
+}
+
+// same as set_status(), for strings that outlive the response (literals)
+void protocol_response::set_static_status(const char* status)
+{
+    if (m_status != NULL && m_status_owned)
+        free((void *)m_status);
+    m_status = status;
+    m_status_owned = false;
 }
 
 const char* protocol_response::get_status(void)
@@ -110,14 +242,14 @@ unsigned int protocol_response::get_values_count()
     return m_values.size();
 }
 
-void protocol_response::set_latency(unsigned int latency)
+void protocol_response::set_latency(uint64_t latency)
 {
     m_latencies.push_back(latency);
 }
 
-unsigned int protocol_response::get_latency()
+uint64_t protocol_response::get_latency()
 {
-    unsigned int latency = m_latencies.front();
+    uint64_t latency = m_latencies.front();
     m_latencies.pop_front();
     return latency;
 }
@@ -146,6 +278,16 @@ unsigned int protocol_response::get_hits(void)
     return m_hits;
 }
 
+void protocol_response::incr_elements(void)
+{
+    m_elements++;
+}
+
+unsigned int protocol_response::get_elements(void)
+{
+    return m_elements;
+}
+
 static bool deleteValues(key_val_node node) {
     if (node.value != NULL)
         free((void *)node.value);
@@ -157,7 +299,8 @@ static bool deleteValues(key_val_node node) {
 void protocol_response::clear(void)
 {
     if (m_status != NULL) {
-        free((void *)m_status);
+        if (m_status_owned)
+            free((void *)m_status);
         m_status = NULL;
     }
     if (!m_values.empty()) {
@@ -169,19 +312,44 @@ void protocol_response::clear(void)
     m_value_len = 0;
     m_total_len = 0;
     m_hits = 0;
+    m_elements = 0;
     m_error = 0;
+    m_push = false;
 }
 
 /////////////////////////////////////////////////////////////////////////
 
+// deepest array nesting accepted in a reply
+#define REDIS_MAX_NESTING   32
+
 class redis_protocol : public abstract_protocol {
 protected:
-    enum response_state { rs_initial, rs_read_bulk };
+    enum response_state { rs_initial, rs_read_element, rs_read_bulk };
     response_state m_response_state;
+    char m_bulk_type;                   // '$', '=' (verbatim) or '!' (blob error)
     unsigned int m_bulk_len;
     size_t m_response_len;
+
+    // aggregates being read, outermost first
+    struct aggregate {
+        char m_type;                    // '*', '%', '~', '|' (attribute) or '>' (push)
+        unsigned int m_left;            // elements left to read
+    };
+    aggregate m_aggregates[REDIS_MAX_NESTING];
+    unsigned int m_depth;
+
+    // once subscribed, top level arrays (RESP2) and pushes (RESP3) are told
+    // apart by their first element
+    enum pubsub_kind { pk_none, pk_unknown, pk_message, pk_subscription, pk_other };
+    bool m_subscribed;
+    pubsub_kind m_pubsub_kind;
+
+    void classify_pubsub(void);
+    int complete_value(uint64_t latency, bool hit);
+    int fail_response(void);
 public:
-    redis_protocol() : m_response_state(rs_initial), m_bulk_len(0), m_response_len(0) { }
+    redis_protocol() : m_response_state(rs_initial), m_bulk_type('$'), m_bulk_len(0), m_response_len(0), m_depth(0),
+        m_subscribed(false), m_pubsub_kind(pk_none) { }
     virtual redis_protocol* clone(void) { return new redis_protocol(); }
     virtual int select_db(int db);
     virtual int authenticate(const char *credentials);
@@ -190,7 +358,9 @@ public:
     virtual int write_command_get_key(const char *key, int key_len, unsigned int offset);
     virtual int write_command_multi_get(const keylist *keylist);
     virtual int write_command_wait(unsigned int num_slaves, unsigned int timeout);
-    virtual int parse_response(unsigned int latency);
+    virtual int write_command_subscribe(const char *channel, int channel_len, bool pattern);
+    virtual int write_command_publish(const char *channel, int channel_len, const char *payload, int payload_len);
+    virtual int parse_response(uint64_t latency);
 };
 
 int redis_protocol::select_db(int db)
@@ -224,106 +394,101 @@ int redis_protocol::authenticate(const char *credentials)
     return size;
 }
 
+// RESP command templates, up to the first argument
+static const char redis_cmd_set[] = "*3\r\n$3\r\nSET\r\n";
+static const char redis_cmd_setex[] = "*4\r\n$5\r\nSETEX\r\n";
+static const char redis_cmd_setrange[] = "*4\r\n$8\r\nSETRANGE\r\n";
+static const char redis_cmd_get[] = "*2\r\n$3\r\nGET\r\n";
+static const char redis_cmd_getrange[] = "*4\r\n$8\r\nGETRANGE\r\n";
+static const char redis_cmd_wait[] = "*3\r\n$4\r\nWAIT\r\n";
+static const char redis_cmd_subscribe[] = "*2\r\n$9\r\nSUBSCRIBE\r\n";
+static const char redis_cmd_psubscribe[] = "*2\r\n$10\r\nPSUBSCRIBE\r\n";
+static const char redis_cmd_publish[] = "*3\r\n$7\r\nPUBLISH\r\n";
+
 int redis_protocol::write_command_set(const char *key, int key_len, const char *value, int value_len, int expiry, unsigned int offset)
 {
     assert(key != NULL);
     assert(key_len > 0);
     assert(value != NULL);
     assert(value_len > 0);
-    int size = 0;
-    
+
+    // small values go out with the command, referenced ones follow it
+    bool inline_value = !is_referenced_value(value_len);
+    command_writer cmd(m_write_buf, key_len + COMMAND_MAX_OVERHEAD + (inline_value ? value_len + 2 : 0));
+
     if (!expiry && !offset) {
-        size = evbuffer_add_printf(m_write_buf,
-            "*3\r\n"
-            "$3\r\n"
-            "SET\r\n"
-            "$%u\r\n", key_len);
-        evbuffer_add(m_write_buf, key, key_len);
-        size += key_len;
-        size += evbuffer_add_printf(m_write_buf,
-            "\r\n"
-            "$%u\r\n", value_len);
+        cmd.add(redis_cmd_set);
+        cmd.add_bulk(key, key_len);
     } else if(offset) {
-        char offset_str[30];
-        snprintf(offset_str, sizeof(offset_str)-1, "%u", offset);
-
-        size = evbuffer_add_printf(m_write_buf,
-            "*4\r\n"
-            "$8\r\n"
-            "SETRANGE\r\n"
-            "$%u\r\n", key_len);
-        evbuffer_add(m_write_buf, key, key_len);
-        size += key_len;
-        size += evbuffer_add_printf(m_write_buf,
-            "\r\n"
-            "$%u\r\n"
-            "%s\r\n"
-            "$%u\r\n", (unsigned int) strlen(offset_str), offset_str, value_len);
+        cmd.add(redis_cmd_setrange);
+        cmd.add_bulk(key, key_len);
+        cmd.add_bulk_number(offset);
     } else {
-        char expiry_str[30];
-        snprintf(expiry_str, sizeof(expiry_str)-1, "%u", expiry);
-        
-        size = evbuffer_add_printf(m_write_buf,
-            "*4\r\n"
-            "$5\r\n"
-            "SETEX\r\n"
-            "$%u\r\n", key_len);
-        evbuffer_add(m_write_buf, key, key_len);
-        size += key_len;
-        size += evbuffer_add_printf(m_write_buf,
-            "\r\n"
-            "$%u\r\n"
-            "%s\r\n"
-            "$%u\r\n", (unsigned int) strlen(expiry_str), expiry_str, value_len);
+        cmd.add(redis_cmd_setex);
+        cmd.add_bulk(key, key_len);
+        cmd.add_bulk_number(expiry);
+    }
+    cmd.add_bulk_header(value_len);
+
+    if (inline_value) {
+        cmd.add(value, value_len);
+        cmd.add("\r\n");
+        return cmd.commit();
     }
-    evbuffer_add(m_write_buf, value, value_len);
+
+    int size = cmd.commit();
+    write_value(value, value_len);
     evbuffer_add(m_write_buf, "\r\n", 2);
-    size += value_len + 2;
 
-    return size;
+    return size + value_len + 2;
 }
 
 int redis_protocol::write_command_multi_get(const keylist *keylist)
 {
-    fprintf(stderr, "error: multi get not implemented for redis yet!\n");
-    assert(0);
+    assert(keylist != NULL);
+    assert(keylist->get_keys_count() > 0);
+
+    size_t len = COMMAND_MAX_OVERHEAD;
+    for (unsigned int i = 0; i < keylist->get_keys_count(); i++) {
+        unsigned int key_len;
+        keylist->get_key(i, &key_len);
+        len += key_len + NUM_FORMAT_MAX_DIGITS + 5;
+    }
+
+    command_writer cmd(m_write_buf, len);
+    cmd.add("*");
+    cmd.add_number(keylist->get_keys_count() + 1);
+    cmd.add("\r\n$4\r\nMGET\r\n");
+    for (unsigned int i = 0; i < keylist->get_keys_count(); i++) {
+        const char *key;
+        unsigned int key_len;
+
+        key = keylist->get_key(i, &key_len);
+        assert(key != NULL);
+
+        cmd.add_bulk(key, key_len);
+    }
+
+    return cmd.commit();
 }
 
 int redis_protocol::write_command_get(const char *key, int key_len, unsigned int offset)
 {
     assert(key != NULL);
     assert(key_len > 0);
-    int size = 0;
-    
+
+    command_writer cmd(m_write_buf, key_len + COMMAND_MAX_OVERHEAD);
     if (!offset) {
-        size = evbuffer_add_printf(m_write_buf,
-            "*2\r\n"
-            "$3\r\n"
-            "GET\r\n"
-            "$%u\r\n", key_len);
-        evbuffer_add(m_write_buf, key, key_len);
-        evbuffer_add(m_write_buf, "\r\n", 2);        
-        size += key_len + 2;
+        cmd.add(redis_cmd_get);
+        cmd.add_bulk(key, key_len);
     } else {
-        char offset_str[30];
-        snprintf(offset_str, sizeof(offset_str)-1, "%u", offset);
-
-        size = evbuffer_add_printf(m_write_buf,
-            "*4\r\n"
-            "$8\r\n"
-            "GETRANGE\r\n"
-            "$%u\r\n", key_len);
-        evbuffer_add(m_write_buf, key, key_len);
-        size += key_len;
-        size += evbuffer_add_printf(m_write_buf,
-            "\r\n"
-            "$%u\r\n"
-            "%s\r\n"
-            "$2\r\n"
-            "-1\r\n", (unsigned int) strlen(offset_str), offset_str);        
+        cmd.add(redis_cmd_getrange);
+        cmd.add_bulk(key, key_len);
+        cmd.add_bulk_number(offset);
+        cmd.add("$2\r\n-1\r\n");
     }
 
-    return size;
+    return cmd.commit();
 }
 
 int redis_protocol::write_command_get_key(const char *key, int key_len, unsigned int offset)
@@ -332,91 +497,355 @@ int redis_protocol::write_command_get_key(const char *key, int key_len, unsigned
 	assert(0);
 }
 
+int redis_protocol::write_command_wait(unsigned int num_slaves, unsigned int timeout)
+{
+    command_writer cmd(m_write_buf, COMMAND_MAX_OVERHEAD);
+
+    cmd.add(redis_cmd_wait);
+    cmd.add_bulk_number(num_slaves);
+    cmd.add_bulk_number(timeout);
+
+    return cmd.commit();
+}
+
+int redis_protocol::write_command_subscribe(const char *channel, int channel_len, bool pattern)
+{
+    assert(channel != NULL);
+    assert(channel_len > 0);
+
+    command_writer cmd(m_write_buf, channel_len + COMMAND_MAX_OVERHEAD);
+    if (pattern)
+        cmd.add(redis_cmd_psubscribe);
+    else
+        cmd.add(redis_cmd_subscribe);
+    cmd.add_bulk(channel, channel_len);
+
+    m_subscribed = true;
+    return cmd.commit();
+}
+
+int redis_protocol::write_command_publish(const char *channel, int channel_len, const char *payload, int payload_len)
+{
+    assert(channel != NULL);
+    assert(channel_len > 0);
+    assert(payload != NULL);
+
+    command_writer cmd(m_write_buf, channel_len + payload_len + COMMAND_MAX_OVERHEAD);
+    cmd.add(redis_cmd_publish);
+    cmd.add_bulk(channel, channel_len);
+    cmd.add_bulk(payload, payload_len);
+
+    return cmd.commit();
+}
+
 /*
- * Utility function to get the number of digits in a number
+ * Parses a decimal integer (RESP lengths, memcache numbers): an optional '-'
+ * followed by digits, up to end.  Returns false if anything else is found.
  */
-static int get_number_length(unsigned int num)
+static bool parse_integer(const char *p, const char *end, long long *value)
 {
-    if (num < 10) return 1;
-    if (num < 100) return 2;
-    if (num < 1000) return 3;
-    if (num < 10000) return 4;
-    if (num < 100000) return 5;
-    if (num < 1000000) return 6;
-    if (num < 10000000) return 7;
-    if (num < 100000000) return 8;
-    if (num < 1000000000) return 9;
-    return 10;
+    bool negative = false;
+    long long v = 0;
+
+    if (p < end && *p == '-') {
+        negative = true;
+        p++;
+    }
+    if (p == end)
+        return false;
+
+    for (; p < end; p++) {
+        unsigned int digit = (unsigned char) *p - '0';
+        if (digit > 9)
+            return false;
+        v = v * 10 + digit;
+    }
+
+    *value = negative ? -v : v;
+    return true;
 }
 
-int redis_protocol::write_command_wait(unsigned int num_slaves, unsigned int timeout)
+/*
+ * Called when a value has been read.  Outside of an aggregate that is the
+ * whole reply; inside, the value completes an element, which may in turn
+ * complete its aggregate and so on up.  Every element of the outermost
+ * aggregate is accounted as a key of its own (as with MGET), with its own
+ * latency.
+ *
+ * RESP3 attributes annotate the value that follows them, and push
+ * messages are not replies at all, so neither completes anything.
+ */
+int redis_protocol::complete_value(uint64_t latency, bool hit)
 {
-    int size = 0;
-    size = evbuffer_add_printf(m_write_buf,
-                               "*3\r\n"
-                               "$4\r\n"
-                               "WAIT\r\n"
-                               "$%u\r\n"
-                               "%u\r\n"
-                               "$%u\r\n"
-                               "%u\r\n",
-                               get_number_length(num_slaves), num_slaves,
-                               get_number_length(timeout), timeout);
-    return size;
+    m_last_response.set_total_len(m_response_len);
+
+    // the first element of a top level aggregate was not a bulk string
+    if (m_pubsub_kind == pk_unknown && m_depth == 1)
+        m_pubsub_kind = pk_other;
+
+    if (m_depth == 0) {
+        if (hit)
+            m_last_response.incr_hits();
+        m_last_response.set_latency(latency);
+        m_response_state = rs_initial;
+        return 1;
+    }
+
+    while (m_depth > 0) {
+        aggregate *a = &m_aggregates[m_depth - 1];
+
+        if (m_depth == 1 && a->m_type != '|' && a->m_type != '>') {
+            // only keys, i.e. outermost elements, can be hits
+            if (hit)
+                m_last_response.incr_hits();
+            m_last_response.set_latency(latency);
+        }
+        hit = false;
+
+        if (--a->m_left > 0) {
+            m_response_state = rs_read_element;
+            return 0;
+        }
+        m_depth--;
+
+        if (a->m_type == '|') {
+            m_response_state = rs_read_element;
+            return 0;
+        }
+        if (m_depth == 0 && m_pubsub_kind == pk_message) {
+            m_last_response.set_static_status(a->m_type == '>' ? ">" : "*");
+            m_last_response.set_push(true);
+        } else if (a->m_type == '>') {
+            // with RESP3, (un)subscribing is confirmed by a push, which is
+            // the reply to the command; any other push is not a reply
+            if (m_pubsub_kind != pk_subscription) {
+                m_response_state = rs_initial;
+                return 0;
+            }
+            m_last_response.set_static_status(">");
+        }
+    }
+
+    m_response_state = rs_initial;
+    return 1;
 }
 
-int redis_protocol::parse_response(unsigned int latency)
+// tells a message from a (un)subscription confirmation, by its first
+// element, which is about to be read from m_read_buf
+void redis_protocol::classify_pubsub(void)
 {
-    char *line;
+    static const char *messages[] = { "message", "pmessage", "smessage", NULL };
+    static const char *subscriptions[] = { "subscribe", "psubscribe", "ssubscribe",
+        "unsubscribe", "punsubscribe", "sunsubscribe", NULL };
+
+    m_pubsub_kind = pk_other;
+    if (m_bulk_len > 12)
+        return;
+
+    char kind[12];
+    evbuffer_copyout(m_read_buf, kind, m_bulk_len);
+    for (unsigned int i = 0; messages[i] != NULL; i++) {
+        if (strlen(messages[i]) == m_bulk_len && memcmp(kind, messages[i], m_bulk_len) == 0) {
+            m_pubsub_kind = pk_message;
+            return;
+        }
+    }
+    for (unsigned int i = 0; subscriptions[i] != NULL; i++) {
+        if (strlen(subscriptions[i]) == m_bulk_len && memcmp(kind, subscriptions[i], m_bulk_len) == 0) {
+            m_pubsub_kind = pk_subscription;
+            return;
+        }
+    }
+}
 
+// drops the state of a reply that cannot be parsed
+int redis_protocol::fail_response(void)
+{
+    m_depth = 0;
+    m_response_state = rs_initial;
+    return -1;
+}
+
+// status of a reply that is not an error, by its first line
+static const char *redis_reply_status(const char *line, size_t line_len, long long len)
+{
+    switch (line[0]) {
+        case '+':
+            if (line_len == 3 && line[1] == 'O' && line[2] == 'K')
+                return "+OK";
+            return "+";
+        case '$':
+            return len == -1 ? "$-1" : "$";
+        case '*':
+            return len == -1 ? "*-1" : "*";
+        case ':': return ":";
+        case '_': return "_";
+        case ',': return ",";
+        case '#': return "#";
+        case '(': return "(";
+        case '=': return "=";
+        case '%': return "%";
+        case '~': return "~";
+        default:
+            return NULL;
+    }
+}
+
+/*
+ * RESP2 and RESP3 reply parser.  Replies are read as they arrive, and an
+ * aggregate is never buffered as a whole: the parser only keeps the number
+ * of elements left at every nesting level, so a reply of any size or depth
+ * may be split across any number of reads.
+ */
+int redis_protocol::parse_response(uint64_t latency)
+{
     while (true) {
         switch (m_response_state) {
-            case rs_initial:                
-                line = evbuffer_readln(m_read_buf, &m_response_len, EVBUFFER_EOL_CRLF_STRICT);
-                if (line == NULL)
+            case rs_initial:
+            case rs_read_element:
+            {
+                // the line is looked at in place; pullup only has to copy
+                // when it happens to span two buffer segments
+                struct evbuffer_ptr eol = evbuffer_search_eol(m_read_buf, NULL, NULL, EVBUFFER_EOL_CRLF_STRICT);
+                if (eol.pos < 0)
                     return 0;   // maybe we didn't get it yet?
-                m_response_len += 2;    // count CRLF
-        
-                // todo: support multi-bulk reply
-                if (line[0] == '*') {
-                    benchmark_debug_log("multi-bulk replies not currently supported.\n");
-                    free(line);
-                    return -1;
+
+                size_t line_len = eol.pos;
+                const char *line = (const char *) evbuffer_pullup(m_read_buf, line_len + 2);
+                assert(line != NULL);
+
+                if (m_response_state == rs_initial) {
+                    // clear last response
+                    m_last_response.clear();
+                    m_response_len = 0;
+                    m_pubsub_kind = pk_none;
+                } else if (m_depth > 0) {
+                    m_last_response.incr_elements();
                 }
+                m_response_len += line_len + 2;    // count CRLF
+
+                char type = line_len > 0 ? line[0] : '\0';
+                switch (type) {
+                    case '$':   // bulk string
+                    case '=':   // verbatim string
+                    case '!':   // blob error
+                    case '*':   // array
+                    case '%':   // map
+                    case '~':   // set
+                    case '|':   // attribute
+                    case '>':   // push
+                    {
+                        long long len;
+                        if (!parse_integer(line + 1, line + line_len, &len) || len < -1 ||
+                            (len == -1 && type != '$' && type != '*')) {
+                            benchmark_debug_log("invalid length: '%.*s'.\n", (int) line_len, line);
+                            evbuffer_drain(m_read_buf, line_len + 2);
+                            return fail_response();
+                        }
 
-                // clear last response
-                m_last_response.clear();
-                m_last_response.set_latency(latency);
+                        // pushes only stand on their own between replies
+                        if (type == '>' && (m_depth > 0 || m_response_state != rs_initial))
+                            type = '*';
+
+                        if (m_depth == 0 && type != '|' && type != '>' && type != '!')
+                            m_last_response.set_static_status(redis_reply_status(line, line_len, len));
+                        evbuffer_drain(m_read_buf, line_len + 2);
+
+                        if (type == '$' || type == '=' || type == '!') {
+                            if (len == -1)
+                                break;
+                            m_bulk_type = type;
+                            m_bulk_len = (unsigned int) len;
+                            m_response_state = rs_read_bulk;
+                            continue;
+                        }
 
-                // bulk?
-                if (line[0] == '$') {
-                    int len = strtol(line + 1, NULL, 10);
-                    if (len == -1) {
-                        m_last_response.set_status(line);
-                        return 1;
-                    }
+                        // maps and attributes hold key and value elements
+                        if (type == '%' || type == '|')
+                            len *= 2;
+
+                        if (len <= 0) {
+                            if (type == '|') {
+                                m_response_state = rs_read_element;
+                                continue;
+                            } else if (type == '>') {
+                                m_response_state = rs_initial;
+                                continue;
+                            }
+                            break;
+                        }
 
-                    m_bulk_len = (unsigned int) len;
-                    m_response_state = rs_read_bulk;
-                    m_last_response.set_status(line);
-                    continue;
-                } else if (line[0] == '+' || line[0] == '-' || line[0] == ':') {
-                    m_last_response.set_status(line);
-                    m_last_response.set_total_len(m_response_len);
-                    if (line[0] == '-')
-                        m_last_response.set_error(true);
-                    return 1;
-                } else {
-                    benchmark_debug_log("unsupported response: '%s'.\n", line);
-                    free(line);
-                    return -1;
+                        if (m_depth == REDIS_MAX_NESTING) {
+                            benchmark_debug_log("reply nested deeper than %u aggregates.\n", REDIS_MAX_NESTING);
+                            return fail_response();
+                        }
+                        if (m_depth == 0 && m_subscribed && (type == '*' || type == '>'))
+                            m_pubsub_kind = pk_unknown;
+                        m_aggregates[m_depth].m_type = type;
+                        m_aggregates[m_depth].m_left = (unsigned int) len;
+                        m_depth++;
+                        m_response_state = rs_read_element;
+                        continue;
+                    }
+                    case '-':
+                        // errors are rare and get reported, so keep the text;
+                        // inside an aggregate (e.g. EXEC) they are just elements
+                        if (m_depth == 0) {
+                            char *status = (char *) malloc(line_len + 1);
+                            assert(status != NULL);
+                            memcpy(status, line, line_len);
+                            status[line_len] = '\0';
+
+                            m_last_response.set_status(status);
+                            m_last_response.set_error(true);
+                        }
+                        evbuffer_drain(m_read_buf, line_len + 2);
+                        break;
+                    case '+':   // simple string
+                    case ':':   // integer
+                    case '_':   // null
+                    case ',':   // double
+                    case '#':   // boolean
+                    case '(':   // big number
+                        if (m_depth == 0)
+                            m_last_response.set_static_status(redis_reply_status(line, line_len, 0));
+                        evbuffer_drain(m_read_buf, line_len + 2);
+                        break;
+                    default:
+                        benchmark_debug_log("unsupported response: '%.*s'.\n", (int) line_len, line);
+                        evbuffer_drain(m_read_buf, line_len + 2);
+                        return fail_response();
                 }
 
-                break;
+                int ret = complete_value(latency, false);
+                if (ret)
+                    return ret;
+                continue;
+            }
             case rs_read_bulk:
                 if (evbuffer_get_length(m_read_buf) >= m_bulk_len + 2) {
-                    if (m_keep_value && m_bulk_len > 0) {
-                        char *bulk_value = (char *) malloc(m_bulk_len);
+                    if (m_pubsub_kind == pk_unknown && m_depth == 1)
+                        classify_pubsub();
+
+                    if (m_bulk_type == '!' && m_depth == 0) {
+                        // a blob error is reported like a simple one
+                        char *status = (char *) malloc(m_bulk_len + 2);
+                        assert(status != NULL);
+
+                        status[0] = '-';
+                        int ret = evbuffer_remove(m_read_buf, status + 1, m_bulk_len);
+                        assert(ret != -1);
+                        status[m_bulk_len + 1] = '\0';
+
+                        ret = evbuffer_drain(m_read_buf, 2);
+                        assert(ret != -1);
+
+                        m_last_response.set_status(status);
+                        m_last_response.set_error(true);
+                    } else if ((m_keep_value && m_bulk_len > 0) ||
+                               (m_pubsub_kind == pk_message && m_depth == 1 && m_aggregates[0].m_left == 1)) {
+                        // a message's payload is its last element
+                        char *bulk_value = (char *) malloc(m_bulk_len + 1);
                         assert(bulk_value != NULL);
                             
                         int ret = evbuffer_remove(m_read_buf, bulk_value, m_bulk_len);
@@ -432,11 +861,11 @@ int redis_protocol::parse_response(unsigned int latency)
                         assert(ret != -1);
                     }
 
-                    m_response_state = rs_initial;
-                    m_last_response.set_total_len(m_response_len + m_bulk_len + 2);
-                    if (m_bulk_len > 0)
-                        m_last_response.incr_hits();
-                    return 1;
+                    m_response_len += m_bulk_len + 2;
+                    int ret = complete_value(latency, m_bulk_type != '!' && m_bulk_len > 0);
+                    if (ret)
+                        return ret;
+                    continue;
                 } else {
                     return 0;
                 }
@@ -451,14 +880,66 @@ int redis_protocol::parse_response(unsigned int latency)
 
 /////////////////////////////////////////////////////////////////////////
 
+/*
+ * Redis using RESP3.  Commands are the same as with RESP2; the connection
+ * is switched over with HELLO 3, which also carries the credentials so
+ * authentication takes no extra round trip.  The reply parser handles
+ * both versions.
+ */
+class redis3_protocol : public redis_protocol {
+public:
+    redis3_protocol() { }
+    virtual redis3_protocol* clone(void) { return new redis3_protocol(); }
+    virtual int write_command_handshake(const char *credentials);
+};
+
+int redis3_protocol::write_command_handshake(const char *credentials)
+{
+    if (credentials == NULL)
+        return evbuffer_add_printf(m_write_buf, "*2\r\n$5\r\nHELLO\r\n$1\r\n3\r\n");
+
+    // USER:PASSWORD, or just a password for the default user
+    const char *user = "default";
+    unsigned int user_len = 7;
+    const char *password = strchr(credentials, ':');
+    if (password != NULL) {
+        user = credentials;
+        user_len = password - credentials;
+        password++;
+    } else {
+        password = credentials;
+    }
+
+    return evbuffer_add_printf(m_write_buf,
+        "*5\r\n"
+        "$5\r\n"
+        "HELLO\r\n"
+        "$1\r\n"
+        "3\r\n"
+        "$4\r\n"
+        "AUTH\r\n"
+        "$%u\r\n"
+        "%.*s\r\n"
+        "$%u\r\n"
+        "%s\r\n",
+        user_len, (int) user_len, user,
+        (unsigned int) strlen(password), password);
+}
+
+/////////////////////////////////////////////////////////////////////////
+
 class memcache_text_protocol : public abstract_protocol {
 protected:
     enum response_state { rs_initial, rs_read_section, rs_read_value, rs_read_end };
     response_state m_response_state;
     unsigned int m_value_len;
     size_t m_response_len;
+    char *m_value_key;                  // key of the value being read, only if m_keep_value
+    unsigned int m_value_key_len;
 public:
-    memcache_text_protocol() : m_response_state(rs_initial), m_value_len(0), m_response_len(0) { }
+    memcache_text_protocol() : m_response_state(rs_initial), m_value_len(0), m_response_len(0),
+        m_value_key(NULL), m_value_key_len(0) { }
+    virtual ~memcache_text_protocol() { free(m_value_key); }
     virtual memcache_text_protocol* clone(void) { return new memcache_text_protocol(); }
     virtual int select_db(int db);
     virtual int authenticate(const char *credentials);
@@ -467,7 +948,7 @@ public:
     virtual int write_command_get_key(const char *key, int key_len, unsigned int offset);
     virtual int write_command_multi_get(const keylist *keylist);
     virtual int write_command_wait(unsigned int num_slaves, unsigned int timeout);
-    virtual int parse_response(unsigned int latency);
+    virtual int parse_response(uint64_t latency);
 };
 
 int memcache_text_protocol::select_db(int db)
@@ -486,26 +967,43 @@ int memcache_text_protocol::write_command_set(const char *key, int key_len, cons
     assert(key_len > 0);
     assert(value != NULL);
     assert(value_len > 0);
-    int size = 0;
-    
-    size = evbuffer_add_printf(m_write_buf,
-        "set %.*s 0 %u %u\r\n", key_len, key, expiry, value_len);
-    evbuffer_add(m_write_buf, value, value_len);
+
+    // small values go out with the command, referenced ones follow it
+    bool inline_value = !is_referenced_value(value_len);
+    command_writer cmd(m_write_buf, key_len + COMMAND_MAX_OVERHEAD + (inline_value ? value_len + 2 : 0));
+
+    cmd.add("set ");
+    cmd.add(key, key_len);
+    cmd.add(" 0 ");
+    cmd.add_number(expiry);
+    cmd.add(" ");
+    cmd.add_number(value_len);
+    cmd.add("\r\n");
+
+    if (inline_value) {
+        cmd.add(value, value_len);
+        cmd.add("\r\n");
+        return cmd.commit();
+    }
+
+    int size = cmd.commit();
+    write_value(value, value_len);
     evbuffer_add(m_write_buf, "\r\n", 2);
-    size += value_len + 2;
 
-    return size;
+    return size + value_len + 2;
 }
 
 int memcache_text_protocol::write_command_get(const char *key, int key_len, unsigned int offset)
 {
     assert(key != NULL);
     assert(key_len > 0);
-    int size = 0;
 
-    size = evbuffer_add_printf(m_write_buf,
-        "get %.*s\r\n", key_len, key);
-    return size;
+    command_writer cmd(m_write_buf, key_len + COMMAND_MAX_OVERHEAD);
+    cmd.add("get ");
+    cmd.add(key, key_len);
+    cmd.add("\r\n");
+
+    return cmd.commit();
 }
 
 int memcache_text_protocol::write_command_get_key(const char *key, int key_len, unsigned int offset)
@@ -519,34 +1017,28 @@ int memcache_text_protocol::write_command_multi_get(const keylist *keylist)
     assert(keylist != NULL);
     assert(keylist->get_keys_count() > 0);
 
-    int n = 0;
-    int size = 0;
+    size_t len = 3 + 2;
+    for (unsigned int i = 0; i < keylist->get_keys_count(); i++) {
+        unsigned int key_len;
+        keylist->get_key(i, &key_len);
+        len += 1 + key_len;
+    }
 
-    n = evbuffer_add(m_write_buf, "get", 3);
-    assert(n != -1);
-    size = 3;
-    
+    command_writer cmd(m_write_buf, len);
+    cmd.add("get");
     for (unsigned int i = 0; i < keylist->get_keys_count(); i++) {
         const char *key;
         unsigned int key_len;
-        
-        n = evbuffer_add(m_write_buf, " ", 1);
-        assert(n != -1);
-        size++;
 
         key = keylist->get_key(i, &key_len);
         assert(key != NULL);
-        
-        n = evbuffer_add(m_write_buf, key, key_len);
-        assert(n != -1);
-        size += key_len;
-    }
 
-    n = evbuffer_add(m_write_buf, "\r\n", 2);
-    assert(n != -1);
-    size += 2;
+        cmd.add(" ");
+        cmd.add(key, key_len);
+    }
+    cmd.add("\r\n");
 
-    return size;
+    return cmd.commit();
 }
 
 int memcache_text_protocol::write_command_wait(unsigned int num_slaves, unsigned int timeout)
@@ -555,11 +1047,57 @@ int memcache_text_protocol::write_command_wait(unsigned int num_slaves, unsigned
     assert(0);
 }
 
-int memcache_text_protocol::parse_response(unsigned int latency)
+#define MEMCACHE_TEXT_MAX_TOKENS    6
+
+struct memcache_text_token {
+    const char *m_str;
+    unsigned int m_len;
+
+    bool is(const char *word, unsigned int len) const {
+        return m_len == len && memcmp(m_str, word, len) == 0;
+    }
+};
+
+// splits a response line on spaces, in place; returns the number of tokens,
+// or MEMCACHE_TEXT_MAX_TOKENS + 1 if there are more.
+static unsigned int memcache_text_tokenize(const char *line, size_t len, memcache_text_token *tokens)
+{
+    const char *end = line + len;
+    unsigned int count = 0;
+
+    while (line < end) {
+        if (*line == ' ') {
+            line++;
+            continue;
+        }
+        if (count == MEMCACHE_TEXT_MAX_TOKENS)
+            return count + 1;
+
+        const char *start = line;
+        while (line < end && *line != ' ')
+            line++;
+        tokens[count].m_str = start;
+        tokens[count].m_len = line - start;
+        count++;
+    }
+
+    return count;
+}
+
+static bool memcache_text_number(const memcache_text_token& token, unsigned long long max, unsigned long long *value)
+{
+    long long v;
+
+    if (token.m_len == 0 || token.m_str[0] == '-' ||
+        !parse_integer(token.m_str, token.m_str + token.m_len, &v) || (unsigned long long) v > max)
+        return false;
+
+    *value = v;
+    return true;
+}
+
+int memcache_text_protocol::parse_response(uint64_t latency)
 {
-    char *line;
-    size_t tmplen;
-    
     while (true) {
         switch (m_response_state) {
             case rs_initial:
@@ -569,45 +1107,79 @@ int memcache_text_protocol::parse_response(unsigned int latency)
                 break;                
                 
             case rs_read_section:
-                line = evbuffer_readln(m_read_buf, &tmplen, EVBUFFER_EOL_CRLF_STRICT);
-                if (!line)
+            {
+                struct evbuffer_ptr eol = evbuffer_search_eol(m_read_buf, NULL, NULL, EVBUFFER_EOL_CRLF_STRICT);
+                if (eol.pos < 0)
                     return 0;
 
-                m_response_len += tmplen + 2;   // For CRLF
-                if (m_last_response.get_status() == NULL) {
-                    m_last_response.set_status(line);
-                }
+                size_t line_len = eol.pos;
+                const char *line = (const char *) evbuffer_pullup(m_read_buf, line_len + 2);
+                assert(line != NULL);
+
+                m_response_len += line_len + 2;   // For CRLF
                 m_last_response.set_total_len((unsigned int) m_response_len);   // for now...                    
-                
-                if (memcmp(line, "VALUE", 5) == 0) {
-                    char prefix[50];
-                    char key[256];
-                    unsigned int flags;
-                    unsigned int cas;
-
-                    int res = sscanf(line, "%s %s %u %u %u", prefix, key, &flags, &m_value_len, &cas);
-                    if (res < 4|| res > 5) {
-                        benchmark_debug_log("unexpected VALUE response: %s\n", line);
-                        if (m_last_response.get_status() != line)
-                            free(line);
+
+                memcache_text_token tokens[MEMCACHE_TEXT_MAX_TOKENS];
+                unsigned int count = memcache_text_tokenize(line, line_len, tokens);
+
+                if (count > 0 && tokens[0].is("VALUE", 5)) {
+                    // VALUE <key> <flags> <bytes> [<cas unique>]
+                    unsigned long long flags, bytes, cas;
+                    if (count < 4 || count > 5 ||
+                        !memcache_text_number(tokens[2], 0xffffffffULL, &flags) ||
+                        !memcache_text_number(tokens[3], 0xffffffffULL - 2, &bytes) ||
+                        (count == 5 && !memcache_text_number(tokens[4], ~0ULL, &cas))) {
+                        benchmark_debug_log("unexpected VALUE response: %.*s\n", (int) line_len, line);
+                        evbuffer_drain(m_read_buf, line_len + 2);
                         return -1;
                     }
 
+                    if (m_keep_value) {
+                        free(m_value_key);
+                        m_value_key_len = tokens[1].m_len;
+                        m_value_key = (char *) malloc(m_value_key_len);
+                        assert(m_value_key != NULL);
+                        memcpy(m_value_key, tokens[1].m_str, m_value_key_len);
+                    }
+
+                    if (m_last_response.get_status() == NULL)
+                        m_last_response.set_static_status("VALUE");
+                    m_value_len = (unsigned int) bytes;
+                    evbuffer_drain(m_read_buf, line_len + 2);
+
                     m_last_response.set_latency(latency);
                     m_response_state = rs_read_value;
                     continue;
-                } else if (memcmp(line, "END", 3) == 0 ||
-                           memcmp(line, "STORED", 6) == 0) {
-                    if (m_last_response.get_status() != line)
-                        free(line);
-                    m_response_state = rs_read_end;
+                } else if (count == 1 && tokens[0].is("END", 3)) {
+                    if (m_last_response.get_status() == NULL)
+                        m_last_response.set_static_status("END");
+                } else if (count == 1 && tokens[0].is("STORED", 6)) {
+                    m_last_response.set_static_status("STORED");
+                } else if (count == 1 && tokens[0].is("NOT_STORED", 10)) {
+                    m_last_response.set_static_status("NOT_STORED");
+                } else if (count > 0 && (tokens[0].is("ERROR", 5) ||
+                                         tokens[0].is("CLIENT_ERROR", 12) ||
+                                         tokens[0].is("SERVER_ERROR", 12))) {
+                    // errors are rare and get reported, so keep the text
+                    char *status = (char *) malloc(line_len + 1);
+                    assert(status != NULL);
+                    memcpy(status, line, line_len);
+                    status[line_len] = '\0';
+
+                    m_last_response.set_status(status);
+                    m_last_response.set_error(true);
                 } else {
                     m_last_response.set_error(true);
-                    benchmark_debug_log("unknown response: %s\n", line);
+                    benchmark_debug_log("unknown response: %.*s\n", (int) line_len, line);
+                    evbuffer_drain(m_read_buf, line_len + 2);
                     return -1;
                 }
+
+                evbuffer_drain(m_read_buf, line_len + 2);
                 m_last_response.set_latency(latency);
+                m_response_state = rs_read_end;
                 break;
+            }
                 
             case rs_read_value:                
                 if (evbuffer_get_length(m_read_buf) >= m_value_len + 2) {
@@ -616,9 +1188,11 @@ int memcache_text_protocol::parse_response(unsigned int latency)
                         assert(value != NULL);
                             
                         int ret = evbuffer_remove(m_read_buf, value, m_value_len);
-                        assert((unsigned int) ret == 0);
+                        assert((unsigned int) ret == m_value_len);
 
-                        m_last_response.set_value(value, m_value_len, NULL, 0);
+                        m_last_response.set_value(value, m_value_len, m_value_key, m_value_key_len);
+                        m_value_key = NULL;
+                        m_value_key_len = 0;
                     } else {
                         int ret = evbuffer_drain(m_read_buf, m_value_len);
                         assert((unsigned int) ret == 0);
@@ -649,6 +1223,373 @@ int memcache_text_protocol::parse_response(unsigned int latency)
 
 /////////////////////////////////////////////////////////////////////////
 
+/*
+ * Memcached meta protocol.  Every command is sent in quiet mode, with the
+ * request sequence number as its opaque token: the server stays silent on
+ * mg misses and successful ms, and a batch of requests is terminated with
+ * an mn no-op.  A request is known to be done once a reply for a later
+ * request arrives, or the MN of its batch; a request that got no reply of
+ * its own is then returned with no hits.
+ *
+ * Error lines carry no opaque token; they are attributed to the oldest
+ * outstanding request.
+ */
+class memcache_meta_protocol : public abstract_protocol {
+protected:
+    enum response_state { rs_initial, rs_read_value };
+    response_state m_response_state;
+    unsigned int m_value_len;
+    size_t m_response_len;
+    char *m_value_key;                  // key of the value being read, only if m_keep_value
+    unsigned int m_value_key_len;
+
+    unsigned int m_next_opaque;         // opaque of the next request written
+    unsigned int m_front_opaque;        // opaque of the oldest outstanding request
+    unsigned int m_done_before;         // requests before this opaque are done
+    unsigned int m_batch_start;         // first request not followed by an mn yet
+    std::deque<unsigned int> m_batch_ends;  // for every mn sent, the opaque following it
+    bool m_response_started;
+
+    static bool opaque_before(unsigned int a, unsigned int b) { return (int) (a - b) < 0; }
+    void start_response(void);
+    void finish_response(uint64_t latency);
+    bool parse_opaque(const memcache_text_token *tokens, unsigned int count, unsigned int *opaque);
+public:
+    memcache_meta_protocol() : m_response_state(rs_initial), m_value_len(0), m_response_len(0),
+        m_value_key(NULL), m_value_key_len(0),
+        m_next_opaque(0), m_front_opaque(0), m_done_before(0), m_batch_start(0),
+        m_response_started(false) { }
+    virtual ~memcache_meta_protocol() { free(m_value_key); }
+    virtual memcache_meta_protocol* clone(void) { return new memcache_meta_protocol(); }
+    virtual int select_db(int db);
+    virtual int authenticate(const char *credentials);
+    virtual int write_command_set(const char *key, int key_len, const char *value, int value_len, int expiry, unsigned int offset);
+    virtual int write_command_get(const char *key, int key_len, unsigned int offset);
+    virtual int write_command_get_key(const char *key, int key_len, unsigned int offset);
+    virtual int write_command_multi_get(const keylist *keylist);
+    virtual int write_command_wait(unsigned int num_slaves, unsigned int timeout);
+    virtual void write_batch_end(void);
+    virtual int parse_response(uint64_t latency);
+};
+
+int memcache_meta_protocol::select_db(int db)
+{
+    assert(0);
+}
+
+int memcache_meta_protocol::authenticate(const char *credentials)
+{
+    assert(0);
+}
+
+int memcache_meta_protocol::write_command_set(const char *key, int key_len, const char *value, int value_len, int expiry, unsigned int offset)
+{
+    assert(key != NULL);
+    assert(key_len > 0);
+    assert(value != NULL);
+    assert(value_len > 0);
+
+    // small values go out with the command, referenced ones follow it
+    bool inline_value = !is_referenced_value(value_len);
+    command_writer cmd(m_write_buf, key_len + COMMAND_MAX_OVERHEAD + (inline_value ? value_len + 2 : 0));
+
+    // ms <key> <datalen> [T<ttl>] O<opaque> q
+    cmd.add("ms ");
+    cmd.add(key, key_len);
+    cmd.add(" ");
+    cmd.add_number(value_len);
+    if (expiry) {
+        cmd.add(" T");
+        cmd.add_number(expiry);
+    }
+    cmd.add(" O");
+    cmd.add_number(m_next_opaque++);
+    cmd.add(" q\r\n");
+
+    if (inline_value) {
+        cmd.add(value, value_len);
+        cmd.add("\r\n");
+        return cmd.commit();
+    }
+
+    int size = cmd.commit();
+    write_value(value, value_len);
+    evbuffer_add(m_write_buf, "\r\n", 2);
+
+    return size + value_len + 2;
+}
+
+int memcache_meta_protocol::write_command_get(const char *key, int key_len, unsigned int offset)
+{
+    assert(key != NULL);
+    assert(key_len > 0);
+
+    // mg <key> v [k] O<opaque> q
+    command_writer cmd(m_write_buf, key_len + COMMAND_MAX_OVERHEAD);
+    cmd.add("mg ");
+    cmd.add(key, key_len);
+    if (m_keep_value)
+        cmd.add(" v k O");
+    else
+        cmd.add(" v O");
+    cmd.add_number(m_next_opaque++);
+    cmd.add(" q\r\n");
+
+    return cmd.commit();
+}
+
+int memcache_meta_protocol::write_command_get_key(const char *key, int key_len, unsigned int offset)
+{
+    // values are only kept (and keys returned with them) when verifying
+    return this->write_command_get(key, key_len, offset);
+}
+
+// one mg per key, all with the opaque of the request
+int memcache_meta_protocol::write_command_multi_get(const keylist *keylist)
+{
+    assert(keylist != NULL);
+    assert(keylist->get_keys_count() > 0);
+
+    unsigned int opaque = m_next_opaque++;
+    size_t len = 0;
+    for (unsigned int i = 0; i < keylist->get_keys_count(); i++) {
+        unsigned int key_len;
+        keylist->get_key(i, &key_len);
+        len += key_len + 20 + NUM_FORMAT_MAX_DIGITS;
+    }
+
+    command_writer cmd(m_write_buf, len);
+    for (unsigned int i = 0; i < keylist->get_keys_count(); i++) {
+        const char *key;
+        unsigned int key_len;
+
+        key = keylist->get_key(i, &key_len);
+        assert(key != NULL);
+
+        cmd.add("mg ");
+        cmd.add(key, key_len);
+        if (m_keep_value)
+            cmd.add(" v k O");
+        else
+            cmd.add(" v O");
+        cmd.add_number(opaque);
+        cmd.add(" q\r\n");
+    }
+
+    return cmd.commit();
+}
+
+int memcache_meta_protocol::write_command_wait(unsigned int num_slaves, unsigned int timeout)
+{
+    fprintf(stderr, "error: WAIT command not implemented for memcache!\n");
+    assert(0);
+}
+
+void memcache_meta_protocol::write_batch_end(void)
+{
+    if (m_batch_start == m_next_opaque)
+        return;
+
+    evbuffer_add(m_write_buf, "mn\r\n", 4);
+    m_batch_ends.push_back(m_next_opaque);
+    m_batch_start = m_next_opaque;
+}
+
+void memcache_meta_protocol::start_response(void)
+{
+    if (m_response_started)
+        return;
+
+    m_last_response.clear();
+    m_response_len = 0;
+    m_response_started = true;
+}
+
+// returns the oldest outstanding request
+void memcache_meta_protocol::finish_response(uint64_t latency)
+{
+    start_response();
+    if (m_last_response.get_status() == NULL)
+        m_last_response.set_static_status("MN");    // no reply of its own
+    m_last_response.set_latency(latency);
+    m_last_response.set_total_len(m_response_len);
+
+    m_front_opaque++;
+    m_response_started = false;
+}
+
+// finds the O<opaque> flag of a reply
+bool memcache_meta_protocol::parse_opaque(const memcache_text_token *tokens, unsigned int count, unsigned int *opaque)
+{
+    for (unsigned int i = 1; i < count; i++) {
+        if (tokens[i].m_len > 1 && tokens[i].m_str[0] == 'O') {
+            memcache_text_token number = { tokens[i].m_str + 1, tokens[i].m_len - 1 };
+            unsigned long long v;
+
+            if (!memcache_text_number(number, 0xffffffffULL, &v))
+                return false;
+            *opaque = (unsigned int) v;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int memcache_meta_protocol::parse_response(uint64_t latency)
+{
+    while (true) {
+        switch (m_response_state) {
+            case rs_initial:
+            {
+                // requests known to be done are returned one at a time
+                if (opaque_before(m_front_opaque, m_done_before)) {
+                    finish_response(latency);
+                    return 1;
+                }
+
+                struct evbuffer_ptr eol = evbuffer_search_eol(m_read_buf, NULL, NULL, EVBUFFER_EOL_CRLF_STRICT);
+                if (eol.pos < 0)
+                    return 0;   // maybe we didn't get it yet?
+
+                size_t line_len = eol.pos;
+                const char *line = (const char *) evbuffer_pullup(m_read_buf, line_len + 2);
+                assert(line != NULL);
+
+                memcache_text_token tokens[MEMCACHE_TEXT_MAX_TOKENS];
+                unsigned int count = memcache_text_tokenize(line, line_len, tokens);
+                unsigned int opaque;
+
+                if (count == 1 && tokens[0].is("MN", 2)) {
+                    if (m_batch_ends.empty()) {
+                        benchmark_debug_log("unexpected MN response.\n");
+                        evbuffer_drain(m_read_buf, line_len + 2);
+                        return -1;
+                    }
+                    m_done_before = m_batch_ends.front();
+                    m_batch_ends.pop_front();
+                    evbuffer_drain(m_read_buf, line_len + 2);
+                    continue;
+                } else if (count > 0 && (tokens[0].is("ERROR", 5) ||
+                                         tokens[0].is("CLIENT_ERROR", 12) ||
+                                         tokens[0].is("SERVER_ERROR", 12))) {
+                    // errors are rare and get reported, so keep the text
+                    char *status = (char *) malloc(line_len + 1);
+                    assert(status != NULL);
+                    memcpy(status, line, line_len);
+                    status[line_len] = '\0';
+
+                    start_response();
+                    m_last_response.set_status(status);
+                    m_last_response.set_error(true);
+                    m_response_len += line_len + 2;
+                    evbuffer_drain(m_read_buf, line_len + 2);
+
+                    finish_response(latency);
+                    return 1;
+                } else if (count == 0 || count > MEMCACHE_TEXT_MAX_TOKENS || !parse_opaque(tokens, count, &opaque)) {
+                    benchmark_debug_log("unknown response: %.*s\n", (int) line_len, line);
+                    evbuffer_drain(m_read_buf, line_len + 2);
+                    return -1;
+                }
+
+                // a reply for a later request: the ones before it are done
+                if (opaque != m_front_opaque) {
+                    if (!opaque_before(m_front_opaque, opaque) || !opaque_before(opaque, m_next_opaque)) {
+                        benchmark_debug_log("unexpected opaque: %.*s\n", (int) line_len, line);
+                        evbuffer_drain(m_read_buf, line_len + 2);
+                        return -1;
+                    }
+                    m_done_before = opaque;
+                    continue;
+                }
+
+                start_response();
+                m_response_len += line_len + 2;
+
+                if (tokens[0].is("VA", 2)) {
+                    // VA <datalen> <flags>*
+                    unsigned long long bytes;
+                    if (count < 2 || !memcache_text_number(tokens[1], 0xffffffffULL - 2, &bytes)) {
+                        benchmark_debug_log("unexpected VA response: %.*s\n", (int) line_len, line);
+                        evbuffer_drain(m_read_buf, line_len + 2);
+                        return -1;
+                    }
+
+                    if (m_keep_value) {
+                        for (unsigned int i = 2; i < count; i++) {
+                            if (tokens[i].m_str[0] == 'k') {
+                                free(m_value_key);
+                                m_value_key_len = tokens[i].m_len - 1;
+                                m_value_key = (char *) malloc(m_value_key_len);
+                                assert(m_value_key != NULL);
+                                memcpy(m_value_key, tokens[i].m_str + 1, m_value_key_len);
+                            }
+                        }
+                    }
+
+                    if (m_last_response.get_status() == NULL)
+                        m_last_response.set_static_status("VA");
+                    m_value_len = (unsigned int) bytes;
+                    evbuffer_drain(m_read_buf, line_len + 2);
+
+                    m_last_response.set_latency(latency);
+                    m_response_state = rs_read_value;
+                    continue;
+                } else if (tokens[0].is("HD", 2)) {
+                    m_last_response.set_static_status("HD");
+                } else if (tokens[0].is("NS", 2)) {
+                    m_last_response.set_static_status("NS");
+                } else if (tokens[0].is("EN", 2)) {
+                    m_last_response.set_static_status("EN");
+                } else {
+                    m_last_response.set_error(true);
+                    benchmark_debug_log("unknown response: %.*s\n", (int) line_len, line);
+                    evbuffer_drain(m_read_buf, line_len + 2);
+                    return -1;
+                }
+
+                evbuffer_drain(m_read_buf, line_len + 2);
+                break;
+            }
+            case rs_read_value:
+                if (evbuffer_get_length(m_read_buf) >= m_value_len + 2) {
+                    if (m_keep_value) {
+                        char *value = (char *) malloc(m_value_len);
+                        assert(value != NULL);
+
+                        int ret = evbuffer_remove(m_read_buf, value, m_value_len);
+                        assert((unsigned int) ret == m_value_len);
+
+                        m_last_response.set_value(value, m_value_len, m_value_key, m_value_key_len);
+                        m_value_key = NULL;
+                        m_value_key_len = 0;
+                    } else {
+                        int ret = evbuffer_drain(m_read_buf, m_value_len);
+                        assert((unsigned int) ret == 0);
+                    }
+
+                    int ret = evbuffer_drain(m_read_buf, 2);
+                    assert((unsigned int) ret == 0);
+
+                    m_last_response.incr_hits();
+                    m_response_len += m_value_len + 2;
+                    m_response_state = rs_initial;
+                } else {
+                    return 0;
+                }
+                break;
+            default:
+                benchmark_debug_log("unknown response state %d.\n", m_response_state);
+                return -1;
+        }
+    }
+
+    return -1;
+}
+
+/////////////////////////////////////////////////////////////////////////
+
 class memcache_binary_protocol : public abstract_protocol {
 protected:
     enum response_state { rs_initial, rs_multi_initial, rs_read_body };
@@ -667,7 +1608,7 @@ public:
     virtual int write_command_get_key(const char *key, int key_len, unsigned int offset);
     virtual int write_command_multi_get(const keylist *keylist);
     virtual int write_command_wait(unsigned int num_slaves, unsigned int timeout);
-    virtual int parse_response(unsigned int latency);
+    virtual int parse_response(uint64_t latency);
 };
 
 int memcache_binary_protocol::select_db(int db)
@@ -732,7 +1673,7 @@ int memcache_binary_protocol::write_command_set(const char *key, int key_len, co
 
     evbuffer_add(m_write_buf, &req, sizeof(req));
     evbuffer_add(m_write_buf, key, key_len);
-    evbuffer_add(m_write_buf, value, value_len);
+    write_value(value, value_len);
 
     return sizeof(req) + key_len + value_len;
 }
@@ -868,7 +1809,7 @@ int memcache_binary_protocol::write_command_wait(unsigned int num_slaves, unsign
     assert(0);
 }
 
-int memcache_binary_protocol::parse_response(unsigned int latency)
+int memcache_binary_protocol::parse_response(uint64_t latency)
 {
     while (true) {
         int ret;
@@ -984,8 +1925,12 @@ class abstract_protocol *protocol_factory(const char *proto_name)
 
     if (strcmp(proto_name, "redis") == 0) {
         return new redis_protocol();
+    } else if (strcmp(proto_name, "redis3") == 0) {
+        return new redis3_protocol();
     } else if (strcmp(proto_name, "memcache_text") == 0) {
         return new memcache_text_protocol();
+    } else if (strcmp(proto_name, "memcache_meta") == 0) {
+        return new memcache_meta_protocol();
     } else if (strcmp(proto_name, "memcache_binary") == 0) {
         return new memcache_binary_protocol();
     } else {
@@ -19,9 +19,13 @@
 #ifndef _PROTOCOL_H
 #define _PROTOCOL_H
 
+#include <stdint.h>
 #include <event2/buffer.h>
 #include <list>
 
+// smaller values are copied even when they could be referenced
+#define PROTOCOL_REFERENCE_MIN_VALUE_LEN    4096
+
 class key_val_node {
 public:
     key_val_node(const char* value, unsigned int value_len, const char* key, unsigned int key_len) :
@@ -35,29 +39,38 @@ public:
 class protocol_response {
 protected:
     const char *m_status;
+    bool m_status_owned;
     std::list<key_val_node> m_values;
-    std::list<unsigned int> m_latencies;
+    std::list<uint64_t> m_latencies;
     const char *m_value;
     unsigned int m_value_len;
     unsigned int m_total_len;
     unsigned int m_hits;
+    unsigned int m_elements;
     bool m_error;
+    bool m_push;
 
 public:
      protocol_response();
      virtual ~protocol_response();
 
      void set_status(const char *status);
+     void set_static_status(const char *status);
      const char *get_status(void);
 
      void set_error(bool error);
      bool is_error(void);
 
+     // a pub/sub message, delivered unsolicited rather than in reply to a
+     // request; its payload is the value
+     void set_push(bool push);
+     bool is_push(void);
+
      void set_value(const char *value, unsigned int value_len , const char* key, unsigned int key_len);
      const char *get_value(unsigned int *value_len, const char** key, unsigned int *key_len);
 
-     void set_latency(unsigned int latency);
-     unsigned int get_latency();
+     void set_latency(uint64_t latency);
+     uint64_t get_latency();
      unsigned int get_latencies_count();
 
      void set_total_len(unsigned int total_len);
@@ -68,6 +81,10 @@ public:
      void incr_hits(void);
      unsigned int get_hits(void);
 
+     // elements of an aggregate (array) reply, at any nesting level
+     void incr_elements(void);
+     unsigned int get_elements(void);
+
      void clear();
 };
 
@@ -106,14 +123,22 @@ protected:
     struct evbuffer* m_write_buf;
 
     bool m_keep_value;
+    bool m_reference_values;
     struct protocol_response m_last_response;
+
+    bool is_referenced_value(unsigned int value_len) const;
+    void write_value(const char *value, unsigned int value_len);
 public:
     abstract_protocol();
     virtual ~abstract_protocol();
     virtual abstract_protocol* clone(void) = 0;
     void set_buffers(struct evbuffer* read_buf, struct evbuffer* write_buf);    
     void set_keep_value(bool flag);
+    void set_reference_values(bool flag);
 
+    // sent first on every connection, if the protocol needs it; returns 0
+    // otherwise.  Credentials, if any, go with it instead of authenticate().
+    virtual int write_command_handshake(const char *credentials) { return 0; }
     virtual int select_db(int db) = 0;
     virtual int authenticate(const char *credentials) = 0;
     virtual int write_command_set(const char *key, int key_len, const char *value, int value_len, int expiry, unsigned int offset) = 0;
@@ -121,7 +146,13 @@ public:
     virtual int write_command_get_key(const char *key, int key_len, unsigned int offset) = 0;
     virtual int write_command_multi_get(const keylist *keylist) = 0;
     virtual int write_command_wait(unsigned int num_slaves, unsigned int timeout) = 0;
-    virtual int parse_response(unsigned int latency) = 0;
+    // pub/sub; once a connection subscribed, messages sent to it are
+    // returned by parse_response() as push responses
+    virtual int write_command_subscribe(const char *channel, int channel_len, bool pattern);
+    virtual int write_command_publish(const char *channel, int channel_len, const char *payload, int payload_len);
+    // called after a batch of requests has been written
+    virtual void write_batch_end(void) { }
+    virtual int parse_response(uint64_t latency) = 0;
 
     struct protocol_response* get_response(void) { return &m_last_response; }
 };
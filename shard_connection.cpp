@@ -0,0 +1,613 @@
+/*
+ * Copyright (C) 2011-2017 Redis Labs Ltd.
+ *
+ * This file is part of memtier_benchmark.
+ *
+ * memtier_benchmark is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * memtier_benchmark is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memtier_benchmark.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+#ifdef HAVE_NETINET_TCP_H
+#include <netinet/tcp.h>
+#endif
+
+#ifdef HAVE_ASSERT_H
+#include <assert.h>
+#endif
+
+#include <sys/uio.h>
+
+#include "shard_connection.h"
+#include "memtier_benchmark.h"
+
+// write buffer chunks handed to a single sendmsg()
+#define CLIENT_WRITE_IOVECS     64
+
+void shard_connection_event_handler(evutil_socket_t sfd, short evtype, void *opaque)
+{
+    shard_connection *conn = (shard_connection *) opaque;
+
+    assert(conn != NULL);
+    assert(conn->get_sockfd() == sfd);
+
+    conn->m_client->m_now = clock_now();
+    conn->handle_event(evtype);
+}
+
+shard_connection::shard_connection(client* owner, struct server_addr* addr, bool addr_owned,
+    const char *name, abstract_protocol* protocol) :
+    m_client(owner), m_name(name), m_server_addr(addr), m_server_addr_owned(addr_owned),
+    m_unix_sockaddr(NULL), m_sockfd(-1), m_event_base(owner->m_event_base),
+    m_event(NULL), m_write_event(NULL), m_write_watched(false),
+    m_read_buf(NULL), m_write_buf(NULL), m_connected(false),
+    m_handshake(handshake_none), m_authentication(auth_none), m_db_selection(select_none),
+    m_protocol(NULL), m_shard_stats(NULL),
+    m_unwritten_requests(0), m_bytes_written(0), m_read_buf_time(0)
+{
+    benchmark_config *config = owner->m_config;
+
+    if (config->unix_socket) {
+        m_unix_sockaddr = (struct sockaddr_un *) malloc(sizeof(struct sockaddr_un));
+        assert(m_unix_sockaddr != NULL);
+
+        m_unix_sockaddr->sun_family = AF_UNIX;
+        strncpy(m_unix_sockaddr->sun_path, config->unix_socket, sizeof(m_unix_sockaddr->sun_path)-1);
+        m_unix_sockaddr->sun_path[sizeof(m_unix_sockaddr->sun_path)-1] = '\0';
+    }
+
+    m_read_buf = evbuffer_new();
+    assert(m_read_buf != NULL);
+
+    m_write_buf = evbuffer_new();
+    assert(m_write_buf != NULL);
+
+    m_protocol = protocol->clone();
+    assert(m_protocol != NULL);
+    m_protocol->set_buffers(m_read_buf, m_write_buf);
+    if (config->value_pool)
+        m_protocol->set_reference_values(true);
+}
+
+shard_connection::~shard_connection()
+{
+    if (m_event != NULL) {
+        event_free(m_event);
+        m_event = NULL;
+    }
+
+    if (m_write_event != NULL) {
+        event_free(m_write_event);
+        m_write_event = NULL;
+    }
+
+    if (m_unix_sockaddr != NULL) {
+        free(m_unix_sockaddr);
+        m_unix_sockaddr = NULL;
+    }
+
+    if (m_read_buf != NULL) {
+        evbuffer_free(m_read_buf);
+        m_read_buf = NULL;
+    }
+
+    if (m_write_buf != NULL) {
+        evbuffer_free(m_write_buf);
+        m_write_buf = NULL;
+    }
+
+    if (m_sockfd != -1) {
+        close(m_sockfd);
+        m_sockfd = -1;
+    }
+
+    if (m_protocol != NULL) {
+        delete m_protocol;
+        m_protocol = NULL;
+    }
+
+    while (!m_pipeline.empty()) {
+        delete m_pipeline.front();
+        m_pipeline.pop_front();
+    }
+
+    if (m_server_addr_owned && m_server_addr != NULL) {
+        delete m_server_addr;
+        m_server_addr = NULL;
+    }
+}
+
+void shard_connection::disconnect(void)
+{
+    if (m_sockfd != -1) {
+        close(m_sockfd);
+        m_sockfd = -1;
+    }
+
+    evbuffer_drain(m_read_buf, evbuffer_get_length(m_read_buf));
+    evbuffer_drain(m_write_buf, evbuffer_get_length(m_write_buf));
+    m_unwritten_requests = 0;
+
+    stop_watching();
+
+    m_connected = false;
+    m_handshake = handshake_none;
+    m_authentication = auth_none;
+    m_db_selection = select_none;
+}
+
+int shard_connection::connect(void)
+{
+    struct connect_info addr;
+
+    // clean up existing socket/buffers
+    if (m_sockfd != -1)
+        close(m_sockfd);
+    evbuffer_drain(m_read_buf, evbuffer_get_length(m_read_buf));
+    evbuffer_drain(m_write_buf, evbuffer_get_length(m_write_buf));
+
+    if (m_unix_sockaddr != NULL) {
+        m_sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (m_sockfd < 0) {
+            return -errno;
+        }
+    } else {
+        if (m_server_addr->get_connect_info(&addr) != 0) {
+            benchmark_error_log("connect: resolve error: %s\n", m_server_addr->get_last_error());
+            return -1;
+        }
+
+        // initialize socket
+        m_sockfd = socket(addr.ci_family, addr.ci_socktype, addr.ci_protocol);
+        if (m_sockfd < 0) {
+            return -errno;
+        }
+
+        // configure socket behavior
+        struct linger ling = {0, 0};
+        int flags = 1;
+        int error = setsockopt(m_sockfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
+        assert(error == 0);
+
+        error = setsockopt(m_sockfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
+        assert(error == 0);
+
+        error = setsockopt(m_sockfd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags, sizeof(flags));
+        assert(error == 0);
+    }
+
+    // set non-blocking behavior
+    int flags = 1;
+    if ((flags = fcntl(m_sockfd, F_GETFL, 0)) < 0 ||
+        fcntl(m_sockfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+            benchmark_error_log("connect: failed to set non-blocking flag.\n");
+            close(m_sockfd);
+            m_sockfd = -1;
+            return -1;
+    }
+
+    // set up events; m_event first waits for the connection to complete
+    if (!m_event) {
+        m_event = event_new(m_event_base,
+            m_sockfd, EV_WRITE, shard_connection_event_handler, (void *)this);
+        assert(m_event != NULL);
+
+        m_write_event = event_new(m_event_base,
+            m_sockfd, EV_WRITE | EV_PERSIST | EV_ET, shard_connection_event_handler, (void *)this);
+        assert(m_write_event != NULL);
+    } else {
+        int ret = event_del(m_event);
+        assert(ret == 0);
+
+        ret = event_assign(m_event, m_event_base,
+            m_sockfd, EV_WRITE, shard_connection_event_handler, (void *)this);
+        assert(ret == 0);
+
+        ret = event_del(m_write_event);
+        assert(ret == 0);
+
+        ret = event_assign(m_write_event, m_event_base,
+            m_sockfd, EV_WRITE | EV_PERSIST | EV_ET, shard_connection_event_handler, (void *)this);
+        assert(ret == 0);
+        m_write_watched = false;
+    }
+
+    int ret = event_add(m_event, NULL);
+    assert(ret == 0);
+
+    // call connect
+    if (::connect(m_sockfd,
+        m_unix_sockaddr ? (struct sockaddr *) m_unix_sockaddr : addr.ci_addr,
+        m_unix_sockaddr ? sizeof(struct sockaddr_un) : addr.ci_addrlen) == -1) {
+        if (errno == EINPROGRESS || errno == EWOULDBLOCK)
+            return 0;
+        benchmark_error_log("connect failed, error = %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+// checks the outcome of a non-blocking connect() and lets the client start
+// (or resume) sending requests; returns false if the connection failed.
+bool shard_connection::complete_connect(void)
+{
+    int error = -1;
+    socklen_t errsz = sizeof(error);
+
+    if (getsockopt(m_sockfd, SOL_SOCKET, SO_ERROR, (void *) &error, &errsz) == -1) {
+        benchmark_error_log("connect: error getting connect response (getsockopt): %s\n", strerror(errno));
+        return false;
+    }
+
+    if (error != 0) {
+        benchmark_error_log("connect: %s: connection failed: %s\n", m_name.c_str(), strerror(error));
+        return false;
+    }
+
+    m_connected = true;
+    m_client->connection_ready(this);
+
+    return true;
+}
+
+void shard_connection::handle_event(short evtype)
+{
+    // connect() returning to us?  normally we expect EV_WRITE, but for UNIX domain
+    // sockets we workaround since connect() returned immediately, but we don't want
+    // to do any I/O from the shard_connection::connect() call...
+    if (!m_connected && (evtype == EV_WRITE || m_unix_sockaddr != NULL)) {
+        // the client can't go on without any of its connections
+        if (!complete_connect()) {
+            m_client->disconnect();
+            return;
+        }
+
+        // from now on the socket stays registered for reading, so events
+        // don't need to be re-armed on every callback
+        int ret = event_assign(m_event, m_event_base,
+            m_sockfd, EV_READ | EV_PERSIST | EV_ET, shard_connection_event_handler, (void *)this);
+        assert(ret == 0);
+
+        ret = event_add(m_event, NULL);
+        assert(ret == 0);
+    }
+
+    assert(m_connected == true);
+    if ((evtype & EV_READ) == EV_READ) {
+        int ret = 1;
+
+        // anything read into an empty buffer starts the next response
+        if (evbuffer_get_length(m_read_buf) == 0)
+            m_read_buf_time = m_client->m_now;
+
+        // edge-triggered: read until the socket is drained
+        while (ret > 0) {
+            ret = evbuffer_read(m_read_buf, m_sockfd, -1);
+        }
+
+        if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            benchmark_error_log("read error: %s\n", strerror(errno));
+            m_client->disconnect();
+
+            return;
+        }
+        if (ret == 0) {
+            benchmark_error_log("connection dropped.\n");
+            m_client->disconnect();
+
+            return;
+        }
+
+        if (evbuffer_get_length(m_read_buf) > 0) {
+            process_response();
+
+            // process_response may have disconnected, in which case
+            // we just abort and wait for libevent to call us back sometime
+            if (!m_connected) {
+                return;
+            }
+        }
+    }
+
+    if (m_client->stop_if_finished())
+        return;
+
+    // responses may have led to requests on any of the client's connections
+    m_client->write_pending();
+}
+
+void shard_connection::stop_watching(void)
+{
+    if (m_event != NULL) {
+        int ret = event_del(m_event);
+        assert(ret == 0);
+    }
+
+    if (m_write_event != NULL) {
+        int ret = event_del(m_write_event);
+        assert(ret == 0);
+    }
+    m_write_watched = false;
+}
+
+// the part of m_write_buf that may be written now.  at most --pipeline
+// requests are in flight on a connection; the requests queued after them
+// stay in the buffer until responses make room for them.
+size_t shard_connection::get_writable_length(void)
+{
+    size_t len = evbuffer_get_length(m_write_buf);
+    unsigned int depth = m_client->m_config->pipeline;
+
+    if (m_pipeline.size() > depth) {
+        // anything written between two requests (e.g. a batch end) goes
+        // out with the request before it
+        client::request *next = m_pipeline[depth];
+        uint64_t next_start = next->m_write_end - next->m_size;
+
+        if (next_start <= m_bytes_written)
+            return 0;
+        if (next_start - m_bytes_written < len)
+            len = next_start - m_bytes_written;
+    }
+
+    return len;
+}
+
+// writes as much of m_write_buf as the socket (and the pipeline depth)
+// takes, right away rather than on the next EV_WRITE, and watches the
+// socket for writing only when a write comes up short.
+void shard_connection::write_pending(void)
+{
+    struct evbuffer_iovec chunks[CLIENT_WRITE_IOVECS];
+    struct iovec iov[CLIENT_WRITE_IOVECS];
+    size_t writable;
+
+    // requests for a connection still being set up wait in its buffer
+    if (!m_connected)
+        return;
+
+    while ((writable = get_writable_length()) > 0) {
+        int n = evbuffer_peek(m_write_buf, writable, NULL, chunks, CLIENT_WRITE_IOVECS);
+        if (n > CLIENT_WRITE_IOVECS)
+            n = CLIENT_WRITE_IOVECS;
+
+        size_t len = 0;
+        for (int i = 0; i < n; i++) {
+            iov[i].iov_base = chunks[i].iov_base;
+            iov[i].iov_len = chunks[i].iov_len;
+            if (iov[i].iov_len > writable - len)
+                iov[i].iov_len = writable - len;
+            len += iov[i].iov_len;
+        }
+
+        // more chunks than fit in one call: let the kernel hold a short
+        // segment back until the rest follows
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        int flags = MSG_NOSIGNAL;
+        if (len < writable)
+            flags |= MSG_MORE;
+
+        ssize_t ret = sendmsg(m_sockfd, &msg, flags);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EWOULDBLOCK && errno != EAGAIN) {
+                benchmark_error_log("write error: %s\n", strerror(errno));
+                m_client->disconnect();
+
+                return;
+            }
+            break;
+        }
+
+        evbuffer_drain(m_write_buf, ret);
+        requests_written(ret);
+
+        // socket buffer full
+        if ((size_t) ret < len)
+            break;
+    }
+
+    bool pending = get_writable_length() > 0;
+    if (pending != m_write_watched) {
+        int ret = pending ? event_add(m_write_event, NULL) : event_del(m_write_event);
+        assert(ret == 0);
+        m_write_watched = pending;
+    }
+}
+
+void shard_connection::push_request(client::request *req)
+{
+    // everything still in the write buffer goes out before this request ends
+    req->m_write_end = m_bytes_written + evbuffer_get_length(m_write_buf);
+
+    m_pipeline.push_back(req);
+    m_unwritten_requests++;
+}
+
+// accounts for bytes written to the socket, and stamps the requests
+// they completed
+void shard_connection::requests_written(unsigned int bytes)
+{
+    m_bytes_written += bytes;
+    while (m_unwritten_requests > 0) {
+        client::request *req = m_pipeline[m_pipeline.size() - m_unwritten_requests];
+        if (req->m_write_end > m_bytes_written)
+            break;
+
+        req->m_write_time = m_client->m_now;
+        m_unwritten_requests--;
+    }
+}
+
+bool shard_connection::send_conn_setup_commands(uint64_t timestamp)
+{
+    benchmark_config *config = m_client->m_config;
+    bool sent = false;
+
+    if (m_handshake == handshake_none) {
+        if (m_protocol->write_command_handshake(config->authenticate) > 0) {
+            benchmark_debug_log("sending protocol handshake.\n");
+            push_request(new client::request(client::rt_handshake, 0, timestamp, 0));
+            m_handshake = handshake_sent;
+            // credentials went with the handshake
+            if (config->authenticate)
+                m_authentication = auth_sent;
+            sent = true;
+        } else {
+            m_handshake = handshake_done;
+        }
+    }
+    if (config->authenticate && m_authentication != auth_done) {
+        if (m_authentication == auth_none) {
+            benchmark_debug_log("sending authentication command.\n");
+            m_protocol->authenticate(config->authenticate);
+            push_request(new client::request(client::rt_auth, 0, timestamp, 0));
+            m_authentication = auth_sent;
+            sent = true;
+        }
+    }
+    if (config->select_db && m_db_selection != select_done) {
+        if (m_db_selection == select_none) {
+            benchmark_debug_log("sending db selection command.\n");
+            m_protocol->select_db(config->select_db);
+            push_request(new client::request(client::rt_select_db, 0, timestamp, 0));
+            m_db_selection = select_sent;
+            sent = true;
+        }
+    }
+
+    return sent;
+}
+
+bool shard_connection::is_conn_setup_done(void)
+{
+     benchmark_config *config = m_client->m_config;
+
+     if (m_handshake != handshake_done)
+         return false;
+     if (config->authenticate && m_authentication != auth_done)
+         return false;
+     if (config->select_db && m_db_selection != select_done)
+         return false;
+     return true;
+}
+
+void shard_connection::process_response(void)
+{
+    int ret;
+    bool responses_handled = false;
+
+    uint64_t now = m_client->m_now;
+    unsigned int depth = m_client->m_config->pipeline;
+
+    client::request* req;
+
+    // the first response may have started arriving in an earlier read, any
+    // response following it was read by this callback.  The pipeline may
+    // be empty when out-of-band data (RESP3 pushes) arrives.
+    if (!m_pipeline.empty())
+        m_pipeline.front()->m_first_byte_time = m_read_buf_time;
+
+    while ((ret = m_protocol->parse_response(m_pipeline.empty() ? 0 : now - m_pipeline.front()->m_sent_time)) > 0) {
+        bool error = false;
+        protocol_response *r = m_protocol->get_response();
+
+        // pub/sub messages are not replies to any request
+        if (r->is_push()) {
+            m_client->handle_message(now, r);
+            continue;
+        }
+
+        if (m_pipeline.empty()) {
+            benchmark_error_log("error: response received with no request outstanding.\n");
+            return;
+        }
+        req = m_pipeline.front();
+        m_pipeline.pop_front();
+        if (m_unwritten_requests > m_pipeline.size())
+            m_unwritten_requests = m_pipeline.size();
+
+        // the request that now fits in the pipeline is sent only now; when
+        // not rate limited, the time it was queued is not its latency
+        if (m_pipeline.size() >= depth && m_client->m_rate_interval == 0)
+            m_pipeline[depth - 1]->m_sent_time = now;
+        if (!m_pipeline.empty())
+            m_pipeline.front()->m_first_byte_time = now;
+        m_read_buf_time = now;
+
+        if (req->m_type == client::rt_handshake) {
+            if (r->is_error()) {
+                benchmark_error_log("error: protocol handshake failed [%s]\n", r->get_status());
+                error = true;
+            } else {
+                m_handshake = handshake_done;
+                if (m_client->m_config->authenticate)
+                    m_authentication = auth_done;
+                benchmark_debug_log("protocol handshake successful.\n");
+            }
+        } else if (req->m_type == client::rt_auth) {
+            if (r->is_error()) {
+                benchmark_error_log("error: authentication failed [%s]\n", r->get_status());
+                error = true;
+            } else {
+                m_authentication = auth_done;
+                benchmark_debug_log("authentication successful.\n");
+            }
+        } else if (req->m_type == client::rt_select_db) {
+           if (strcmp(r->get_status(), "+OK") != 0) {
+                benchmark_error_log("database selection failed.\n");
+                error = true;
+            } else {
+                benchmark_debug_log("database selection successful.\n");
+                m_db_selection = select_done;
+            }
+        } else if (req->m_type == client::rt_asking) {
+            benchmark_debug_log("%s: ASKING: %s\n", m_name.c_str(), r->get_status());
+        } else {
+            // the request may have been handed over to another connection
+            if (!m_client->process_reply(this, req, r))
+                continue;
+            responses_handled = true;
+        }
+        delete req;
+        if (error) {
+            return;
+        }
+    }
+
+    if (ret == -1) {
+        benchmark_error_log("error: response parsing failed.\n");
+    }
+
+    m_client->responses_processed(responses_handled);
+}
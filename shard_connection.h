@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2011-2017 Redis Labs Ltd.
+ *
+ * This file is part of memtier_benchmark.
+ *
+ * memtier_benchmark is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * memtier_benchmark is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memtier_benchmark.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SHARD_CONNECTION_H
+#define _SHARD_CONNECTION_H
+
+#include <string>
+#include <deque>
+#include <sys/un.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+
+#include "client.h"
+
+/*
+ * A connection of a client to one server.  A client normally has a single
+ * connection; in cluster mode it has one per node, and sends every request
+ * on the connection of the node that owns its key.
+ *
+ * The connection owns the socket, its buffers, its protocol instance (the
+ * parser state is per connection) and the requests that were sent on it
+ * and await a response.  Requests themselves are created, and responses
+ * accounted for, by the client.
+ */
+class shard_connection {
+    friend void shard_connection_event_handler(evutil_socket_t sfd, short evtype, void *opaque);
+    friend class client;
+    friend class io_uring_engine;
+protected:
+    client* m_client;
+    std::string m_name;                 // host:port, for per-shard stats
+    struct server_addr* m_server_addr;  // NULL for a UNIX socket
+    bool m_server_addr_owned;
+    struct sockaddr_un* m_unix_sockaddr;
+
+    int m_sockfd;
+    struct event_base* m_event_base;
+    struct event* m_event;              // connect completion, then persistent read interest
+    struct event* m_write_event;        // persistent write interest, added while the socket is full
+    bool m_write_watched;               // m_write_event is added
+    struct evbuffer *m_read_buf;
+    struct evbuffer *m_write_buf;
+    bool m_connected;
+    enum handshake_state { handshake_none, handshake_sent, handshake_done } m_handshake;
+    enum authentication_state { auth_none, auth_sent, auth_done } m_authentication;
+    enum select_db_state { select_none, select_sent, select_done } m_db_selection;
+
+    abstract_protocol* m_protocol;
+    run_stats::shard_stats* m_shard_stats;     // NULL unless per-shard stats are kept
+
+    std::deque<client::request *> m_pipeline;  // requests written, or waiting in m_write_buf, not answered yet
+    unsigned int m_unwritten_requests;  // requests at the back of m_pipeline not yet fully written
+    uint64_t m_bytes_written;           // bytes written to the socket since connecting
+    uint64_t m_read_buf_time;           // when the oldest unparsed byte in m_read_buf was read
+
+    bool complete_connect(void);
+    void handle_event(short evtype);
+    void process_response(void);
+    int get_sockfd(void) { return m_sockfd; }
+public:
+    shard_connection(client* owner, struct server_addr* addr, bool addr_owned, const char *name,
+        abstract_protocol* protocol);
+    ~shard_connection();
+
+    const char* get_name(void) { return m_name.c_str(); }
+    abstract_protocol* get_protocol(void) { return m_protocol; }
+    void set_shard_stats(run_stats::shard_stats* stats) { m_shard_stats = stats; }
+
+    int connect(void);
+    void disconnect(void);
+    bool is_connected(void) { return m_connected; }
+    void stop_watching(void);
+    void write_pending(void);
+    size_t get_writable_length(void);
+    bool has_pending_writes(void) { return get_writable_length() > 0; }
+    unsigned int get_queued_requests(void) { return m_pipeline.size(); }
+
+    void push_request(client::request* req);
+    void requests_written(unsigned int bytes);
+    bool send_conn_setup_commands(uint64_t timestamp);
+    bool is_conn_setup_done(void);
+};
+
+#endif /* _SHARD_CONNECTION_H */
@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2011-2017 Redis Labs Ltd.
+ *
+ * This file is part of memtier_benchmark.
+ *
+ * memtier_benchmark is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * memtier_benchmark is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memtier_benchmark.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#ifdef HAVE_ASSERT_H
+#include <assert.h>
+#endif
+
+#include "stats_stream.h"
+#include "clock_source.h"
+
+stats_stream::stats_stream() :
+    m_file(NULL), m_ndjson(false)
+{
+}
+
+stats_stream::~stats_stream()
+{
+    if (m_file != NULL) {
+        fclose(m_file);
+        m_file = NULL;
+    }
+}
+
+bool stats_stream::open(const char *filename, const char *format, const std::vector<float>& quantiles)
+{
+    assert(m_file == NULL);
+
+    m_file = fopen(filename, "w");
+    if (!m_file) {
+        perror(filename);
+        return false;
+    }
+
+    m_ndjson = strcmp(format, "ndjson") == 0;
+    m_quantiles = quantiles;
+
+    if (!m_ndjson)
+        write_csv_header();
+
+    return true;
+}
+
+// both formats carry the same fields under the same names: a CSV column
+// is named after the type and the NDJSON key, e.g. "Gets p99.00"
+static const char *stream_types[] = { "Sets", "Gets", "Waits" };
+static const char *stream_fields[] = { "Count", "Bytes", "Average Latency", "Max Latency" };
+#define QUANTILE_FORMAT "p%.2f"
+
+void stats_stream::write_csv_header(void)
+{
+    fprintf(m_file, "Run,Second,Interval (usec)");
+    for (unsigned int t = 0; t < sizeof(stream_types) / sizeof(stream_types[0]); t++) {
+        for (unsigned int f = 0; f < sizeof(stream_fields) / sizeof(stream_fields[0]); f++) {
+            fprintf(m_file, ",%s %s", stream_types[t], stream_fields[f]);
+        }
+        for (std::vector<float>::const_iterator i = m_quantiles.begin(); i != m_quantiles.end(); i++) {
+            fprintf(m_file, ",%s " QUANTILE_FORMAT, stream_types[t], *i);
+        }
+    }
+    fprintf(m_file, ",Hits,Misses\n");
+    fflush(m_file);
+}
+
+void stats_stream::write_csv_type(unsigned long int ops, unsigned long int bytes, unsigned long long int total_latency,
+                                  const latency_histogram& histogram)
+{
+    fprintf(m_file, ",%lu,%lu,%.3f,%.3f",
+            ops, bytes, ops > 0 ? (double) total_latency / ops / NSEC_PER_MSEC : 0.0,
+            histogram.get_max() / (double) NSEC_PER_MSEC);
+    for (std::vector<float>::const_iterator i = m_quantiles.begin(); i != m_quantiles.end(); i++) {
+        fprintf(m_file, ",%.3f", histogram.value_at_percentile(*i) / (double) NSEC_PER_MSEC);
+    }
+}
+
+void stats_stream::write_ndjson_type(const char *type, unsigned long int ops, unsigned long int bytes,
+                                     unsigned long long int total_latency, const latency_histogram& histogram)
+{
+    fprintf(m_file, ",\"%s\":{\"%s\":%lu,\"%s\":%lu,\"%s\":%.3f,\"%s\":%.3f", type,
+            stream_fields[0], ops, stream_fields[1], bytes,
+            stream_fields[2], ops > 0 ? (double) total_latency / ops / NSEC_PER_MSEC : 0.0,
+            stream_fields[3], histogram.get_max() / (double) NSEC_PER_MSEC);
+    for (std::vector<float>::const_iterator i = m_quantiles.begin(); i != m_quantiles.end(); i++) {
+        fprintf(m_file, ",\"" QUANTILE_FORMAT "\":%.3f", *i, histogram.value_at_percentile(*i) / (double) NSEC_PER_MSEC);
+    }
+    fprintf(m_file, "}");
+}
+
+void stats_stream::write_interval(unsigned int run_id, unsigned int second, unsigned long int interval_usec,
+                                  const live_stats_interval& interval)
+{
+    if (m_file == NULL)
+        return;
+
+    if (m_ndjson) {
+        fprintf(m_file, "{\"Run\":%u,\"Second\":%u,\"Interval (usec)\":%lu", run_id, second, interval_usec);
+        write_ndjson_type(stream_types[0], interval.m_ops_set, interval.m_bytes_set,
+                          interval.m_total_set_latency, interval.m_set_latency_histogram);
+        write_ndjson_type(stream_types[1], interval.m_ops_get, interval.m_bytes_get,
+                          interval.m_total_get_latency, interval.m_get_latency_histogram);
+        write_ndjson_type(stream_types[2], interval.m_ops_wait, 0,
+                          interval.m_total_wait_latency, interval.m_wait_latency_histogram);
+        fprintf(m_file, ",\"Hits\":%lu,\"Misses\":%lu}\n",
+                (unsigned long) interval.m_get_hits, (unsigned long) interval.m_get_misses);
+    } else {
+        fprintf(m_file, "%u,%u,%lu", run_id, second, interval_usec);
+        write_csv_type(interval.m_ops_set, interval.m_bytes_set,
+                       interval.m_total_set_latency, interval.m_set_latency_histogram);
+        write_csv_type(interval.m_ops_get, interval.m_bytes_get,
+                       interval.m_total_get_latency, interval.m_get_latency_histogram);
+        write_csv_type(interval.m_ops_wait, 0,
+                       interval.m_total_wait_latency, interval.m_wait_latency_histogram);
+        fprintf(m_file, ",%lu,%lu\n",
+                (unsigned long) interval.m_get_hits, (unsigned long) interval.m_get_misses);
+    }
+
+    fflush(m_file);
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2011-2017 Redis Labs Ltd.
+ *
+ * This file is part of memtier_benchmark.
+ *
+ * memtier_benchmark is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * memtier_benchmark is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memtier_benchmark.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _STATS_STREAM_H
+#define _STATS_STREAM_H
+
+#include <stdio.h>
+#include <vector>
+
+#include "live_stats.h"
+
+/*
+ * Appends one line per reporting interval to a file while the test is
+ * running, either as CSV or as newline delimited JSON.  Every line is
+ * flushed as soon as it is written, so the file can be followed during a
+ * long run and is complete up to the last interval if the run is aborted.
+ */
+class stats_stream {
+protected:
+    FILE *m_file;
+    bool m_ndjson;
+    std::vector<float> m_quantiles;
+
+    void write_csv_header(void);
+    void write_csv_type(unsigned long int ops, unsigned long int bytes, unsigned long long int total_latency,
+                        const latency_histogram& histogram);
+    void write_ndjson_type(const char *type, unsigned long int ops, unsigned long int bytes,
+                           unsigned long long int total_latency, const latency_histogram& histogram);
+public:
+    stats_stream();
+    ~stats_stream();
+
+    // format is either "csv" or "ndjson"
+    bool open(const char *filename, const char *format, const std::vector<float>& quantiles);
+    void write_interval(unsigned int run_id, unsigned int second, unsigned long int interval_usec,
+                        const live_stats_interval& interval);
+};
+
+#endif /* _STATS_STREAM_H */